@@ -0,0 +1,250 @@
+﻿#pragma once
+
+#include <QVariant>
+#include <QDateTime>
+
+// Атрибут сигнала хранится в поле m_<name>
+#define ATTRIBUTE(type,name) \
+   type get_##name() const { return m_##name; }\
+   void set_##name(const type &a_value) { m_##name = a_value; }\
+   type m_##name{}
+
+// используется в visitAttributes сигнала, порядок вызовов задает схему компактного формата
+#define VISIT_ATTRIBUTE(name) a_visitor(#name, a_signal.m_##name)
+
+// Прежний формат сигналов: значения атрибутов по их именам.
+struct AttributeContainer
+{
+    AttributeContainer() {}
+
+    explicit AttributeContainer(const QVariant &a_value)
+    {
+        m_container = a_value.toMap();
+    }
+
+    QVariant toQVariant() const
+    {
+        return m_container;
+    }
+
+    QMap<QString, QVariant> m_container;
+};
+
+// Запись атрибутов в компактном формате.
+// Целые числа записываются в формате varint, строки - в UTF-8 с предшествующей длиной.
+class AttributeWriter
+{
+public:
+    explicit AttributeWriter(QByteArray &a_data) : m_data(a_data) {}
+
+    void writeByte(quint8 a_value)
+    {
+        m_data.append(char(a_value));
+    }
+
+    void write(bool a_value)
+    {
+        writeByte(a_value ? 1 : 0);
+    }
+
+    void write(size_t a_value)
+    {
+        writeNumber(a_value);
+    }
+
+    void write(const QString &a_value)
+    {
+        write(a_value.toUtf8());
+    }
+
+    void write(const QByteArray &a_value)
+    {
+        writeNumber(a_value.size());
+        m_data.append(a_value);
+    }
+
+    void write(const QDateTime &a_value)
+    {
+        write(a_value.isValid());
+        if (!a_value.isValid())
+            return;
+        // знак переносится в младший бит, чтобы даты до 1970 года тоже были короткими
+        auto value = a_value.toMSecsSinceEpoch();
+        writeNumber((quint64(value) << 1) ^ quint64(value >> 63));
+    }
+
+private:
+    void writeNumber(quint64 a_value)
+    {
+        do
+        {
+            quint8 byte = a_value & 0x7f;
+            a_value >>= 7;
+            writeByte(a_value != 0 ? byte | 0x80 : byte);
+        }
+        while (a_value != 0);
+    }
+
+    QByteArray &m_data;
+};
+
+// Чтение атрибутов в компактном формате без промежуточных копий.
+class AttributeReader
+{
+public:
+    explicit AttributeReader(const QByteArray &a_data) :
+        m_position(a_data.constData()),
+        m_end(a_data.constData() + a_data.size())
+    {
+    }
+
+    bool isValid() const
+    {
+        return m_valid;
+    }
+
+    bool atEnd() const
+    {
+        return m_position == m_end;
+    }
+
+    quint8 readByte()
+    {
+        auto data = take(1);
+        return data != nullptr ? *data : 0;
+    }
+
+    void read(bool &a_value)
+    {
+        a_value = readByte() != 0;
+    }
+
+    void read(size_t &a_value)
+    {
+        a_value = readNumber();
+    }
+
+    void read(QString &a_value)
+    {
+        auto size = readNumber();
+        auto data = take(size);
+        a_value = data != nullptr ? QString::fromUtf8(data, size) : QString();
+    }
+
+    void read(QByteArray &a_value)
+    {
+        auto size = readNumber();
+        auto data = take(size);
+        a_value = data != nullptr ? QByteArray(data, size) : QByteArray();
+    }
+
+    void read(QDateTime &a_value)
+    {
+        if (readByte() == 0)
+        {
+            a_value = QDateTime();
+            return;
+        }
+        auto value = readNumber();
+        a_value = QDateTime::fromMSecsSinceEpoch(qint64(value >> 1) ^ -qint64(value & 1));
+    }
+
+private:
+    quint64 readNumber()
+    {
+        quint64 result = 0;
+        for (int shift = 0; shift < 64; shift += 7)
+        {
+            auto byte = readByte();
+            result |= quint64(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+                return result;
+        }
+        m_valid = false;
+        return 0;
+    }
+
+    const char *take(quint64 a_size)
+    {
+        if (!m_valid || quint64(m_end - m_position) < a_size)
+        {
+            m_valid = false;
+            return nullptr;
+        }
+        auto result = m_position;
+        m_position += a_size;
+        return result;
+    }
+
+    const char *m_position;
+    const char *m_end;
+    bool m_valid = true;
+};
+
+// Сигнал с атрибутами, перечисленными в статическом методе T::visitAttributes.
+// Передается в компактном формате: байт версии и значения атрибутов в порядке схемы, без имен.
+// Сигналы в формате AttributeContainer также принимаются, а узлам прежних версий передаются в нем (toLegacyQVariant).
+template<typename T> struct AttributeSignal
+{
+    static constexpr quint8 g_formatVersion = 1;
+
+    bool isValid() const
+    {
+        return m_valid;
+    }
+
+    QVariant toQVariant() const
+    {
+        QByteArray result;
+        AttributeWriter writer(result);
+        writer.writeByte(g_formatVersion);
+        T::visitAttributes(static_cast<const T &>(*this), [&writer](const char *, auto &a_value)
+            {
+                writer.write(a_value);
+            });
+        return result;
+    }
+
+    // значения атрибутов по именам (AttributeContainer)
+    QVariant toLegacyQVariant() const
+    {
+        AttributeContainer container;
+        T::visitAttributes(static_cast<const T &>(*this), [&container](const char *a_name, auto &a_value)
+            {
+                container.m_container[a_name] = QVariant::fromValue(a_value);
+            });
+        return container.toQVariant();
+    }
+
+protected:
+    void fromQVariant(const QVariant &a_value)
+    {
+        auto &signal = static_cast<T &>(*this);
+        if (a_value.typeId() != QMetaType::QByteArray)
+        {
+            AttributeContainer container(a_value);
+            T::visitAttributes(signal, [&container](const char *a_name, auto &a_value)
+                {
+                    a_value = container.m_container.value(a_name).template value<std::remove_reference_t<decltype(a_value)>>();
+                });
+            return;
+        }
+        auto data = a_value.toByteArray();
+        AttributeReader reader(data);
+        if (reader.readByte() != g_formatVersion)
+        {
+            m_valid = false;
+            return;
+        }
+        // атрибуты, добавленные в конец схемы, в сигналах прежних версий отсутствуют и остаются по умолчанию
+        T::visitAttributes(signal, [&reader](const char *, auto &a_value)
+            {
+                if (!reader.atEnd())
+                    reader.read(a_value);
+            });
+        m_valid = reader.isValid();
+    }
+
+private:
+    bool m_valid = true;
+};
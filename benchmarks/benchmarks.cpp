@@ -0,0 +1,384 @@
+﻿#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QFile>
+#include <QTextStream>
+#include <QUuid>
+#include "signaling.h"
+#include "signaling_protocol.h"
+#include "attribute_signal.h"
+
+// Микробенчмарки горячих путей сигнализации: разбор потока на сообщения, кодирование и разбор
+// сигналов протокола, атрибуты сигналов и рассылка подписчикам.
+// Результаты выводятся в формате JSON в файл, заданный параметром -o, или в стандартный вывод.
+
+namespace
+{
+    struct Result
+    {
+        QString m_name;
+        quint64 m_iterations = 0;
+        double m_nsPerOperation = 0;
+        qint64 m_bytesPerOperation = 0; // 0 - пропускная способность не вычисляется
+    };
+
+    // минимальное время измерения одного бенчмарка, мс
+    qint64 g_minTime = 500;
+    // результаты операций накапливаются, чтобы компилятор не удалил вычисления
+    volatile quint64 g_sink = 0;
+
+    // операция повторяется сериями удваивающейся длины, пока серия не займет g_minTime
+    template<typename F> Result measure(const QString &a_name, qint64 a_bytesPerOperation, F &&a_operation)
+    {
+        a_operation();
+        quint64 iterations = 1;
+        QElapsedTimer timer;
+        for (;;)
+        {
+            timer.start();
+            for (quint64 i = 0; i < iterations; i++)
+                a_operation();
+            auto elapsed = timer.nsecsElapsed();
+            if (elapsed >= g_minTime * 1000000 || iterations >= (1ull << 40))
+                return Result{ a_name, iterations, double(elapsed) / iterations, a_bytesPerOperation };
+            iterations *= 2;
+        }
+    }
+
+    QByteArray getRandomData(qsizetype a_size)
+    {
+        QByteArray result(a_size, Qt::Uninitialized);
+        for (auto &byte : result)
+            byte = char(QRandomGenerator::global()->bounded(256));
+        return result;
+    }
+
+    // текст, который сжимается так же, как сообщения чата
+    QString getText(qsizetype a_size)
+    {
+        static const QStringList words{ "привет", "файл", "сообщение", "hello", "transfer", "ok", "готово", "2024" };
+        QString result;
+        while (result.size() < a_size)
+            result += words[QRandomGenerator::global()->bounded(words.size())] + ' ';
+        return result.left(a_size);
+    }
+
+    // Сокет, отбрасывающий записываемые данные: рассылка измеряется без сети
+    class NullSocket : public QTcpSocket
+    {
+    public:
+        NullSocket()
+        {
+            setOpenMode(QIODevice::ReadWrite);
+        }
+
+    protected:
+        qint64 writeData(const char *, qint64 a_size) override
+        {
+            g_sink = g_sink + a_size;
+            return a_size;
+        }
+    };
+
+    //-------------------------------------------------------------------------------------------------
+    // Сигналы с теми же наборами атрибутов, что и сигналы приложения
+    struct TextSignal : AttributeSignal<TextSignal>
+    {
+        ATTRIBUTE(QString, sender);
+        ATTRIBUTE(QString, text);
+
+        TextSignal(const QString &a_sender, const QString &a_text)
+        {
+            set_sender(a_sender);
+            set_text(a_text);
+        }
+
+        explicit TextSignal(const QVariant &a_value)
+        {
+            fromQVariant(a_value);
+        }
+
+        template<typename S, typename V> static void visitAttributes(S &a_signal, V &&a_visitor)
+        {
+            VISIT_ATTRIBUTE(sender);
+            VISIT_ATTRIBUTE(text);
+        }
+    };
+
+    struct FileSignal : AttributeSignal<FileSignal>
+    {
+        ATTRIBUTE(QString, id);
+        ATTRIBUTE(QString, name);
+        ATTRIBUTE(size_t, size);
+        ATTRIBUTE(QDateTime, date);
+        ATTRIBUTE(bool, sending);
+        ATTRIBUTE(QByteArray, hash);
+
+        FileSignal() {}
+
+        explicit FileSignal(const QVariant &a_value)
+        {
+            fromQVariant(a_value);
+        }
+
+        template<typename S, typename V> static void visitAttributes(S &a_signal, V &&a_visitor)
+        {
+            VISIT_ATTRIBUTE(id);
+            VISIT_ATTRIBUTE(name);
+            VISIT_ATTRIBUTE(size);
+            VISIT_ATTRIBUTE(date);
+            VISIT_ATTRIBUTE(sending);
+            VISIT_ATTRIBUTE(hash);
+        }
+    };
+}
+
+//-------------------------------------------------------------------------------------------------
+class SignalingBenchmark
+{
+public:
+    void run()
+    {
+        benchmarkFraming();
+        benchmarkEncoding();
+        benchmarkDecoding();
+        benchmarkAttributes();
+        benchmarkRouting();
+    }
+
+    QJsonDocument getReport() const
+    {
+        QJsonArray benchmarks;
+        for (auto &result : m_results)
+        {
+            QJsonObject benchmark;
+            benchmark["name"] = result.m_name;
+            benchmark["iterations"] = double(result.m_iterations);
+            benchmark["ns_per_op"] = result.m_nsPerOperation;
+            if (result.m_bytesPerOperation != 0)
+            {
+                benchmark["bytes_per_op"] = double(result.m_bytesPerOperation);
+                benchmark["mb_per_s"] = result.m_bytesPerOperation * 1000.0 / result.m_nsPerOperation;
+            }
+            benchmarks.append(benchmark);
+        }
+        QJsonObject report;
+        report["qt_version"] = qVersion();
+        report["min_time_ms"] = double(g_minTime);
+        report["benchmarks"] = benchmarks;
+        return QJsonDocument(report);
+    }
+
+private:
+    // Поток из сообщений разных размеров, поступающий частями, как из сокета
+    void benchmarkFraming()
+    {
+        static const qsizetype messageSizes[]{ 16, 64, 300, 1024, 16 * 1024 + 16 };
+        QByteArray stream;
+        for (int i = 0; i < 1000; i++)
+        {
+            auto size = messageSizes[QRandomGenerator::global()->bounded((int)std::size(messageSizes))];
+            stream.append(MessageQueue::createMessage(getRandomData(size)));
+        }
+
+        auto split = [&stream](auto a_getFragmentSize)
+            {
+                std::vector<QByteArray> fragments;
+                for (qsizetype position = 0; position < stream.size();)
+                {
+                    auto size = std::min<qsizetype>(a_getFragmentSize(), stream.size() - position);
+                    fragments.push_back(stream.mid(position, size));
+                    position += size;
+                }
+                return fragments;
+            };
+        std::pair<QString, std::vector<QByteArray>> patterns[]{
+            { "whole", { stream } },
+            { "mss_1460", split([] { return 1460; }) },
+            { "read_64k", split([] { return 64 * 1024; }) },
+            { "random_1_4096", split([] { return QRandomGenerator::global()->bounded(1, 4097); }) },
+            { "tiny_1_16", split([] { return QRandomGenerator::global()->bounded(1, 17); }) }
+        };
+        for (auto &pattern : patterns)
+        {
+            auto &fragments = pattern.second;
+            m_results.push_back(measure("framing/" + pattern.first, stream.size(), [&fragments]
+                {
+                    MessageQueue queue;
+                    for (auto &fragment : fragments)
+                    {
+                        queue.appendRawData(fragment);
+                        while (queue.messageIsReady())
+                            g_sink = g_sink + queue.takeMessage().size();
+                    }
+                }));
+        }
+    }
+
+    template<typename T> void benchmarkEncoding(const QString &a_name, const T &a_signal)
+    {
+        auto size = signalToByteArray(a_signal).size();
+        m_results.push_back(measure("encode/" + a_name, size, [&a_signal]
+            {
+                g_sink = g_sink + signalToByteArray(a_signal).size();
+            }));
+    }
+
+    void benchmarkEncoding()
+    {
+        auto topicName = "Message_" + QUuid::createUuid().toString(QUuid::WithoutBraces);
+        benchmarkEncoding("data", TopicDataSignal(1, TextSignal("sender", getText(100)).toQVariant()));
+        benchmarkEncoding("subscribe", SubscribeSignal(topicName));
+        benchmarkEncoding("unsubscribe", UnsubscribeSignal(topicName));
+        benchmarkEncoding("topic", TopicSignal(topicName, 1));
+        benchmarkEncoding("keep_alive", KeepAliveSignal());
+        benchmarkEncoding("bulk_chunk", BulkChunkSignal(false, getRandomData(16 * 1024)));
+        benchmarkEncoding("capabilities", CapabilitiesSignal(CapabilitiesSignal::Compression));
+        benchmarkEncoding("compressed", CompressedSignal(qCompress(getText(4096).toUtf8(), 1)));
+    }
+
+    // разбор сообщения вместе с выбором обработчика в Signaling::handleMessage
+    void benchmarkDecoding(Signaling &a_signaling, QTcpSocket *a_peer, const QString &a_name, const QByteArray &a_message)
+    {
+        auto body = a_message.mid(sizeof(MessageQueue::MessageSize));
+        m_results.push_back(measure("decode/" + a_name, body.size(), [&a_signaling, a_peer, &body]
+            {
+                a_signaling.handleMessage(a_peer, body);
+            }));
+    }
+
+    void benchmarkDecoding()
+    {
+        Signaling signaling;
+        NullSocket peer;
+        auto topicName = "Message_" + QUuid::createUuid().toString(QUuid::WithoutBraces);
+        // тема узла 1 соответствует теме, на которую подписан этот узел, поэтому данные доходят до обработчика
+        signaling.subscribe(topicName, &signaling, [](const QVariant &a_value, QTcpSocket *)
+            {
+                g_sink = g_sink + a_value.isValid();
+            });
+        signaling.handleMessage(&peer, signalToByteArray(TopicSignal(topicName, 1)).mid(sizeof(MessageQueue::MessageSize)));
+        auto data = signalToByteArray(TopicDataSignal(1, TextSignal("sender", getText(100)).toQVariant()));
+
+        benchmarkDecoding(signaling, &peer, "data", data);
+        benchmarkDecoding(signaling, &peer, "subscribe", signalToByteArray(SubscribeSignal(topicName)));
+        benchmarkDecoding(signaling, &peer, "unsubscribe", signalToByteArray(UnsubscribeSignal(topicName)));
+        benchmarkDecoding(signaling, &peer, "topic", signalToByteArray(TopicSignal(topicName, 1)));
+        benchmarkDecoding(signaling, &peer, "keep_alive", signalToByteArray(KeepAliveSignal()));
+        benchmarkDecoding(signaling, &peer, "bulk_chunk", signalToByteArray(BulkChunkSignal(true, data.mid(sizeof(MessageQueue::MessageSize)))));
+        benchmarkDecoding(signaling, &peer, "capabilities", signalToByteArray(CapabilitiesSignal(CapabilitiesSignal::Compression)));
+        auto largeData = signalToByteArray(TopicDataSignal(1, TextSignal("sender", getText(4096)).toQVariant()));
+        benchmarkDecoding(signaling, &peer, "compressed", signalToByteArray(CompressedSignal(qCompress(largeData.mid(sizeof(MessageQueue::MessageSize)), 1))));
+    }
+
+    template<typename T> void benchmarkAttributes(const QString &a_name, const T &a_signal, const AttributeContainer &a_container)
+    {
+        auto compact = a_signal.toQVariant();
+        m_results.push_back(measure("attributes/" + a_name + "/compact_write", compact.toByteArray().size(), [&a_signal]
+            {
+                g_sink = g_sink + a_signal.toQVariant().toByteArray().size();
+            }));
+        m_results.push_back(measure("attributes/" + a_name + "/compact_read", compact.toByteArray().size(), [&compact]
+            {
+                g_sink = g_sink + T(compact).isValid();
+            }));
+        // прежний формат: значения по именам атрибутов
+        m_results.push_back(measure("attributes/" + a_name + "/container_round_trip", 0, [&a_container]
+            {
+                auto value = AttributeContainer(a_container.toQVariant()).toQVariant();
+                g_sink = g_sink + T(value).isValid();
+            }));
+    }
+
+    void benchmarkAttributes()
+    {
+        TextSignal text("3f2504e0-4f89-11d3-9a0c-0305e82c3301", getText(100));
+        AttributeContainer textContainer;
+        textContainer.m_container["sender"] = text.get_sender();
+        textContainer.m_container["text"] = text.get_text();
+        benchmarkAttributes("text", text, textContainer);
+
+        FileSignal file;
+        file.set_id(QUuid::createUuid().toString(QUuid::WithoutBraces));
+        file.set_name("archive.zip");
+        file.set_size(1234567890);
+        file.set_date(QDateTime::currentDateTime());
+        file.set_sending(true);
+        file.set_hash(getRandomData(32));
+        AttributeContainer fileContainer;
+        fileContainer.m_container["id"] = file.get_id();
+        fileContainer.m_container["name"] = file.get_name();
+        fileContainer.m_container["size"] = QVariant::fromValue(file.get_size());
+        fileContainer.m_container["date"] = file.get_date();
+        fileContainer.m_container["sending"] = file.get_sending();
+        fileContainer.m_container["hash"] = file.get_hash();
+        benchmarkAttributes("file", file, fileContainer);
+    }
+
+    // Signaling::sendSignal: сериализация, сжатие и выбор подписчиков темы
+    void benchmarkRouting(int a_peerCount, bool a_compression, qsizetype a_textSize)
+    {
+        Signaling signaling;
+        std::vector<std::unique_ptr<NullSocket>> peers;
+        auto topicName = QString("Message_%1").arg(a_peerCount);
+        // подписки узлов на другие темы тоже входят в таблицу подписчиков
+        for (int i = 0; i < a_peerCount; i++)
+        {
+            peers.push_back(std::make_unique<NullSocket>());
+            auto peer = peers.back().get();
+            signaling.m_peers.insert(peer);
+            auto capabilities = (a_compression ? CapabilitiesSignal::Compression : 0) | CapabilitiesSignal::CompactAttributes | CapabilitiesSignal::TopicIds |
+                CapabilitiesSignal::BulkChunks;
+            signaling.handleMessage(peer, signalToByteArray(CapabilitiesSignal(capabilities)).mid(sizeof(MessageQueue::MessageSize)));
+            signaling.handleMessage(peer, signalToByteArray(SubscribeSignal(topicName)).mid(sizeof(MessageQueue::MessageSize)));
+            signaling.handleMessage(peer, signalToByteArray(SubscribeSignal(QString("Other_%1").arg(i))).mid(sizeof(MessageQueue::MessageSize)));
+        }
+        auto topic = signaling.getTopicId(topicName);
+        auto value = TextSignal("sender", getText(a_textSize)).toQVariant();
+        auto name = QString("route/peers_%1/%2/text_%3").arg(a_peerCount).arg(a_compression ? "compression" : "plain").arg(a_textSize);
+        m_results.push_back(measure(name, 0, [&signaling, topic, &value]
+            {
+                signaling.sendSignal(topic, value);
+            }));
+    }
+
+    void benchmarkRouting()
+    {
+        for (auto peerCount : { 0, 1, 10, 100 })
+            for (auto compression : { false, true })
+                for (auto textSize : { 100, 4096 })
+                    benchmarkRouting(peerCount, compression, textSize);
+    }
+
+    std::vector<Result> m_results;
+};
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication application(argc, argv);
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    QCommandLineOption outputOption("o", "JSON report file", "file");
+    QCommandLineOption minTimeOption("min-time", "Minimum measurement time per benchmark, ms", "ms", QString::number(g_minTime));
+    parser.addOption(outputOption);
+    parser.addOption(minTimeOption);
+    parser.process(application);
+    g_minTime = std::max(1LL, parser.value(minTimeOption).toLongLong());
+
+    SignalingBenchmark benchmark;
+    benchmark.run();
+    auto report = benchmark.getReport().toJson();
+    if (!parser.isSet(outputOption))
+    {
+        QTextStream(stdout) << report;
+        return 0;
+    }
+    QFile file(parser.value(outputOption));
+    if (!file.open(QIODevice::WriteOnly) || file.write(report) != report.size())
+        return 1;
+    return 0;
+}
@@ -0,0 +1,19 @@
+TARGET = benchmarks
+TEMPLATE = app
+QT = core network
+CONFIG += console
+CONFIG -= app_bundle
+INCLUDEPATH += ..
+SOURCES += benchmarks.cpp \
+    ../signaling.cpp \
+    ../block_queue.cpp \
+    ../settings.cpp \
+    ../metrics.cpp \
+    ../tracing.cpp
+HEADERS += ../signaling.h \
+    ../signaling_protocol.h \
+    ../block_queue.h \
+    ../settings.h \
+    ../attribute_signal.h \
+    ../metrics.h \
+    ../tracing.h
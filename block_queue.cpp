@@ -1,42 +1,84 @@
-﻿#include "block_queue.h"
+﻿#include <cstring>
+#include <stdexcept>
+#include <QIODevice>
+#include "block_queue.h"
+#include "metrics.h"
+
+// метрики всех очередей
+static MetricCounter &g_movedBytes = Metrics::get().getCounter("block_queue_moved_bytes_total", "Bytes moved to the beginning of queue buffers");
+static MetricCounter &g_bufferResizes = Metrics::get().getCounter("block_queue_buffer_resizes_total", "Queue buffer reallocations");
+static MetricHistogram &g_messageSizes = Metrics::get().getHistogram("message_queue_message_size_bytes", "Sizes of messages taken from queues",
+    MetricHistogram::getExponentialBounds(16, 4, 10));
 
 void BlockQueue::appendBlock(const QByteArray &a_block)
 {
-    m_blocks.append(a_block);
-    m_size += a_block.size();
+    if (a_block.isEmpty())
+        return;
+    std::memcpy(reserve(a_block.size()), a_block.constData(), a_block.size());
+    m_end += a_block.size();
+}
+
+// чтение из устройства сразу в буфер очереди
+qint64 BlockQueue::appendBlock(QIODevice *a_device)
+{
+    auto size = a_device->bytesAvailable();
+    if (size <= 0)
+        return 0;
+    auto result = a_device->read(reserve(size), size);
+    if (result > 0)
+        m_end += result;
+    return result;
 }
 
 QByteArray BlockQueue::takeBlock(qsizetype a_size)
 {
-    if (a_size > m_size)
-        throw std::exception("BlockQueue.takeBlock: requested more than stored");
-    QByteArray result;
-    auto size = a_size; // требуемое количество байт
-    while (size != 0)
+    if (a_size > getSize())
+        throw std::runtime_error("BlockQueue.takeBlock: requested more than stored");
+    auto result = QByteArray::fromRawData(peek(), a_size);
+    m_begin += a_size;
+    return result;
+}
+
+char *BlockQueue::reserve(qsizetype a_size)
+{
+    auto size = getSize();
+    if (size == 0)
+        m_begin = m_end = 0;
+    if (m_buffer.size() - m_end >= a_size)
+        return m_buffer.data() + m_end;
+    if (m_begin != 0)
     {
-        QByteArray block = m_blocks.takeFirst();
-        if (block.size() > size) // если очередной блок оказался длинее требуемого количества
-        {
-            result.append(block.left(size));
-            m_blocks.prepend(block.mid(size)); // оставшуюся часть блока записываем обратно
-            break;
-        }
-        result.append(block);
-        size -= block.size();
+        // сдвигаем непрочитанные данные к началу буфера
+        std::memmove(m_buffer.data(), m_buffer.constData() + m_begin, size);
+        g_movedBytes.add(size);
+        m_begin = 0;
+        m_end = size;
     }
-    m_size -= a_size;
-    return result;
+    if (m_buffer.size() - m_end < a_size)
+    {
+        m_buffer.resize(std::max(size + a_size, m_buffer.size() * 2));
+        g_bufferResizes.add();
+    }
+    return m_buffer.data() + m_end;
 }
 
 //------------------------------------------------------------------------------------------------------
 QByteArray MessageQueue::createMessage(const QByteArray &a_rawData)
 {
-    QByteArray result(sizeof(MessageSize), Qt::Uninitialized);
-    *reinterpret_cast<MessageSize *>(result.data()) = a_rawData.size();
+    QByteArray result;
+    result.reserve(sizeof(MessageSize) + a_rawData.size());
+    MessageSize size = a_rawData.size();
+    result.append(reinterpret_cast<const char *>(&size), sizeof(MessageSize));
     result.append(a_rawData);
     return result;
 }
 
+void MessageQueue::writeMessageSize(QByteArray &a_message)
+{
+    MessageSize size = a_message.size() - sizeof(MessageSize);
+    std::memcpy(a_message.data(), &size, sizeof(MessageSize));
+}
+
 void MessageQueue::appendRawData(const QByteArray &a_rawData)
 {
     m_data.appendBlock(a_rawData);
@@ -44,6 +86,14 @@ void MessageQueue::appendRawData(const QByteArray &a_rawData)
         updateNextMessageSize();
 }
 
+qint64 MessageQueue::appendRawData(QIODevice *a_device)
+{
+    auto result = m_data.appendBlock(a_device);
+    if (!m_nextMessageSize.has_value())
+        updateNextMessageSize();
+    return result;
+}
+
 bool MessageQueue::messageIsReady() const
 {
     return m_nextMessageSize.has_value() && m_nextMessageSize.value() <= m_data.getSize();
@@ -52,8 +102,9 @@ bool MessageQueue::messageIsReady() const
 QByteArray MessageQueue::takeMessage()
 {
     if (!messageIsReady())
-        throw std::exception("MessageQueue.takeMessage: message is not ready");
+        throw std::runtime_error("MessageQueue.takeMessage: message is not ready");
     auto result = m_data.takeBlock(m_nextMessageSize.value());
+    g_messageSizes.observe(result.size());
     m_nextMessageSize.reset();
     updateNextMessageSize();
     return result;
@@ -63,6 +114,9 @@ void MessageQueue::updateNextMessageSize()
 {
     if (m_data.getSize() < sizeof(MessageSize))
         return;
-    auto messageSizeBlock = m_data.takeBlock(sizeof(MessageSize));
-    m_nextMessageSize = *reinterpret_cast<MessageSize *>(messageSizeBlock.data());
+    // размер сообщения читается прямо из буфера
+    MessageSize size;
+    std::memcpy(&size, m_data.peek(), sizeof(MessageSize));
+    m_data.takeBlock(sizeof(MessageSize));
+    m_nextMessageSize = size;
 }
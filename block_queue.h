@@ -1,25 +1,39 @@
 ﻿#ifndef BLOCK_QUEUE_H
 #define BLOCK_QUEUE_H
 
+#include <optional>
 #include <QByteArray>
-#include <QList>
 
+class QIODevice;
+
+// Очередь байтов в непрерывном буфере.
+// Прочитанные байты сдвигаются к началу буфера только при нехватке места в его конце,
+// поэтому данные можно просматривать и извлекать на месте, без копирования.
 class BlockQueue
 {
 public:
     void appendBlock(const QByteArray &a_block);
+    qint64 appendBlock(QIODevice *a_device);
 
     qsizetype getSize() const
     {
-        return m_size;
+        return m_end - m_begin;
+    }
+
+    const char *peek() const
+    {
+        return m_buffer.constData() + m_begin;
     }
 
+    // возвращаемый массив ссылается на буфер очереди и действителен до следующего добавления данных
     QByteArray takeBlock(qsizetype size);
 
 private:
-    QList<QByteArray> m_blocks;
+    char *reserve(qsizetype a_size);
 
-    qsizetype m_size = 0;
+    QByteArray m_buffer;
+    qsizetype m_begin = 0; // начало непрочитанных данных
+    qsizetype m_end = 0; // конец записанных данных
 };
 
 class MessageQueue
@@ -28,11 +42,27 @@ public:
     using MessageSize = unsigned int;
 
     static QByteArray createMessage(const QByteArray &a_rawData);
+    // записывает размер в начало сообщения, сформированного без createMessage
+    static void writeMessageSize(QByteArray &a_message);
 
     void appendRawData(const QByteArray &a_rawData);
+    qint64 appendRawData(QIODevice *a_device);
+
+    // объем данных в очереди, включая неполное сообщение
+    qsizetype getSize() const
+    {
+        return m_data.getSize() + (m_nextMessageSize.has_value() ? sizeof(MessageSize) : 0);
+    }
 
     bool messageIsReady() const;
 
+    // размер следующего сообщения, если он уже прочитан; позволяет отвергнуть сообщение до его накопления
+    std::optional<MessageSize> getNextMessageSize() const
+    {
+        return m_nextMessageSize;
+    }
+
+    // сообщение действительно до следующего добавления данных
     QByteArray takeMessage();
 
 private:
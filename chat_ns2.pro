@@ -14,20 +14,38 @@ SOURCES += main.cpp \
     signaling_facade.cpp \
     file_form.cpp \
     settings.cpp \
-    file_signaling.cpp
+    file_signaling.cpp \
+    file_hash.cpp \
+    file_sync.cpp \
+    history_store.cpp \
+    history_writer.cpp \
+    message_view.cpp \
+    search_index.cpp \
+    metrics.cpp \
+    tracing.cpp
 HEADERS += user_list_widget.h \
     type_field.h \
     detection_server.h \
     message_form.h \
     seeker_client.h \
     signaling.h \
+    signaling_protocol.h \
     block_queue.h \
     messenger_signaling.h \
     resource_holder.h \
     signaling_facade.h \
     file_form.h \
     settings.h \
-    file_signaling.h
+    file_signaling.h \
+    attribute_signal.h \
+    file_hash.h \
+    file_sync.h \
+    history_store.h \
+    history_writer.h \
+    message_view.h \
+    search_index.h \
+    metrics.h \
+    tracing.h
 FORMS += user_list_widget.ui \
     message_form.ui \
     file_form.ui
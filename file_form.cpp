@@ -18,6 +18,7 @@ FileForm::FileForm(std::shared_ptr<MessengerSignaling> a_signaling, std::shared_
     connect(m_fileSignaling.get(), &FileSignaling::fileAboutToReceive, this, &FileForm::onFileAboutToReceive);
     connect(m_fileSignaling.get(), &FileSignaling::fileFragmentSent, this, &FileForm::onFileFragmentSent);
     connect(m_fileSignaling.get(), &FileSignaling::fileFragmentReceived, this, &FileForm::onFileFragmentReceived);
+    connect(m_fileSignaling.get(), &FileSignaling::fileStatusChanged, this, &FileForm::onFileStatusChanged);
     connect(m_ui->filesListWidget, &QListWidget::currentItemChanged, this, &FileForm::onFileListWidgetCurrentItemChanged);
     connect(m_ui->setFolderToolButton, &QAbstractButton::clicked, this, &FileForm::onSetFileNameToolButtonClicked);
     connect(m_ui->startToolButton, &QAbstractButton::clicked, this, &FileForm::onStartToolButtonClicked);
@@ -51,7 +52,7 @@ bool FileForm::sendFile(const QString &a_receiver, const QString &a_fileName)
         return false;
     if (canAddItem(a_receiver))
     {
-        auto &fileId = m_fileSignaling->getFileId(a_fileName);
+        auto fileId = m_fileSignaling->getFileId(a_fileName);
         auto item = new QListWidgetItem(ResourceHolder::get().getSendIcon(), getItemText(fileId, m_ui->tabBar->currentIndex() != 0));
         item->setData(Qt::UserRole, fileIdToString(fileId));
         m_ui->filesListWidget->addItem(item);
@@ -131,6 +132,13 @@ void FileForm::onFileFragmentReceived(QString a_sender, QString a_name, size_t a
         updateButtons();
 }
 
+void FileForm::onFileStatusChanged(QString a_sender, QString a_name)
+{
+    // планировщик запускает файлы из очереди независимо от действий пользователя
+    if (getCurrentFileId() == FileId{ FileActionType::Receive, a_sender, a_name })
+        updateButtons();
+}
+
 void FileForm::onFileListWidgetCurrentItemChanged(QListWidgetItem *, QListWidgetItem *)
 {
     updateButtons();
@@ -247,12 +255,12 @@ void FileForm::changeIcons()
     {
         auto item = m_ui->filesListWidget->item(i);
         auto fileId = fileIdFromString(item->data(Qt::UserRole).toString());
-        auto &fileInfo = m_fileSignaling->getReceivingFileInfo(m_fileSignaling->getFileName(fileId));
+        auto fileInfo = m_fileSignaling->getReceivingFileInfo(m_fileSignaling->getFileName(fileId));
         auto status = FileInfo::Status::Unknown;
         if (fileInfo.isValid())
             status = fileInfo.m_status;
         QIcon icon;
-        if (m_blinkState && status == FileInfo::Status::Pending)
+        if (m_blinkState && (status == FileInfo::Status::Pending || status == FileInfo::Status::Queued))
             icon = ResourceHolder::get().getFileIcon();
         else if (m_blinkState && status == FileInfo::Status::Paused)
             icon = ResourceHolder::get().getPauseIcon();
@@ -344,7 +352,7 @@ QString FileForm::getCurrentFileName()
     return m_fileSignaling->getFileName(getCurrentFileId());
 }
 
-const FileInfo &FileForm::getCurrentReceivingFileInfo()
+FileInfo FileForm::getCurrentReceivingFileInfo()
 {
     return m_fileSignaling->getReceivingFileInfo(getCurrentFileName());
 }
@@ -369,7 +377,7 @@ QString FileForm::getItemText(const FileId &a_fileId, bool a_printUserName)
         result = QString("%1: ").arg(userName);
     size_t size = 0;
     auto fileName = m_fileSignaling->getFileName(a_fileId);
-    auto &fileInfo = m_fileSignaling->getReceivingFileInfo(fileName);
+    auto fileInfo = m_fileSignaling->getReceivingFileInfo(fileName);
     if (fileInfo.isValid())
         size = fileInfo.m_size;
     else
@@ -413,7 +421,7 @@ void FileForm::updateButtons()
         m_ui->openFolderToolButton->setEnabled(true);
     m_ui->removeToolButton->setEnabled(true);
     // остальные кнопки работают только для получаемых файлов
-    auto &fileInfo = getCurrentReceivingFileInfo();
+    auto fileInfo = getCurrentReceivingFileInfo();
     if (!fileInfo.isValid())
         return;
     switch (fileInfo.m_status)
@@ -422,6 +430,7 @@ void FileForm::updateButtons()
         m_ui->setFolderToolButton->setEnabled(true);
         m_ui->startToolButton->setEnabled(true);
         break;
+    case FileInfo::Status::Queued:
     case FileInfo::Status::Started:
         m_ui->pauseToolButton->setEnabled(true);
         m_ui->cancelToolButton->setEnabled(true);
@@ -31,6 +31,7 @@ private slots:
     void onFileAboutToReceive(QString a_sender, QString a_name);
     void onFileFragmentSent(QString a_sender, QString a_name, size_t a_offset, size_t a_size);
     void onFileFragmentReceived(QString a_sender, QString a_name, size_t a_offset, size_t a_size);
+    void onFileStatusChanged(QString a_sender, QString a_name);
     void onFileListWidgetCurrentItemChanged(QListWidgetItem *a_current, QListWidgetItem *a_previous);
     void onSetFileNameToolButtonClicked();
     void onStartToolButtonClicked();
@@ -50,7 +51,7 @@ private:
     void changeEvent(QEvent *a_event) override;
     FileId getCurrentFileId();
     QString getCurrentFileName();
-    const FileInfo &getCurrentReceivingFileInfo();
+    FileInfo getCurrentReceivingFileInfo();
     QListWidgetItem *getItem(const FileId &a_fileId);
     QString getItemText(const FileId &a_fileId, bool a_printUserName);
     void updateButtons();
@@ -0,0 +1,55 @@
+﻿#include <QCryptographicHash>
+#include <QFile>
+#include "file_hash.h"
+
+size_t FileHash::getChunkCount(size_t a_fileSize)
+{
+    return (a_fileSize + g_chunkSize - 1) / g_chunkSize;
+}
+
+QByteArray FileHash::hashChunks(const QByteArray &a_data)
+{
+    QByteArray result;
+    result.reserve(getChunkCount(a_data.size()) * g_hashSize);
+    for (qsizetype offset = 0; offset < a_data.size(); offset += g_chunkSize)
+    {
+        auto chunk = QByteArrayView(a_data).sliced(offset, std::min<qsizetype>(g_chunkSize, a_data.size() - offset));
+        result.append(QCryptographicHash::hash(chunk, QCryptographicHash::Sha256));
+    }
+    return result;
+}
+
+std::vector<QByteArray> FileHash::hashFile(const QString &a_fileName)
+{
+    QFile file(a_fileName);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Unbuffered))
+        return std::vector<QByteArray>();
+    std::vector<QByteArray> result;
+    result.reserve(getChunkCount(file.size()));
+    while (!file.atEnd())
+    {
+        auto chunk = file.read(g_chunkSize);
+        if (chunk.isEmpty())
+            return std::vector<QByteArray>();
+        result.push_back(QCryptographicHash::hash(chunk, QCryptographicHash::Sha256));
+    }
+    return result;
+}
+
+QByteArray FileHash::getRootHash(std::vector<QByteArray> a_chunkHashes)
+{
+    if (a_chunkHashes.empty())
+        return QCryptographicHash::hash(QByteArray(), QCryptographicHash::Sha256);
+    // на каждом уровне хэшируются пары узлов, непарный узел переходит на следующий уровень
+    while (a_chunkHashes.size() > 1)
+    {
+        std::vector<QByteArray> level;
+        level.reserve((a_chunkHashes.size() + 1) / 2);
+        for (size_t i = 0; i + 1 < a_chunkHashes.size(); i += 2)
+            level.push_back(QCryptographicHash::hash(a_chunkHashes[i] + a_chunkHashes[i + 1], QCryptographicHash::Sha256));
+        if (a_chunkHashes.size() % 2 != 0)
+            level.push_back(a_chunkHashes.back());
+        a_chunkHashes = std::move(level);
+    }
+    return a_chunkHashes.front();
+}
@@ -0,0 +1,24 @@
+﻿#pragma once
+
+#include <QByteArray>
+#include <QString>
+#include <vector>
+
+// Хэши содержимого файла.
+// Файл делится на блоки фиксированного размера; хэш файла - корень дерева хэшей блоков,
+// поэтому каждый фрагмент, состоящий из целых блоков, проверяется независимо от остальных.
+class FileHash
+{
+public:
+    // размер блока; размер фрагмента файла должен быть ему кратен
+    static constexpr size_t g_chunkSize = 256 * 1024;
+    static constexpr qsizetype g_hashSize = 32;
+
+    static size_t getChunkCount(size_t a_fileSize);
+    // хэши блоков данных, начинающихся с границы блока, записанные подряд
+    static QByteArray hashChunks(const QByteArray &a_data);
+    // хэши всех блоков файла; при ошибке чтения - пустой список
+    static std::vector<QByteArray> hashFile(const QString &a_fileName);
+    // корень дерева хэшей блоков
+    static QByteArray getRootHash(std::vector<QByteArray> a_chunkHashes);
+};
@@ -1,46 +1,85 @@
 ﻿#include <QFileInfo>
 #include <QDir>
+#include <QSaveFile>
+#include <QDataStream>
+#include <QThread>
+#include <cmath>
+#include <stdexcept>
 #include "file_signaling.h"
-#include "messenger_signaling.h"
+#include "attribute_signal.h"
+#include "settings.h"
+#include "file_hash.h"
+#include "file_sync.h"
+#include "metrics.h"
+#include "tracing.h"
+
+// метрики всех экземпляров FileSignaling
+static MetricCounter &g_sentBytes = Metrics::get().getCounter("file_sent_bytes_total", "File contents sent to receivers");
+static MetricCounter &g_receivedBytes = Metrics::get().getCounter("file_received_bytes_total", "File contents received and written");
+static MetricCounter &g_requestedFragments = Metrics::get().getCounter("file_requested_fragments_total", "Fragment requests sent to senders");
+static MetricCounter &g_timedOutFragments = Metrics::get().getCounter("file_timed_out_fragments_total", "Fragments requested again after a timeout");
+static MetricCounter &g_corruptedFragments = Metrics::get().getCounter("file_corrupted_fragments_total", "Fragments that failed the hash check");
+static MetricCounter &g_decodeErrors = Metrics::get().getCounter("file_decode_errors_total", "File signals of unknown version");
+static MetricGauge &g_activeFiles = Metrics::get().getGauge("file_active_receives", "Files being received");
+static MetricGauge &g_queuedFiles = Metrics::get().getGauge("file_queued_receives", "Files waiting for a receive slot");
+static MetricHistogram &g_fragmentRtt = Metrics::get().getHistogram("file_fragment_rtt_ms", "Time from a fragment request to its arrival",
+    MetricHistogram::getExponentialBounds(1, 2, 16));
 
 //-------------------------------------------------------------------------------------------------
-struct FileInfoSignal : AttributeContainer
+struct FileInfoSignal : AttributeSignal<FileInfoSignal>
 {
     ATTRIBUTE(QString, sender);
     ATTRIBUTE(QString, name);
     ATTRIBUTE(QDateTime, modification_date);
     ATTRIBUTE(size_t, size);
+    ATTRIBUTE(QByteArray, hash);
 
-    FileInfoSignal(const QString &a_sender, const QString &a_name, const QDateTime &a_modificationDate, size_t a_size)
+    FileInfoSignal(const QString &a_sender, const QString &a_name, const QDateTime &a_modificationDate, size_t a_size, const QByteArray &a_hash = QByteArray())
     {
         set_sender(a_sender);
         set_name(a_name);
         set_modification_date(a_modificationDate);
         set_size(a_size);
+        set_hash(a_hash);
+    }
+
+    explicit FileInfoSignal(const QVariant &a_value)
+    {
+        fromQVariant(a_value);
     }
 
-    explicit FileInfoSignal(const QVariant &a_value) : AttributeContainer(a_value) {}
+    template<typename S, typename V> static void visitAttributes(S &a_signal, V &&a_visitor)
+    {
+        VISIT_ATTRIBUTE(sender);
+        VISIT_ATTRIBUTE(name);
+        VISIT_ATTRIBUTE(modification_date);
+        VISIT_ATTRIBUTE(size);
+        VISIT_ATTRIBUTE(hash);
+    }
 
     static constexpr char g_signalName[]{ "FileInfo" };
 };
 
 //-------------------------------------------------------------------------------------------------
-struct FileContentsSignal : AttributeContainer
+struct FileContentsSignal : AttributeSignal<FileContentsSignal>
 {
     ATTRIBUTE(QString, sender);
     ATTRIBUTE(QString, name);
     ATTRIBUTE(size_t, offset);
     ATTRIBUTE(size_t, size);
     ATTRIBUTE(QByteArray, contents);
+    // хэши блоков фрагмента (FileHash::hashChunks)
+    ATTRIBUTE(QByteArray, hashes);
 
     // для отправки фрагмента
-    FileContentsSignal(const QString &a_sender, const QString &a_name, size_t a_offset, const QByteArray &a_contents)
+    FileContentsSignal(const QString &a_sender, const QString &a_name, size_t a_offset, const QByteArray &a_contents, const QByteArray &a_hashes)
     {
         set_sender(a_sender);
         set_name(a_name);
         set_offset(a_offset);
         set_size(a_contents.size());
         set_contents(a_contents);
+        set_hashes(a_hashes);
     }
 
     // для запроса на фрагмент
@@ -52,7 +91,20 @@ struct FileContentsSignal : AttributeContainer
         set_size(a_size);
     }
 
-    explicit FileContentsSignal(const QVariant &a_value) : AttributeContainer(a_value) {}
+    explicit FileContentsSignal(const QVariant &a_value)
+    {
+        fromQVariant(a_value);
+    }
+
+    template<typename S, typename V> static void visitAttributes(S &a_signal, V &&a_visitor)
+    {
+        VISIT_ATTRIBUTE(sender);
+        VISIT_ATTRIBUTE(name);
+        VISIT_ATTRIBUTE(offset);
+        VISIT_ATTRIBUTE(size);
+        VISIT_ATTRIBUTE(contents);
+        VISIT_ATTRIBUTE(hashes);
+    }
 
     static constexpr char g_signalName[]{ "FileContents" };
 };
@@ -73,26 +125,59 @@ bool FileId::operator<(const FileId &a_id) const
 }
 
 //-------------------------------------------------------------------------------------------------
-FileSignaling::FileSignaling(std::shared_ptr<Signaling> a_signaling)
+FileSignaling::FileSignaling(std::shared_ptr<Signaling> a_signaling, const QString &a_directory)
 {
     m_signaling = a_signaling;
-    connect(m_signaling.get(), &Signaling::signalReceived, this, &FileSignaling::onSignalReceived);
+    m_directory = QDir(a_directory.isNull() ? "files" : a_directory).absolutePath();
+    connect(m_signaling.get(), &Signaling::subscriberAdded, this, &FileSignaling::onSubscriberAdded);
+    connect(m_signaling.get(), &Signaling::writable, this, &FileSignaling::onWritable);
+    setWindowSize(Settings::get().value("FileTransferWindowSize", (uint)m_windowSize).toUInt());
+    setFragmentSizeLimits(Settings::get().value("FileTransferMinFragmentSize", (uint)m_minFragmentSize).toUInt(),
+        Settings::get().value("FileTransferMaxFragmentSize", (uint)m_maxFragmentSize).toUInt(),
+        Settings::get().value("FileTransferMaxWindowSize", (uint)m_maxWindowSize).toUInt(),
+        Settings::get().value("FileTransferTargetFragmentTime", m_targetFragmentTime).toInt());
+    setTransferLimits(Settings::get().value("FileTransferMaxActiveFiles", (uint)m_maxActiveFiles).toUInt(),
+        Settings::get().value("FileTransferMaxActiveFilesPerPeer", (uint)m_maxActiveFilesPerPeer).toUInt(),
+        Settings::get().value("FileTransferMaxPendingFragments", (uint)m_maxPendingFragments).toUInt());
+    m_fragmentTimeout = Settings::get().value("FileTransferFragmentTimeout", m_fragmentTimeout).toInt();
+    m_clock.start();
+    // таймер - дочерний объект, чтобы переноситься в поток FileSignaling вместе с ним
+    m_fragmentTimer = std::make_unique<QTimer>(this);
+    connect(m_fragmentTimer.get(), &QTimer::timeout, this, &FileSignaling::checkPendingFragments);
+    m_fragmentTimer->start(std::max(m_fragmentTimeout / 4, 1000));
+    // хэширование не должно занимать все ядра и мешать передаче
+    m_hashPool.setMaxThreadCount(std::max(QThread::idealThreadCount() / 2, 1));
+}
+
+FileSignaling::~FileSignaling()
+{
+    m_hashPool.clear();
+    m_hashPool.waitForDone();
+    clearPeerStats();
 }
 
 QString FileSignaling::getId() const
 {
+    QMutexLocker locker(&m_stateMutex);
     return m_id;
 }
 
+// подписки Signaling потокобезопасны, поэтому идентификатор меняется сразу, без ожидания потока FileSignaling
 void FileSignaling::setId(const QString &a_id)
 {
-    m_signaling->unsubscribe(getSignalName(FileInfoSignal::g_signalName, m_id));
-    m_signaling->unsubscribe(getSignalName(FileContentsSignal::g_signalName, m_id));
-    m_id = a_id;
-    m_signaling->subscribe(getSignalName(FileInfoSignal::g_signalName, m_id));
-    m_signaling->subscribe(getSignalName(FileContentsSignal::g_signalName, m_id));
+    QString oldId;
+    {
+        QMutexLocker locker(&m_stateMutex);
+        oldId = m_id;
+        m_id = a_id;
+    }
+    m_signaling->unsubscribe(getSignalName(FileInfoSignal::g_signalName, oldId));
+    m_signaling->unsubscribe(getSignalName(FileContentsSignal::g_signalName, oldId));
+    subscribe<FileInfoSignal>(getSignalName(FileInfoSignal::g_signalName, a_id));
+    subscribe<FileContentsSignal>(getSignalName(FileContentsSignal::g_signalName, a_id));
 }
 
+// файл регистрируется сразу, чтобы интерфейс мог его показать; отправка и хэширование выполняются в других потоках
 bool FileSignaling::sendFile(const QString &a_receiver, const QString &a_fileName)
 {
     QFileInfo fileInfo(a_fileName);
@@ -100,18 +185,32 @@ bool FileSignaling::sendFile(const QString &a_receiver, const QString &a_fileNam
         return false;
     auto name = fileInfo.fileName();
     FileId fileId{ FileActionType::Send, a_receiver, name };
-    if (!getFileName(fileId).isNull())
-        return false; // файл с таким именем уже отправлен/отправляется
-    m_fileNames[fileId] = a_fileName;
+    {
+        QMutexLocker locker(&m_stateMutex);
+        if (!m_fileNames.emplace(fileId, a_fileName).second)
+            return false; // файл с таким именем уже отправлен/отправляется
+    }
 
     // идентификатор ресурса - короткое имя файла
     // передача файлов с одинаковыми короткими именами, но разными полными именами невозможна
-    m_signaling->sendSignal(getSignalName(FileInfoSignal::g_signalName, a_receiver), FileInfoSignal(m_id, name, fileInfo.lastModified(), (size_t)fileInfo.size()).toQVariant());
+    m_signaling->sendSignal(getSignalName(FileInfoSignal::g_signalName, a_receiver), FileInfoSignal(getId(), name, fileInfo.lastModified(), (size_t)fileInfo.size()));
+
+    // хэш вычисляется в фоне, чтобы не задерживать начало передачи, и отправляется повторным FileInfo
+    m_hashPool.start([this, fileId, a_fileName]
+        {
+            auto chunkHashes = FileHash::hashFile(a_fileName);
+            QMetaObject::invokeMethod(this, [this, fileId, a_fileName, chunkHashes]
+                {
+                    onFileHashed(fileId, a_fileName, chunkHashes);
+                }, Qt::QueuedConnection);
+        });
     return true;
 }
 
 void FileSignaling::receiveFile(const QString &a_sender, const QString &a_name)
 {
+    if (invokeInOwnThread([=] { receiveFile(a_sender, a_name); }))
+        return;
     FileId fileId{ FileActionType::Receive, a_sender, a_name };
     auto fileName = getFileName(fileId);
     auto &fileInfo = getReceivingFileInfoRef(fileName);
@@ -126,64 +225,113 @@ void FileSignaling::receiveFile(const QString &a_sender, const QString &a_name)
     if (fileInfo.m_status == FileInfo::Status::Pending &&
         !QDir().mkpath(QFileInfo(fileName).path()))
         return;
-    fileInfo.m_status = FileInfo::Status::Started;
-    requestFileContents(fileId.m_userId, fileId.m_name, m_offsets[fileId], fileInfo.m_size > m_maxFragmentSize ? m_maxFragmentSize : fileInfo.m_size);
+    if (fileInfo.m_status == FileInfo::Status::Started || fileInfo.m_status == FileInfo::Status::Queued)
+        return;
+    // прием начнет планировщик, когда освободится место
+    {
+        QMutexLocker locker(&m_stateMutex);
+        fileInfo.m_status = FileInfo::Status::Queued;
+        fileInfo.m_queueNumber = m_nextQueueNumber++;
+    }
+    emit fileStatusChanged(a_sender, a_name);
+    scheduleTransfers();
 }
 
 void FileSignaling::renameFileName(const QString &a_oldFileName, const QString &a_newFileName)
 {
+    if (invokeInOwnThread([=] { renameFileName(a_oldFileName, a_newFileName); }))
+        return;
     auto fileId = getFileId(a_oldFileName);
     if (fileId == FileId() || fileId.m_action == FileActionType::Send)
         return;
     // имя файла FileId.m_name определено отправителем и не может тут измениться
-    m_fileNames[fileId] = a_newFileName;
-    auto fileInfo = m_receivingFiles[a_oldFileName];
-    m_receivingFiles.erase(a_oldFileName);
-    m_receivingFiles[a_newFileName] = fileInfo;
+    closeFile(fileId);
+    {
+        QMutexLocker locker(&m_stateMutex);
+        m_fileNames[fileId] = a_newFileName;
+        auto fileInfo = m_receivingFiles[a_oldFileName];
+        m_receivingFiles.erase(a_oldFileName);
+        m_receivingFiles[a_newFileName] = fileInfo;
+    }
     QFile::rename(a_oldFileName, a_newFileName);
+    if (m_offsets.find(fileId) != m_offsets.end())
+        saveJournal(fileId);
 }
 
 void FileSignaling::pauseReceivingFile(const QString &a_sender, const QString &a_name)
 {
-    auto &fileInfo = getReceivingFileInfoRef(getFileName(FileId{ FileActionType::Receive, a_sender, a_name }));
+    if (invokeInOwnThread([=] { pauseReceivingFile(a_sender, a_name); }))
+        return;
+    FileId id{ FileActionType::Receive, a_sender, a_name };
+    auto &fileInfo = getReceivingFileInfoRef(getFileName(id));
     if (!fileInfo.isValid())
         return;
-    fileInfo.m_status = FileInfo::Status::Paused;
+    saveJournal(id);
+    closeFile(id);
+    m_windows.erase(id);
+    setStatus(fileInfo, FileInfo::Status::Paused);
+    emit fileStatusChanged(a_sender, a_name);
+    scheduleTransfers();
 }
 
 void FileSignaling::cancelReceivingFile(const QString &a_sender, const QString &a_name)
 {
+    if (invokeInOwnThread([=] { cancelReceivingFile(a_sender, a_name); }))
+        return;
     FileId id{ FileActionType::Receive, a_sender, a_name };
     auto fileName = getFileName(id);
     auto &fileInfo = getReceivingFileInfoRef(fileName);
     if (!fileInfo.isValid())
         return;
+    closeFile(id);
     QFile::remove(fileName);
     m_offsets.erase(id);
-    fileInfo.m_status = FileInfo::Status::Pending;
+    m_windows.erase(id);
+    m_chunkHashes.erase(id);
+    removeJournal(id);
+    setStatus(fileInfo, FileInfo::Status::Pending);
+    emit fileStatusChanged(a_sender, a_name);
+    scheduleTransfers();
 }
 
 void FileSignaling::removeFile(const QString &a_userId, const QString &a_name)
 {
+    if (invokeInOwnThread([=] { removeFile(a_userId, a_name); }))
+        return;
     FileId id{ FileActionType::Receive, a_userId, a_name };
     auto fileName = getFileName(id);
     if (!fileName.isNull())
     {
-        m_fileNames.erase(id);
+        {
+            QMutexLocker locker(&m_stateMutex);
+            m_fileNames.erase(id);
+            m_receivingFiles.erase(fileName);
+        }
         m_offsets.erase(id);
+        m_windows.erase(id);
+        m_chunkHashes.erase(id);
+        removeJournal(id);
+        removeSources(id);
+        closeFile(id);
         QFile::remove(fileName);
-        m_receivingFiles.erase(fileName);
+        scheduleTransfers();
         return;
     }
     id = FileId{ FileActionType::Send, a_userId, a_name };
     fileName = getFileName(id);
     if (fileName.isNull())
         return;
-    m_fileNames.erase(id);
+    closeFile(id);
+    {
+        QMutexLocker locker(&m_stateMutex);
+        m_fileNames.erase(id);
+    }
+    m_chunkHashes.erase(id);
 }
 
 QString FileSignaling::getFileName(const FileId &a_fileId) const
 {
+    QMutexLocker locker(&m_stateMutex);
     auto it = m_fileNames.find(a_fileId);
     if (it == m_fileNames.end())
         return QString();
@@ -192,6 +340,7 @@ QString FileSignaling::getFileName(const FileId &a_fileId) const
 
 QStringList FileSignaling::getFileNames(const QString &a_userId) const
 {
+    QMutexLocker locker(&m_stateMutex);
     QStringList result;
     for (auto &fileId : m_fileNames)
         if (a_userId.isNull() || fileId.first.m_userId == a_userId)
@@ -199,50 +348,193 @@ QStringList FileSignaling::getFileNames(const QString &a_userId) const
     return result;
 }
 
-const FileId &FileSignaling::getFileId(const QString &a_fileName) const
+FileId FileSignaling::getFileId(const QString &a_fileName) const
 {
+    QMutexLocker locker(&m_stateMutex);
     auto it = std::find_if(m_fileNames.begin(), m_fileNames.end(), [&a_fileName](auto &a_fileInfo)
         {
             return a_fileInfo.second == a_fileName;
         });
     if (it == m_fileNames.end())
-    {
-        static FileId nullId;
-        return nullId;
-    }
+        return FileId();
     return it->first;
 }
 
-const FileInfo &FileSignaling::getReceivingFileInfo(const QString &a_fileName) const
+FileInfo FileSignaling::getReceivingFileInfo(const QString &a_fileName) const
 {
+    QMutexLocker locker(&m_stateMutex);
     return const_cast<FileSignaling &>(*this).getReceivingFileInfoRef(a_fileName);
 }
 
+void FileSignaling::setReceivingFilePriority(const QString &a_sender, const QString &a_name, int a_priority)
+{
+    if (invokeInOwnThread([=] { setReceivingFilePriority(a_sender, a_name, a_priority); }))
+        return;
+    auto &fileInfo = getReceivingFileInfoRef(getFileName(FileId{ FileActionType::Receive, a_sender, a_name }));
+    if (!fileInfo.isValid())
+        return;
+    // приоритет влияет на порядок запуска ожидающих файлов, а не на уже принимаемые
+    {
+        QMutexLocker locker(&m_stateMutex);
+        fileInfo.m_priority = a_priority;
+    }
+    scheduleTransfers();
+}
+
+size_t FileSignaling::getWindowSize() const
+{
+    QMutexLocker locker(&m_stateMutex);
+    return m_windowSize;
+}
+
+void FileSignaling::setWindowSize(size_t a_windowSize)
+{
+    if (invokeInOwnThread([=] { setWindowSize(a_windowSize); }))
+        return;
+    QMutexLocker locker(&m_stateMutex);
+    m_windowSize = std::max<size_t>(a_windowSize, 1);
+}
+
+void FileSignaling::setFragmentSizeLimits(size_t a_minFragmentSize, size_t a_maxFragmentSize, size_t a_maxWindowSize, int a_targetFragmentTime)
+{
+    if (invokeInOwnThread([=] { setFragmentSizeLimits(a_minFragmentSize, a_maxFragmentSize, a_maxWindowSize, a_targetFragmentTime); }))
+        return;
+    // фрагменты состоят из целых блоков, чтобы проверяться по хэшам блоков
+    auto alignSize = [](size_t a_size)
+        {
+            return std::max<size_t>(a_size / FileHash::g_chunkSize, 1) * FileHash::g_chunkSize;
+        };
+    m_minFragmentSize = alignSize(a_minFragmentSize);
+    m_maxFragmentSize = std::max(alignSize(a_maxFragmentSize), m_minFragmentSize);
+    m_fragmentSize = std::clamp(alignSize(m_fragmentSize), m_minFragmentSize, m_maxFragmentSize);
+    m_maxWindowSize = std::max<size_t>(a_maxWindowSize, 2);
+    m_targetFragmentTime = std::max(a_targetFragmentTime, 1);
+    clearPeerStats();
+}
+
+void FileSignaling::setTransferLimits(size_t a_maxActiveFiles, size_t a_maxActiveFilesPerPeer, size_t a_maxPendingFragments)
+{
+    if (invokeInOwnThread([=] { setTransferLimits(a_maxActiveFiles, a_maxActiveFilesPerPeer, a_maxPendingFragments); }))
+        return;
+    m_maxActiveFiles = std::max<size_t>(a_maxActiveFiles, 1);
+    m_maxActiveFilesPerPeer = std::max<size_t>(a_maxActiveFilesPerPeer, 1);
+    m_maxPendingFragments = std::max<size_t>(a_maxPendingFragments, 1);
+    scheduleTransfers();
+}
+
+// public slots:
+void FileSignaling::onUserAdded(QString a_id)
+{
+    if (m_offlineUsers.erase(a_id) != 0)
+        requestFragments(); // вернувшийся узел снова может отдавать фрагменты
+}
+
+void FileSignaling::onUserRemoved(QString a_id)
+{
+    m_offlineUsers.insert(a_id);
+    reassignFragments(a_id);
+    requestFragments();
+}
+
 // private slots:
-void FileSignaling::onSignalReceived(QString a_signal, QVariant a_value)
+// вернувшийся получатель снова подписывается на FileInfo: ему повторно предлагаются отправляемые файлы,
+// чтобы он мог продолжить прием, прерванный перезапуском
+void FileSignaling::onSubscriberAdded(Signaling::TopicId a_topic)
+{
+    std::vector<std::pair<FileId, QString>> sendingFiles;
+    {
+        QMutexLocker locker(&m_stateMutex);
+        for (auto &file : m_fileNames)
+            if (file.first.m_action == FileActionType::Send)
+                sendingFiles.push_back(file);
+    }
+    for (auto &file : sendingFiles)
+    {
+        auto signalName = getSignalName(FileInfoSignal::g_signalName, file.first.m_userId);
+        if (m_signaling->getTopicId(signalName) != a_topic)
+            continue;
+        QFileInfo fileInfo(file.second);
+        auto chunkHashes = m_chunkHashes.find(file.first);
+        auto hash = chunkHashes != m_chunkHashes.end() ? FileHash::getRootHash(chunkHashes->second) : QByteArray();
+        m_signaling->sendSignal(signalName, FileInfoSignal(getId(), file.first.m_name, fileInfo.lastModified(), (size_t)fileInfo.size(), hash));
+    }
+}
+
+void FileSignaling::onWritable()
 {
-    tryHandleSignal<FileInfoSignal>(a_signal, a_value) ||
-        tryHandleSignal<FileContentsSignal>(a_signal, a_value);
+    // запросы, которые все еще нельзя выполнить, снова откладываются в том же порядке
+    auto requests = std::move(m_deferredRequests);
+    m_deferredRequests.clear();
+    for (auto &request : requests)
+        serveFileContents(request.m_receiver, request.m_name, request.m_offset, request.m_size);
+}
+
+void FileSignaling::checkPendingFragments()
+{
+    // долго не отвечающий узел не должен задерживать файл: его фрагменты запрашиваются у других узлов
+    auto now = m_clock.elapsed();
+    auto reassigned = false;
+    for (auto &window : m_windows)
+    {
+        auto &pendingFragments = window.second.m_pendingFragments;
+        for (auto it = pendingFragments.begin(); it != pendingFragments.end();)
+        {
+            if (now - it->second.m_requestTime < m_fragmentTimeout)
+            {
+                it++;
+                continue;
+            }
+            window.second.m_missingFragments[it->first] = it->second.m_size;
+            it = pendingFragments.erase(it);
+            reassigned = true;
+            g_timedOutFragments.add();
+        }
+    }
+    if (reassigned)
+        requestFragments();
 }
 
 // private:
 QString FileSignaling::getSignalName(const QString &a_prefix, const QString &a_id)
 {
-    return QString("%1_%2").arg(a_prefix).arg(a_id);
+    return a_prefix + '_' + a_id;
 }
 
-QString FileSignaling::createReceivingFileName(const QString &a_user, const QString &a_name)
+QString FileSignaling::createReceivingFileName(const QString &a_user, const QString &a_name) const
 {
-    auto result = QString("%1/files/%2/%3").arg(QDir::currentPath()).arg(a_user).arg(a_name);
+    auto result = QString("%1/%2/%3").arg(m_directory).arg(a_user).arg(a_name);
     if (!QFile::exists(result))
         return result;
     auto baseName = QFileInfo(a_name).baseName();
     auto suffix = QFileInfo(a_name).suffix();
     for (int i = 1; QFile::exists(result); i++)
-        result = QString("%1/files/%2/%3(%4).%5").arg(QDir::currentPath()).arg(a_user).arg(baseName).arg(i).arg(suffix);
+        result = QString("%1/%2/%3(%4).%5").arg(m_directory).arg(a_user).arg(baseName).arg(i).arg(suffix);
     return result;
 }
 
+// чтение без повторного позиционирования, если фрагменты читаются последовательно
+QByteArray FileSignaling::readFileAt(QFile &a_file, size_t a_offset, size_t a_size)
+{
+    if ((size_t)a_file.pos() != a_offset && !a_file.seek(a_offset))
+        return QByteArray();
+    return a_file.read(a_size);
+}
+
+bool FileSignaling::writeFileAt(QFile &a_file, size_t a_offset, const QByteArray &a_data)
+{
+    if ((size_t)a_file.pos() != a_offset && !a_file.seek(a_offset))
+        return false;
+    return a_file.write(a_data) == a_data.size();
+}
+
+template<typename F> bool FileSignaling::invokeInOwnThread(F &&a_function)
+{
+    if (QThread::currentThread() == thread())
+        return false;
+    QMetaObject::invokeMethod(this, std::forward<F>(a_function), Qt::QueuedConnection);
+    return true;
+}
+
 FileInfo &FileSignaling::getReceivingFileInfoRef(const QString &a_fileName)
 {
     auto it = m_receivingFiles.find(a_fileName);
@@ -254,33 +546,72 @@ FileInfo &FileSignaling::getReceivingFileInfoRef(const QString &a_fileName)
     return it->second;
 }
 
-template<typename T> bool FileSignaling::tryHandleSignal(const QString &a_signal, const QVariant &a_value)
+void FileSignaling::setStatus(FileInfo &a_fileInfo, FileInfo::Status a_status)
 {
-    if (a_signal.left(QString(T::g_signalName).length()) != T::g_signalName)
-        return false;
-    handleSignal<T>(T(a_value));
-    return true;
+    QMutexLocker locker(&m_stateMutex);
+    a_fileInfo.m_status = a_status;
+}
+
+// сигналы темы передаются обработчику в потоке FileSignaling без сравнения имен тем
+template<typename T> void FileSignaling::subscribe(const QString &a_name)
+{
+    m_signaling->subscribe(a_name, this, [this](const QVariant &a_value, QTcpSocket *)
+        {
+            TraceSpan span(T::g_signalName, "file");
+            T signal(a_value);
+            if (signal.isValid())
+                handleSignal<T>(signal); // сигналы неизвестной версии пропускаются
+            else
+                g_decodeErrors.add();
+        });
 }
 
 template<typename T> void FileSignaling::handleSignal(const T &)
 {
-    throw std::exception("FileSignaling.handleSignal: undefined signal handler");
+    throw std::runtime_error("FileSignaling.handleSignal: undefined signal handler");
 }
 
 template<> void FileSignaling::handleSignal(const FileInfoSignal &a_data)
 {
     auto sender = a_data.get_sender();
     auto name = a_data.get_name();
-    auto fileName = createReceivingFileName(sender, name);
-    if (getReceivingFileInfo(fileName).isValid())
-        return; // файл с таким именем уже принимается/принят
-
-    m_receivingFiles[fileName] = FileInfo{ FileInfo::Status::Pending, a_data.get_modification_date(), a_data.get_size() };
-
     FileId fileId{ FileActionType::Receive, sender, name };
-    m_fileNames[fileId] = fileName;
+    auto &existingFileInfo = getReceivingFileInfoRef(getFileName(fileId));
+    if (existingFileInfo.isValid() &&
+        existingFileInfo.m_size == a_data.get_size() && existingFileInfo.m_modificationDate == a_data.get_modification_date())
+    {
+        // повторное предложение того же файла, возможно, с вычисленным хэшем
+        auto hash = a_data.get_hash();
+        if (!existingFileInfo.m_hash.isEmpty() || hash.isEmpty())
+            return;
+        {
+            QMutexLocker locker(&m_stateMutex);
+            existingFileInfo.m_hash = hash;
+        }
+        checkSourceHashes(fileId);
+        return;
+    }
 
-    emit fileAboutToReceive(sender, name);
+    FileInfo fileInfo{ FileInfo::Status::Pending, a_data.get_modification_date(), a_data.get_size() };
+    fileInfo.m_hash = a_data.get_hash();
+    auto sourceFileId = m_sourceFileIds.find(fileId);
+    if (sourceFileId != m_sourceFileIds.end())
+    {
+        auto &identicalFileInfo = getReceivingFileInfoRef(getFileName(sourceFileId->second));
+        if (fileInfo.m_hash.isEmpty() || fileInfo.m_hash == identicalFileInfo.m_hash)
+            return; // отправитель уже является источником этого файла
+        if (identicalFileInfo.m_hash.isEmpty())
+        {
+            // хэш источника сравнивается с хэшем файла, когда тот станет известен
+            m_sourceHashes[fileId] = fileInfo.m_hash;
+            return;
+        }
+        // отправитель был добавлен по имени, размеру и дате, но его хэш отличается: файл принимается от него отдельно
+        detachSource(fileId);
+    }
+    if (!existingFileInfo.isValid() && restoreJournal(fileId, fileInfo))
+        return; // прием, прерванный перезапуском, продолжается
+    offerReceivingFile(fileId, fileInfo);
 }
 
 template<> void FileSignaling::handleSignal(const FileContentsSignal &a_data)
@@ -292,92 +623,749 @@ template<> void FileSignaling::handleSignal(const FileContentsSignal &a_data)
     FileId fileId{ FileActionType::Send, sender, name };
     auto fileName = getFileName(fileId);
     if (!fileName.isNull())
-    {
-        // отправка
-        QFile file(fileName);
-        if (!file.open(QIODevice::ReadOnly))
-        {
-            // файл удален
-            sendFileContents(sender, name, offset, QByteArray());
-            return;
-        }
-        if (!file.seek(offset))
-        {
-            // неправильное смещение
-            sendFileContents(sender, name, offset, QByteArray());
-            return;
-        }
-        auto contents = file.read(size);
-        if (contents.size() != size)
-        {
-            // неправильный размер
-            sendFileContents(sender, name, offset, QByteArray());
-            return;
-        }
-        sendFileContents(sender, name, offset, contents);
-        //m_offsets[fileId] = offset + size; // обновляем смещение для индикатора выполнения
-        emit fileFragmentSent(sender, name, offset, size);
-    }
+        serveFileContents(sender, name, offset, size); // отправка
     else
     {
         // прием
         fileId = FileId{ FileActionType::Receive, sender, name };
+        auto sourceFileId = m_sourceFileIds.find(fileId);
+        if (sourceFileId != m_sourceFileIds.end())
+            fileId = sourceFileId->second; // фрагмент от дополнительного отправителя
         fileName = getFileName(fileId);
         if (fileName.isNull())
             return; // файл не запрашивался
         auto &fileInfo = getReceivingFileInfoRef(fileName);
         if (!fileInfo.isValid())
             return;
-        if (fileInfo.m_status != FileInfo::Status::Started)
-            return; // пользователь отказался от приема файла
-        if (size == 0)
+        auto windowIt = m_windows.find(fileId);
+        if (fileInfo.m_status != FileInfo::Status::Started || windowIt == m_windows.end())
+            return; // пользователь отказался от приема файла или файл уже принят и проверяется
+        auto &window = windowIt->second;
+        auto pendingFragment = window.m_pendingFragments.find(offset);
+        if (pendingFragment == window.m_pendingFragments.end() || pendingFragment->second.m_source != sender)
+            return; // фрагмент не запрашивался у этого узла или уже получен
+        auto contents = a_data.get_contents();
+        if (size == 0 || (size_t)contents.size() != pendingFragment->second.m_size)
         {
-            // отправитель вернул ошибку
-            fileInfo.m_status = FileInfo::Status::Error;
+            // отправитель вернул ошибку: фрагмент запрашивается у остальных узлов, а этот узел больше не используется
+            auto &sources = m_sources[fileId];
+            sources.erase(sender);
+            window.m_missingFragments[offset] = pendingFragment->second.m_size;
+            window.m_pendingFragments.erase(pendingFragment);
+            if (!sources.empty())
+            {
+                requestFragments();
+                return;
+            }
+            setStatus(fileInfo, FileInfo::Status::Error);
+            m_windows.erase(fileId);
+            emit fileStatusChanged(fileId.m_userId, fileId.m_name);
+            scheduleTransfers();
             return;
         }
-        auto &offset = m_offsets[fileId];
-        if (offset != offset)
+        // хэши блоков проверяются до записи, поврежденный фрагмент запрашивается заново отдельно от остальных
+        auto chunkHashes = offset % FileHash::g_chunkSize == 0 ? FileHash::hashChunks(contents) : QByteArray();
+        auto hashes = a_data.get_hashes();
+        if (!hashes.isEmpty() && hashes != chunkHashes)
         {
-            // неправильное смещение
-            fileInfo.m_status = FileInfo::Status::Error;
+            window.m_pendingFragments.erase(pendingFragment);
+            g_corruptedFragments.add();
+            if (++window.m_corruptedFragments[offset] < m_maxCorruptedFragmentRetries)
+            {
+                window.m_missingFragments[offset] = contents.size();
+                requestFragments();
+                return;
+            }
+            setStatus(fileInfo, FileInfo::Status::Error);
+            m_windows.erase(fileId);
+            saveJournal(fileId);
+            emit fileStatusChanged(fileId.m_userId, fileId.m_name);
+            scheduleTransfers();
             return;
         }
-        QFile file(fileName);
-        file.open(QIODevice::Append);
-        if (file.pos() != offset)
+        auto file = openFile(fileId, fileName);
+        if (file == nullptr || !writeFileAt(*file, offset, contents))
         {
-            // неправильный размер локального файла
-            fileInfo.m_status = FileInfo::Status::Error;
+            // локальный файл недоступен
+            setStatus(fileInfo, FileInfo::Status::Error);
+            closeFile(fileId);
+            m_windows.erase(fileId);
+            emit fileStatusChanged(fileId.m_userId, fileId.m_name);
+            scheduleTransfers();
             return;
         }
-        file.write(a_data.get_contents());
-        size = a_data.get_contents().size();
-        offset += a_data.get_contents().size();
+        updatePeerStats(sender, contents.size(), pendingFragment->second.m_requestTime);
+        g_receivedBytes.add(contents.size());
+        window.m_pendingFragments.erase(pendingFragment);
+        window.m_receivedFragments[offset] = contents.size();
+        window.m_corruptedFragments.erase(offset);
+        auto &fileChunkHashes = m_chunkHashes[fileId];
+        for (qsizetype i = 0; i < chunkHashes.size() / FileHash::g_hashSize; i++)
+        {
+            auto chunk = offset / FileHash::g_chunkSize + (size_t)i;
+            if (chunk < fileChunkHashes.size())
+                fileChunkHashes[chunk] = chunkHashes.mid(i * FileHash::g_hashSize, FileHash::g_hashSize);
+        }
 
-        // запрашиваем следующий фрагмент
-        if (fileInfo.m_status == FileInfo::Status::Started)
+        // сдвигаем принятую без пропусков часть файла
+        auto &receivedOffset = m_offsets[fileId];
+        auto firstOffset = receivedOffset;
+        while (!window.m_receivedFragments.empty() && window.m_receivedFragments.begin()->first == receivedOffset)
         {
-            auto nextFragmentSize = std::min(fileInfo.m_size - offset, m_maxFragmentSize);
-            if (nextFragmentSize != 0)
-                requestFileContents(sender, name, offset, nextFragmentSize);
-            else
+            receivedOffset += window.m_receivedFragments.begin()->second;
+            window.m_receivedFragments.erase(window.m_receivedFragments.begin());
+        }
+
+        auto finished = receivedOffset == fileInfo.m_size;
+        if (finished)
+        {
+            // прием завершен, если хэш файла совпадает с хэшем отправителя;
+            // место файла освобождается после проверки (onFileVerified)
+            file->setFileTime(fileInfo.m_modificationDate, QFileDevice::FileModificationTime);
+            closeFile(fileId);
+            m_windows.erase(fileId);
+            verifyFile(fileId, fileName, fileInfo);
+        }
+        else if (receivedOffset != firstOffset)
+            saveJournal(fileId, false);
+
+        if (receivedOffset != firstOffset)
+            emit fileFragmentReceived(fileId.m_userId, fileId.m_name, firstOffset, receivedOffset - firstOffset);
+
+        // освободившееся место занимает следующий по кругу файл
+        if (!finished)
+            requestFragments();
+    }
+}
+
+void FileSignaling::serveFileContents(const QString &a_receiver, const QString &a_name, size_t a_offset, size_t a_size)
+{
+    TraceSpan span("FileSignaling.serveContents", "file");
+    span.setArgument("bytes", a_size);
+    FileId fileId{ FileActionType::Send, a_receiver, a_name };
+    auto fileName = getFileName(fileId);
+    if (fileName.isNull())
+        return; // отправка отменена, пока запрос ждал
+    // файл не читается, пока получатель не заберет уже отправленные ему данные,
+    // а поток Signaling - прочитанные, но еще не поставленные в очередь узла
+    if (!m_signaling->isWritable(m_signaling->getTopicId(getSignalName(FileContentsSignal::g_signalName, a_receiver))))
+    {
+        auto duplicate = std::any_of(m_deferredRequests.begin(), m_deferredRequests.end(), [&](auto &a_request)
             {
-                fileInfo.m_status = FileInfo::Status::Finished; // прием завершен
-                file.setFileTime(fileInfo.m_modificationDate, QFileDevice::FileModificationTime);
+                return a_request.m_receiver == a_receiver && a_request.m_name == a_name && a_request.m_offset == a_offset;
+            });
+        if (!duplicate)
+            m_deferredRequests.push_back(DeferredRequest{ a_receiver, a_name, a_offset, a_size });
+        return;
+    }
+    auto file = openFile(fileId, fileName);
+    if (file == nullptr)
+    {
+        // файл удален
+        sendFileContents(a_receiver, a_name, a_offset, QByteArray());
+        return;
+    }
+    auto contents = readFileAt(*file, a_offset, a_size);
+    if ((size_t)contents.size() != a_size)
+    {
+        // неправильное смещение или размер
+        sendFileContents(a_receiver, a_name, a_offset, QByteArray());
+        return;
+    }
+    if (a_offset + a_size == (size_t)file->size())
+        closeFile(fileId); // последний фрагмент файла
+    sendFileContents(a_receiver, a_name, a_offset, contents, getChunkHashes(fileId, a_offset, contents));
+    //m_offsets[fileId] = offset + size; // обновляем смещение для индикатора выполнения
+    emit fileFragmentSent(a_receiver, a_name, a_offset, a_size);
+}
+
+void FileSignaling::sendFileContents(const QString &a_receiver, QString a_name, size_t a_offset, const QByteArray &a_contents, const QByteArray &a_hashes)
+{
+    // содержимое файла не должно задерживать сообщения, запросы фрагментов отправляются без задержки
+    g_sentBytes.add(a_contents.size());
+    m_signaling->sendSignal(getSignalName(FileContentsSignal::g_signalName, a_receiver), FileContentsSignal(getId(), a_name, a_offset, a_contents, a_hashes),
+        Signaling::Priority::Bulk);
+}
+
+void FileSignaling::requestFileContents(const QString &a_receiver, QString a_name, size_t a_offset, size_t a_size)
+{
+    m_signaling->sendSignal(getSignalName(FileContentsSignal::g_signalName, a_receiver), FileContentsSignal(getId(), a_name, a_offset, a_size));
+}
+
+void FileSignaling::startReceivingFile(const FileId &a_fileId, FileInfo &a_fileInfo)
+{
+    auto offset = m_offsets[a_fileId];
+    auto file = openFile(a_fileId, getFileName(a_fileId));
+    if (file == nullptr || (size_t)file->size() < offset)
+    {
+        // локальный файл недоступен или изменен
+        closeFile(a_fileId);
+        setStatus(a_fileInfo, FileInfo::Status::Error);
+        return;
+    }
+    if (offset == a_fileInfo.m_size)
+    {
+        // пустой файл запрашивать не нужно
+        file->setFileTime(a_fileInfo.m_modificationDate, QFileDevice::FileModificationTime);
+        closeFile(a_fileId);
+        setStatus(a_fileInfo, FileInfo::Status::Finished);
+        emit fileFragmentReceived(a_fileId.m_userId, a_fileId.m_name, offset, 0);
+        return;
+    }
+    setStatus(a_fileInfo, FileInfo::Status::Started);
+    // фрагменты, запрошенные до паузы, запрашиваются заново
+    m_windows[a_fileId] = ReceivingWindow{ offset };
+    m_chunkHashes[a_fileId].resize(FileHash::getChunkCount(a_fileInfo.m_size));
+    // после ошибок всех дополнительных отправителей файл снова запрашивается у исходного
+    m_sources[a_fileId].insert(a_fileId.m_userId);
+}
+
+// запуск ожидающих файлов в порядке приоритета с учетом ограничений на количество одновременных передач
+void FileSignaling::scheduleTransfers()
+{
+    size_t activeFiles = 0;
+    std::map<QString, size_t> activePeerFiles;
+    // сведения о принимаемых файлах изменяются только в этом потоке, поэтому указатели действительны и после блокировки
+    std::vector<std::pair<FileId, FileInfo *>> queuedFiles;
+    {
+        QMutexLocker locker(&m_stateMutex);
+        for (auto &file : m_fileNames)
+        {
+            if (file.first.m_action != FileActionType::Receive)
+                continue;
+            auto &fileInfo = getReceivingFileInfoRef(file.second);
+            if (fileInfo.m_status == FileInfo::Status::Started)
+            {
+                activeFiles++;
+                activePeerFiles[file.first.m_userId]++;
             }
+            else if (fileInfo.m_status == FileInfo::Status::Queued)
+                queuedFiles.emplace_back(file.first, &fileInfo);
+        }
+    }
+    std::sort(queuedFiles.begin(), queuedFiles.end(), [](auto &a_file1, auto &a_file2)
+        {
+            if (a_file1.second->m_priority != a_file2.second->m_priority)
+                return a_file1.second->m_priority > a_file2.second->m_priority;
+            return a_file1.second->m_queueNumber < a_file2.second->m_queueNumber;
+        });
+    auto startedFiles = 0;
+    for (auto &file : queuedFiles)
+    {
+        if (activeFiles >= m_maxActiveFiles)
+            break;
+        auto &peerFiles = activePeerFiles[file.first.m_userId];
+        if (peerFiles >= m_maxActiveFilesPerPeer)
+            continue; // от этого узла уже принимается достаточно файлов
+        startReceivingFile(file.first, *file.second);
+        startedFiles++;
+        if (file.second->m_status == FileInfo::Status::Started)
+        {
+            activeFiles++;
+            peerFiles++;
+        }
+        emit fileStatusChanged(file.first.m_userId, file.first.m_name);
+    }
+    g_activeFiles.set(activeFiles);
+    g_queuedFiles.set(queuedFiles.size() - startedFiles);
+    requestFragments();
+}
+
+// фрагменты запрашиваются у принимаемых файлов по одному по кругу, пока не исчерпан общий лимит,
+// поэтому одновременно принимаемые файлы делят канал поровну
+void FileSignaling::requestFragments()
+{
+    auto pendingFragments = getPendingFragmentCount();
+    for (bool requested = true; requested && pendingFragments < m_maxPendingFragments;)
+    {
+        requested = false;
+        auto it = m_windows.upper_bound(m_lastRequestedFile);
+        for (size_t i = 0; i < m_windows.size() && pendingFragments < m_maxPendingFragments; i++, it++)
+        {
+            if (it == m_windows.end())
+                it = m_windows.begin();
+            if (!requestNextFragment(it->first, it->second))
+                continue;
+            m_lastRequestedFile = it->first;
+            pendingFragments++;
+            requested = true;
         }
+    }
+}
 
-        emit fileFragmentReceived(sender, name, offset - size, size);
+bool FileSignaling::requestNextFragment(const FileId &a_fileId, ReceivingWindow &a_window)
+{
+    auto &fileInfo = getReceivingFileInfoRef(getFileName(a_fileId));
+    if (fileInfo.m_status != FileInfo::Status::Started)
+        return false;
+    auto source = chooseSource(a_fileId, a_window);
+    if (source.isNull())
+        return false; // все отправители отключены или окно заполнено
+    // окно файла - сумма окон отправителей, чтобы каждый из них был загружен
+    // полученные не по порядку фрагменты тоже занимают окно, что ограничивает объем памяти
+    size_t windowSize = 0;
+    for (auto &fileSource : m_sources[a_fileId])
+        windowSize += getPeerStats(fileSource).m_windowSize;
+    if (a_window.m_pendingFragments.size() + a_window.m_receivedFragments.size() >= windowSize)
+        return false;
+    size_t offset = 0;
+    size_t size = 0;
+    if (!a_window.m_missingFragments.empty())
+    {
+        // сначала запрашиваются фрагменты, не полученные от других узлов
+        offset = a_window.m_missingFragments.begin()->first;
+        size = a_window.m_missingFragments.begin()->second;
+        a_window.m_missingFragments.erase(a_window.m_missingFragments.begin());
+    }
+    else if (a_window.m_requestedOffset < fileInfo.m_size)
+    {
+        offset = a_window.m_requestedOffset;
+        size = std::min(fileInfo.m_size - offset, getPeerStats(source).m_fragmentSize);
+        a_window.m_requestedOffset += size;
     }
+    else
+        return false;
+    a_window.m_pendingFragments[offset] = PendingFragment{ size, source, m_clock.elapsed() };
+    requestFileContents(source, a_fileId.m_name, offset, size);
+    g_requestedFragments.add();
+    return true;
 }
 
-void FileSignaling::sendFileContents(const QString &a_receiver, QString a_name, size_t a_offset, const QByteArray &a_contents)
+// выбирается подключенный отправитель с наименьшей загрузкой своего окна
+QString FileSignaling::chooseSource(const FileId &a_fileId, const ReceivingWindow &a_window)
 {
-    m_signaling->sendSignal(getSignalName(FileContentsSignal::g_signalName, a_receiver), FileContentsSignal(m_id, a_name, a_offset, a_contents).toQVariant());
+    auto sources = m_sources.find(a_fileId);
+    if (sources == m_sources.end())
+        return QString();
+    std::map<QString, size_t> sourceLoads;
+    for (auto &source : sources->second)
+        if (m_offlineUsers.find(source) == m_offlineUsers.end())
+            sourceLoads[source] = 0;
+    for (auto &fragment : a_window.m_pendingFragments)
+    {
+        auto it = sourceLoads.find(fragment.second.m_source);
+        if (it != sourceLoads.end())
+            it->second++;
+    }
+    QString result;
+    double minLoad = 1;
+    for (auto &source : sourceLoads)
+    {
+        auto load = (double)source.second / getPeerStats(source.first).m_windowSize;
+        if (load < minLoad)
+        {
+            minLoad = load;
+            result = source.first;
+        }
+    }
+    return result;
 }
 
-void FileSignaling::requestFileContents(const QString &a_receiver, QString a_name, size_t a_offset, size_t a_size)
+PeerTransferStats &FileSignaling::getPeerStats(const QString &a_source)
+{
+    auto it = m_peerStats.find(a_source);
+    if (it != m_peerStats.end())
+        return it->second;
+    auto &stats = m_peerStats[a_source];
+    stats.m_fragmentSize = m_fragmentSize;
+    stats.m_windowSize = m_windowSize;
+    // номер измерения различает метрики одного узла в нескольких экземплярах FileSignaling, которые удаляются независимо
+    static std::atomic<quint64> statsNumber = 0;
+    stats.m_goodputMetric = &Metrics::get().getGauge("file_peer_goodput_bytes_per_second", "Smoothed receive rate from the peer",
+        QString("peer=\"%1\",stats=\"%2\"").arg(Metric::escapeLabelValue(a_source)).arg(++statsNumber));
+    return stats;
+}
+
+void FileSignaling::clearPeerStats()
+{
+    for (auto &stats : m_peerStats)
+        Metrics::get().remove(*stats.second.m_goodputMetric);
+    m_peerStats.clear();
+}
+
+// Размер фрагмента подбирается так, чтобы он передавался за целевое время: на медленном канале
+// фрагменты не задерживают сообщения в том же соединении, а на быстром их меньше на мегабайт.
+// Окно покрывает произведение скорости на время ответа, чтобы канал не простаивал между ответами.
+void FileSignaling::updatePeerStats(const QString &a_source, size_t a_size, qint64 a_requestTime)
+{
+    static const qint64 measureInterval = 500;
+    auto &stats = getPeerStats(a_source);
+    auto now = m_clock.elapsed();
+    auto rtt = std::max<qint64>(now - a_requestTime, 1);
+    g_fragmentRtt.observe(rtt);
+    stats.m_minRtt = stats.m_minRtt == 0 ? rtt : std::min(stats.m_minRtt, rtt);
+
+    // после простоя интервал измерения начинается заново, чтобы простой не занижал скорость
+    if (stats.m_measureStart == 0 || now - stats.m_measureStart > 4 * measureInterval)
+    {
+        stats.m_measureStart = a_requestTime;
+        stats.m_measuredBytes = 0;
+    }
+    stats.m_measuredBytes += a_size;
+    auto elapsed = now - stats.m_measureStart;
+    if (elapsed < measureInterval)
+        return;
+    auto goodput = (double)stats.m_measuredBytes / elapsed;
+    stats.m_goodput = stats.m_goodput == 0 ? goodput : stats.m_goodput * 0.75 + goodput * 0.25;
+    stats.m_goodputMetric->set((qint64)(stats.m_goodput * 1000));
+    stats.m_measureStart = now;
+    stats.m_measuredBytes = 0;
+
+    auto fragmentSize = (size_t)(stats.m_goodput * m_targetFragmentTime) / FileHash::g_chunkSize * FileHash::g_chunkSize;
+    stats.m_fragmentSize = std::clamp(fragmentSize, m_minFragmentSize, m_maxFragmentSize);
+    auto windowSize = (size_t)std::ceil(stats.m_goodput * stats.m_minRtt / stats.m_fragmentSize) + 1;
+    stats.m_windowSize = std::clamp<size_t>(windowSize, 2, m_maxWindowSize);
+}
+
+// фрагменты, запрошенные у отключившегося узла, запрашиваются у остальных
+void FileSignaling::reassignFragments(const QString &a_source)
+{
+    for (auto &window : m_windows)
+        reassignFragments(a_source, window.second);
+}
+
+void FileSignaling::reassignFragments(const QString &a_source, ReceivingWindow &a_window)
+{
+    auto &pendingFragments = a_window.m_pendingFragments;
+    for (auto it = pendingFragments.begin(); it != pendingFragments.end();)
+    {
+        if (it->second.m_source != a_source)
+        {
+            it++;
+            continue;
+        }
+        a_window.m_missingFragments[it->first] = it->second.m_size;
+        it = pendingFragments.erase(it);
+    }
+}
+
+// новый принимаемый файл или еще один источник уже принимаемого
+void FileSignaling::offerReceivingFile(const FileId &a_fileId, const FileInfo &a_fileInfo)
+{
+    auto fileName = createReceivingFileName(a_fileId.m_userId, a_fileId.m_name);
+    if (getReceivingFileInfo(fileName).isValid())
+        return; // файл с таким именем уже принимается/принят
+
+    auto identicalFileId = findIdenticalFile(a_fileId.m_userId, a_fileId.m_name, a_fileInfo);
+    if (!identicalFileId.m_userId.isNull())
+    {
+        // тот же файл уже предложен другим узлом: отправитель становится еще одним источником фрагментов
+        m_sources[identicalFileId].insert(a_fileId.m_userId);
+        m_sourceFileIds[a_fileId] = identicalFileId;
+        if (!a_fileInfo.m_hash.isEmpty() && getReceivingFileInfo(getFileName(identicalFileId)).m_hash.isEmpty())
+            m_sourceHashes[a_fileId] = a_fileInfo.m_hash;
+        requestFragments();
+        return;
+    }
+
+    {
+        QMutexLocker locker(&m_stateMutex);
+        m_receivingFiles[fileName] = a_fileInfo;
+        m_fileNames[a_fileId] = fileName;
+    }
+    m_sources[a_fileId].insert(a_fileId.m_userId);
+
+    emit fileAboutToReceive(a_fileId.m_userId, a_fileId.m_name);
+}
+
+// дополнительный отправитель перестает быть источником файла, запрошенные у него фрагменты запрашиваются у остальных
+void FileSignaling::detachSource(const FileId &a_sourceFileId)
+{
+    auto sourceFileId = m_sourceFileIds.find(a_sourceFileId);
+    if (sourceFileId == m_sourceFileIds.end())
+        return;
+    auto fileId = sourceFileId->second;
+    m_sources[fileId].erase(a_sourceFileId.m_userId);
+    m_sourceFileIds.erase(sourceFileId);
+    m_sourceHashes.erase(a_sourceFileId);
+    auto window = m_windows.find(fileId);
+    if (window != m_windows.end())
+        reassignFragments(a_sourceFileId.m_userId, window->second);
+    requestFragments();
+}
+
+// хэш файла стал известен: источники, добавленные по имени, размеру и дате, но объявившие другой хэш,
+// отсоединяются, и файл принимается от них отдельно
+void FileSignaling::checkSourceHashes(const FileId &a_fileId)
+{
+    auto fileInfo = getReceivingFileInfo(getFileName(a_fileId));
+    std::vector<std::pair<FileId, QByteArray>> conflictingSources;
+    for (auto &source : m_sourceFileIds)
+    {
+        auto hash = m_sourceHashes.find(source.first);
+        if (!(source.second == a_fileId) || hash == m_sourceHashes.end())
+            continue;
+        if (hash->second != fileInfo.m_hash)
+            conflictingSources.emplace_back(source.first, hash->second);
+        else
+            m_sourceHashes.erase(hash);
+    }
+    for (auto &source : conflictingSources)
+    {
+        FileInfo sourceFileInfo{ FileInfo::Status::Pending, fileInfo.m_modificationDate, fileInfo.m_size };
+        sourceFileInfo.m_hash = source.second;
+        detachSource(source.first);
+        if (!restoreJournal(source.first, sourceFileInfo))
+            offerReceivingFile(source.first, sourceFileInfo);
+    }
+}
+
+// одинаковым считается файл с тем же именем и хэшем, предложенный другим узлом,
+// а пока хэши неизвестны - с тем же именем, размером и датой изменения
+FileId FileSignaling::findIdenticalFile(const QString &a_sender, const QString &a_name, const FileInfo &a_fileInfo) const
+{
+    QMutexLocker locker(&m_stateMutex);
+    for (auto &file : m_fileNames)
+    {
+        if (file.first.m_action != FileActionType::Receive || file.first.m_name != a_name || file.first.m_userId == a_sender)
+            continue;
+        auto it = m_receivingFiles.find(file.second);
+        if (it == m_receivingFiles.end())
+            continue;
+        if (!it->second.m_hash.isEmpty() && !a_fileInfo.m_hash.isEmpty())
+        {
+            if (it->second.m_hash == a_fileInfo.m_hash)
+                return file.first;
+        }
+        else if (it->second.m_size == a_fileInfo.m_size && it->second.m_modificationDate == a_fileInfo.m_modificationDate)
+            return file.first;
+    }
+    return FileId();
+}
+
+void FileSignaling::onFileHashed(const FileId &a_fileId, const QString &a_fileName, const std::vector<QByteArray> &a_chunkHashes)
+{
+    if (getFileName(a_fileId) != a_fileName || a_chunkHashes.empty())
+        return; // отправка отменена или файл недоступен
+    m_chunkHashes[a_fileId] = a_chunkHashes;
+    QFileInfo fileInfo(a_fileName);
+    auto hash = FileHash::getRootHash(a_chunkHashes);
+    m_signaling->sendSignal(getSignalName(FileInfoSignal::g_signalName, a_fileId.m_userId),
+        FileInfoSignal(getId(), a_fileId.m_name, fileInfo.lastModified(), (size_t)fileInfo.size(), hash));
+}
+
+// хэши блоков отправляемого фрагмента: вычисленные заранее или по содержимому
+QByteArray FileSignaling::getChunkHashes(const FileId &a_fileId, size_t a_offset, const QByteArray &a_contents) const
+{
+    if (a_offset % FileHash::g_chunkSize != 0)
+        return QByteArray(); // фрагмент не выровнен по блокам и проверяется только по хэшу файла
+    auto it = m_chunkHashes.find(a_fileId);
+    auto firstChunk = a_offset / FileHash::g_chunkSize;
+    auto chunkCount = FileHash::getChunkCount(a_contents.size());
+    if (it == m_chunkHashes.end() || firstChunk + chunkCount > it->second.size())
+        return FileHash::hashChunks(a_contents);
+    QByteArray result;
+    result.reserve(chunkCount * FileHash::g_hashSize);
+    for (size_t i = firstChunk; i < firstChunk + chunkCount; i++)
+        result.append(it->second[i]);
+    return result;
+}
+
+// Проверка хэша принятого файла. Блоки, хэши которых не запомнены при приеме (например, принятые до перезапуска),
+// хэшируются по файлу в m_hashPool, чтобы не задерживать прием остальных файлов; результат - в onFileVerified.
+void FileSignaling::verifyFile(const FileId &a_fileId, const QString &a_fileName, const FileInfo &a_fileInfo)
+{
+    if (a_fileInfo.m_hash.isEmpty())
+    {
+        onFileVerified(a_fileId, true); // отправитель не сообщил хэш
+        return;
+    }
+    auto chunkHashes = std::move(m_chunkHashes[a_fileId]);
+    m_chunkHashes.erase(a_fileId);
+    chunkHashes.resize(FileHash::getChunkCount(a_fileInfo.m_size));
+    m_hashPool.start([this, a_fileId, a_fileName, a_fileInfo, chunkHashes]() mutable
+        {
+            QFile file(a_fileName);
+            auto verified = file.open(QIODevice::ReadOnly);
+            for (size_t i = 0; verified && i < chunkHashes.size(); i++)
+            {
+                if (!chunkHashes[i].isEmpty())
+                    continue;
+                auto chunk = readFileAt(file, i * FileHash::g_chunkSize, std::min(FileHash::g_chunkSize, a_fileInfo.m_size - i * FileHash::g_chunkSize));
+                chunkHashes[i] = FileHash::hashChunks(chunk);
+            }
+            verified = verified && FileHash::getRootHash(chunkHashes) == a_fileInfo.m_hash;
+            QMetaObject::invokeMethod(this, [this, a_fileId, verified]
+                {
+                    onFileVerified(a_fileId, verified);
+                }, Qt::QueuedConnection);
+        });
+}
+
+void FileSignaling::onFileVerified(const FileId &a_fileId, bool a_verified)
+{
+    auto &fileInfo = getReceivingFileInfoRef(getFileName(a_fileId));
+    // за время проверки прием могли приостановить, отменить или начать заново
+    if (fileInfo.m_status != FileInfo::Status::Started || m_windows.count(a_fileId) != 0)
+        return;
+    setStatus(fileInfo, a_verified ? FileInfo::Status::Finished : FileInfo::Status::Error);
+    m_chunkHashes.erase(a_fileId);
+    removeJournal(a_fileId);
+    emit fileStatusChanged(a_fileId.m_userId, a_fileId.m_name);
+    // освободившееся место занимает следующий файл из очереди
+    scheduleTransfers();
+}
+
+QString FileSignaling::getJournalFileName(const FileId &a_fileId) const
+{
+    return QString("%1/.journal/%2/%3.journal").arg(m_directory).arg(a_fileId.m_userId).arg(a_fileId.m_name);
+}
+
+// Журнал принимаемого файла: сведения о файле, принятая без пропусков часть и хэши ее блоков.
+// Записывается атомарно, поэтому после аварийного завершения остается предыдущая или новая версия.
+// Файл открыт без буферизации, так что записанные фрагменты уже переданы системе к моменту записи журнала.
+void FileSignaling::saveJournal(const FileId &a_fileId, bool a_force)
+{
+    auto now = m_clock.elapsed();
+    auto &journalTime = m_journalTimes[a_fileId];
+    if (!a_force && journalTime != 0 && now - journalTime < m_journalInterval)
+        return;
+    journalTime = now;
+
+    auto fileName = getFileName(a_fileId);
+    auto &fileInfo = getReceivingFileInfoRef(fileName);
+    if (!fileInfo.isValid())
+        return;
+    auto offset = m_offsets[a_fileId];
+    // хэши сохраняются только для блоков, принятых целиком
+    std::vector<QByteArray> chunkHashes;
+    auto chunkHashesIt = m_chunkHashes.find(a_fileId);
+    if (chunkHashesIt != m_chunkHashes.end())
+    {
+        auto chunkCount = std::min(offset / FileHash::g_chunkSize, chunkHashesIt->second.size());
+        chunkHashes.assign(chunkHashesIt->second.begin(), chunkHashesIt->second.begin() + chunkCount);
+    }
+
+    // смещение в журнале не должно опережать данные на диске, иначе после сбоя питания
+    // непринятая часть файла будет считаться принятой
+    auto openFile = m_openFiles.find(a_fileId);
+    QFile closedFile(fileName);
+    if (openFile == m_openFiles.end() && !closedFile.open(QIODevice::ReadWrite))
+        return;
+    if (!syncFile(openFile != m_openFiles.end() ? *openFile->second : closedFile))
+        return;
+
+    auto journalFileName = getJournalFileName(a_fileId);
+    if (!QDir().mkpath(QFileInfo(journalFileName).path()))
+        return;
+    QSaveFile file(journalFileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+    stream << g_journalVersion << fileName << fileInfo.m_modificationDate << (quint64)fileInfo.m_size << fileInfo.m_hash
+        << (quint64)offset << (quint64)chunkHashes.size();
+    for (auto &hash : chunkHashes)
+        stream << hash;
+    file.commit();
+}
+
+bool FileSignaling::restoreJournal(const FileId &a_fileId, const FileInfo &a_fileInfo)
+{
+    QFile file(getJournalFileName(a_fileId));
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    QDataStream stream(&file);
+    stream.setVersion(QDataStream::Qt_6_0);
+    quint32 version = 0;
+    QString fileName;
+    QDateTime modificationDate;
+    quint64 size = 0;
+    QByteArray hash;
+    quint64 offset = 0;
+    quint64 chunkCount = 0;
+    stream >> version >> fileName >> modificationDate >> size >> hash >> offset >> chunkCount;
+    if (stream.status() != QDataStream::Ok || version != g_journalVersion ||
+        chunkCount > FileHash::getChunkCount(size))
+        return false;
+    std::vector<QByteArray> chunkHashes(chunkCount);
+    for (auto &chunkHash : chunkHashes)
+        stream >> chunkHash;
+    if (stream.status() != QDataStream::Ok)
+        return false;
+    file.close();
+
+    // журнал относится к другой версии файла или принятая часть файла потеряна
+    if (modificationDate != a_fileInfo.m_modificationDate || size != a_fileInfo.m_size ||
+        (!hash.isEmpty() && !a_fileInfo.m_hash.isEmpty() && hash != a_fileInfo.m_hash) ||
+        (size_t)QFileInfo(fileName).size() < offset || getReceivingFileInfo(fileName).isValid())
+    {
+        removeJournal(a_fileId);
+        return false;
+    }
+
+    auto fileInfo = a_fileInfo;
+    fileInfo.m_status = FileInfo::Status::Paused;
+    if (fileInfo.m_hash.isEmpty())
+        fileInfo.m_hash = hash;
+    {
+        QMutexLocker locker(&m_stateMutex);
+        m_receivingFiles[fileName] = fileInfo;
+        m_fileNames[a_fileId] = fileName;
+    }
+    m_sources[a_fileId].insert(a_fileId.m_userId);
+    m_offsets[a_fileId] = offset;
+    chunkHashes.resize(FileHash::getChunkCount(size));
+    m_chunkHashes[a_fileId] = chunkHashes;
+
+    emit fileAboutToReceive(a_fileId.m_userId, a_fileId.m_name);
+    emit fileFragmentReceived(a_fileId.m_userId, a_fileId.m_name, 0, offset);
+    receiveFile(a_fileId.m_userId, a_fileId.m_name);
+    return true;
+}
+
+void FileSignaling::removeJournal(const FileId &a_fileId)
+{
+    m_journalTimes.erase(a_fileId);
+    QFile::remove(getJournalFileName(a_fileId));
+}
+
+void FileSignaling::removeSources(const FileId &a_fileId)
+{
+    m_sources.erase(a_fileId);
+    for (auto it = m_sourceFileIds.begin(); it != m_sourceFileIds.end();)
+    {
+        if (it->second == a_fileId)
+        {
+            m_sourceHashes.erase(it->first);
+            it = m_sourceFileIds.erase(it);
+        }
+        else
+            it++;
+    }
+}
+
+size_t FileSignaling::getPendingFragmentCount() const
+{
+    size_t result = 0;
+    for (auto &window : m_windows)
+        result += window.second.m_pendingFragments.size();
+    return result;
+}
+
+// открытые файлы хранятся до завершения передачи, чтобы не открывать файл для каждого фрагмента
+QFile *FileSignaling::openFile(const FileId &a_fileId, const QString &a_fileName)
+{
+    auto it = m_openFiles.find(a_fileId);
+    if (it != m_openFiles.end())
+    {
+        m_openFilesOrder.remove(a_fileId);
+        m_openFilesOrder.push_back(a_fileId);
+        return it->second.get();
+    }
+    // фрагменты читаются и пишутся целиком, поэтому буферизация QFile не нужна
+    auto mode = a_fileId.m_action == FileActionType::Send ? QIODevice::ReadOnly : QIODevice::ReadWrite;
+    auto file = std::make_unique<QFile>(a_fileName);
+    if (!file->open(mode | QIODevice::Unbuffered))
+        return nullptr;
+    if (m_openFiles.size() >= m_maxOpenFiles)
+        closeFile(m_openFilesOrder.front()); // закрываем давно не использованный файл
+    m_openFilesOrder.push_back(a_fileId);
+    return (m_openFiles[a_fileId] = std::move(file)).get();
+}
+
+void FileSignaling::closeFile(const FileId &a_fileId)
 {
-    m_signaling->sendSignal(getSignalName(FileContentsSignal::g_signalName, a_receiver), FileContentsSignal(m_id, a_name, a_offset, a_size).toQVariant());
+    if (m_openFiles.erase(a_fileId) != 0)
+        m_openFilesOrder.remove(a_fileId);
 }
@@ -3,8 +3,17 @@
 #include <QObject>
 #include <QTimer>
 #include <QDateTime>
+#include <QFile>
+#include <QMutex>
+#include <QElapsedTimer>
+#include <QThreadPool>
+#include <list>
+#include <deque>
+#include <set>
 #include "signaling.h"
 
+class MetricGauge;
+
 // Информация о принимаемом файле.
 struct FileInfo
 {
@@ -12,6 +21,7 @@ struct FileInfo
     {
         Unknown,
         Pending,
+        Queued, // прием разрешен, но ожидает своей очереди
         Started,
         Paused,
         Finished,
@@ -27,6 +37,12 @@ struct FileInfo
     QDateTime m_modificationDate;
     // размер файла
     size_t m_size = 0;
+    // файлы с большим приоритетом принимаются раньше
+    int m_priority = 0;
+    // порядок постановки в очередь среди файлов с одинаковым приоритетом
+    quint64 m_queueNumber = 0;
+    // хэш содержимого (FileHash), пустой, пока отправитель его не вычислил
+    QByteArray m_hash;
 };
 
 enum class FileActionType
@@ -45,12 +61,67 @@ struct FileId
     QString m_name; // короткое имя файла
 };
 
+// Запрошенный, но еще не полученный фрагмент.
+struct PendingFragment
+{
+    size_t m_size = 0;
+    // узел, у которого запрошен фрагмент
+    QString m_source;
+    qint64 m_requestTime = 0;
+};
+
+// Запрос фрагмента, отложенный до освобождения очереди отправки получателю.
+struct DeferredRequest
+{
+    QString m_receiver;
+    QString m_name;
+    size_t m_offset = 0;
+    size_t m_size = 0;
+};
+
+// Измерения передачи от узла, по которым подбираются размер фрагмента и окно.
+struct PeerTransferStats
+{
+    // минимальное время ответа на запрос фрагмента, мс; не включает ожидание в очереди отправителя
+    qint64 m_minRtt = 0;
+    // сглаженная скорость получения полезных данных, байт/мс
+    double m_goodput = 0;
+    // начало текущего интервала измерения скорости и полученные за него байты
+    qint64 m_measureStart = 0;
+    size_t m_measuredBytes = 0;
+    size_t m_fragmentSize = 0;
+    size_t m_windowSize = 0;
+    // метрика скорости получения от узла (Metrics)
+    MetricGauge *m_goodputMetric = nullptr;
+};
+
+// Окно запрошенных фрагментов принимаемого файла.
+struct ReceivingWindow
+{
+    // смещение, до которого фрагменты уже запрошены
+    size_t m_requestedOffset = 0;
+    // запрошенные, но еще не полученные фрагменты по смещениям
+    std::map<size_t, PendingFragment> m_pendingFragments;
+    // фрагменты, которые нужно запросить заново (у другого узла): смещение - размер
+    std::map<size_t, size_t> m_missingFragments;
+    // количество фрагментов, не прошедших проверку хэша, по смещениям
+    std::map<size_t, int> m_corruptedFragments;
+    // фрагменты, записанные не по порядку: смещение - размер
+    std::map<size_t, size_t> m_receivedFragments;
+};
+
+// Передача файлов.
+// Может работать в отдельном потоке: открытые методы можно вызывать из любого потока.
+// Изменяющие методы выполняются в потоке FileSignaling в порядке поступления, а сведения о файлах
+// читаются под m_stateMutex, который не удерживается на время чтения, записи и хэширования файлов.
 class FileSignaling : public QObject
 {
     Q_OBJECT
 
 public:
-    FileSignaling(std::shared_ptr<Signaling> a_signaling);
+    // a_directory - каталог принимаемых файлов, по умолчанию files в текущем каталоге
+    FileSignaling(std::shared_ptr<Signaling> a_signaling, const QString &a_directory = QString());
+    ~FileSignaling();
 
     QString getId() const;
     void setId(const QString &a_id);
@@ -62,34 +133,134 @@ public:
     void removeFile(const QString &a_userId, const QString &a_name);
     QString getFileName(const FileId &a_fileId) const;
     QStringList getFileNames(const QString &a_userId) const;
-    const FileId &getFileId(const QString &a_fileName) const;
-    const FileInfo &getReceivingFileInfo(const QString &a_fileName) const;
+    FileId getFileId(const QString &a_fileName) const;
+    FileInfo getReceivingFileInfo(const QString &a_fileName) const;
+    void setReceivingFilePriority(const QString &a_sender, const QString &a_name, int a_priority);
+    size_t getWindowSize() const;
+    void setWindowSize(size_t a_windowSize);
+    void setFragmentSizeLimits(size_t a_minFragmentSize, size_t a_maxFragmentSize, size_t a_maxWindowSize, int a_targetFragmentTime);
+    void setTransferLimits(size_t a_maxActiveFiles, size_t a_maxActiveFilesPerPeer, size_t a_maxPendingFragments);
+
+public slots:
+    void onUserAdded(QString a_id);
+    void onUserRemoved(QString a_id);
 
 signals:
     void fileAboutToReceive(QString a_sender, QString a_name);
+    void fileStatusChanged(QString a_sender, QString a_name);
     void fileFragmentSent(QString a_receiver, QString a_name, size_t a_offset, size_t a_size);
     void fileFragmentReceived(QString a_sender, QString a_name, size_t a_offset, size_t a_size);
 
 private slots:
-    void onSignalReceived(QString a_signal, QVariant a_value);
+    void onSubscriberAdded(Signaling::TopicId a_topic);
+    void checkPendingFragments();
+    void onWritable();
 
 private:
+    static constexpr quint32 g_journalVersion = 1;
+
     static QString getSignalName(const QString &a_prefix, const QString &a_id);
-    static QString createReceivingFileName(const QString &a_user, const QString &a_name);
+    QString createReceivingFileName(const QString &a_user, const QString &a_name) const;
+    static QByteArray readFileAt(QFile &a_file, size_t a_offset, size_t a_size);
+    static bool writeFileAt(QFile &a_file, size_t a_offset, const QByteArray &a_data);
 
+    template<typename F> bool invokeInOwnThread(F &&a_function);
     FileInfo &getReceivingFileInfoRef(const QString &a_fileName);
-    template<typename T> bool tryHandleSignal(const QString &a_signal, const QVariant &a_value);
+    void setStatus(FileInfo &a_fileInfo, FileInfo::Status a_status);
+    // подписка на тему с обработчиком сигнала T
+    template<typename T> void subscribe(const QString &a_name);
     template<typename T> void handleSignal(const T &a_signal);
-    void sendFileContents(const QString &a_receiver, QString a_name, size_t a_offset, const QByteArray &a_contents);
+    void serveFileContents(const QString &a_receiver, const QString &a_name, size_t a_offset, size_t a_size);
+    void sendFileContents(const QString &a_receiver, QString a_name, size_t a_offset, const QByteArray &a_contents, const QByteArray &a_hashes = QByteArray());
     void requestFileContents(const QString &a_receiver, QString a_name, size_t a_offset, size_t a_size);
+    void startReceivingFile(const FileId &a_fileId, FileInfo &a_fileInfo);
+    void scheduleTransfers();
+    void requestFragments();
+    bool requestNextFragment(const FileId &a_fileId, ReceivingWindow &a_window);
+    QString chooseSource(const FileId &a_fileId, const ReceivingWindow &a_window);
+    PeerTransferStats &getPeerStats(const QString &a_source);
+    // измерения удаляются вместе с метриками
+    void clearPeerStats();
+    void updatePeerStats(const QString &a_source, size_t a_size, qint64 a_requestTime);
+    void reassignFragments(const QString &a_source);
+    void reassignFragments(const QString &a_source, ReceivingWindow &a_window);
+    void offerReceivingFile(const FileId &a_fileId, const FileInfo &a_fileInfo);
+    void detachSource(const FileId &a_sourceFileId);
+    void checkSourceHashes(const FileId &a_fileId);
+    FileId findIdenticalFile(const QString &a_sender, const QString &a_name, const FileInfo &a_fileInfo) const;
+    void removeSources(const FileId &a_fileId);
+    void onFileHashed(const FileId &a_fileId, const QString &a_fileName, const std::vector<QByteArray> &a_chunkHashes);
+    QByteArray getChunkHashes(const FileId &a_fileId, size_t a_offset, const QByteArray &a_contents) const;
+    void verifyFile(const FileId &a_fileId, const QString &a_fileName, const FileInfo &a_fileInfo);
+    void onFileVerified(const FileId &a_fileId, bool a_verified);
+    QString getJournalFileName(const FileId &a_fileId) const;
+    void saveJournal(const FileId &a_fileId, bool a_force = true);
+    bool restoreJournal(const FileId &a_fileId, const FileInfo &a_fileInfo);
+    void removeJournal(const FileId &a_fileId);
+    size_t getPendingFragmentCount() const;
+    QFile *openFile(const FileId &a_fileId, const QString &a_fileName);
+    void closeFile(const FileId &a_fileId);
 
     std::shared_ptr<Signaling> m_signaling;
+    // Защищает m_id, m_fileNames, m_receivingFiles и m_windowSize, которые читаются из других потоков.
+    // m_id и m_fileNames изменяются в потоке вызывающего (setId, sendFile) и всегда читаются под блокировкой,
+    // остальное изменяется только в потоке FileSignaling и читается в нем без блокировки.
+    mutable QMutex m_stateMutex;
+    QString m_directory;
     QString m_id;
     // отправляемые и принимаемые файлы: ид - абсолютное имя
     std::map<FileId, QString> m_fileNames;
-    // позиции для запроса очередных фрагментов
+    // позиции, до которых файлы приняты без пропусков
     std::map<FileId, size_t> m_offsets;
+    // окна запрошенных фрагментов принимаемых файлов
+    std::map<FileId, ReceivingWindow> m_windows;
     // абсолютное имя - информация о получении
     std::map<QString, FileInfo> m_receivingFiles;
-    size_t m_maxFragmentSize = 1024 * 1024;
+    // размер фрагмента и окно подбираются для каждого узла в этих пределах;
+    // начальные значения используются, пока скорость узла не измерена
+    size_t m_fragmentSize = 1024 * 1024;
+    size_t m_minFragmentSize = 256 * 1024;
+    size_t m_maxFragmentSize = 8 * 1024 * 1024;
+    // количество одновременно запрошенных у одного узла фрагментов одного файла
+    size_t m_windowSize = 8;
+    size_t m_maxWindowSize = 64;
+    // время передачи одного фрагмента, к которому подбирается его размер, мс
+    int m_targetFragmentTime = 100;
+    std::map<QString, PeerTransferStats> m_peerStats;
+    // ограничения планировщика: одновременно принимаемые файлы всего и от одного узла,
+    // запрошенные фрагменты всех файлов
+    size_t m_maxActiveFiles = 4;
+    size_t m_maxActiveFilesPerPeer = 2;
+    size_t m_maxPendingFragments = 32;
+    quint64 m_nextQueueNumber = 0;
+    // файл, у которого последним запрошен фрагмент; следующий запрос - у следующего по кругу
+    FileId m_lastRequestedFile{ FileActionType::Receive };
+    // узлы, предложившие одинаковый файл: ид принимаемого файла - отправители
+    std::map<FileId, std::set<QString>> m_sources;
+    // ид файла у дополнительного отправителя - ид принимаемого файла
+    std::map<FileId, FileId> m_sourceFileIds;
+    // хэши, объявленные дополнительными отправителями, пока хэш принимаемого файла неизвестен
+    std::map<FileId, QByteArray> m_sourceHashes;
+    // отключившиеся пользователи; у них фрагменты не запрашиваются
+    std::set<QString> m_offlineUsers;
+    // фрагмент, не полученный за это время, запрашивается у другого узла
+    int m_fragmentTimeout = 30000;
+    QElapsedTimer m_clock;
+    std::unique_ptr<QTimer> m_fragmentTimer;
+    // хэши блоков отправляемых файлов и принятых блоков принимаемых файлов
+    std::map<FileId, std::vector<QByteArray>> m_chunkHashes;
+    // фрагмент, хэш которого не совпал столько раз, считается ошибкой файла
+    int m_maxCorruptedFragmentRetries = 3;
+    // журнал принимаемого файла перезаписывается не чаще этого интервала
+    int m_journalInterval = 1000;
+    std::map<FileId, qint64> m_journalTimes;
+    // запросы получателей, очередь отправки которым заполнена
+    std::deque<DeferredRequest> m_deferredRequests;
+    // открытые отправляемые и принимаемые файлы
+    std::map<FileId, std::unique_ptr<QFile>> m_openFiles;
+    // порядок использования открытых файлов: последний использованный - в конце
+    std::list<FileId> m_openFilesOrder;
+    size_t m_maxOpenFiles = 32;
+    // вычисление хэшей отправляемых файлов и проверка принятых; объявлен последним, чтобы дождаться задач до удаления остальных полей
+    QThreadPool m_hashPool;
 };
@@ -0,0 +1,16 @@
+﻿#include <QFile>
+#ifdef Q_OS_WIN
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "file_sync.h"
+
+bool syncFile(QFile &a_file)
+{
+#ifdef Q_OS_WIN
+    return _commit(a_file.handle()) == 0;
+#else
+    return fsync(a_file.handle()) == 0;
+#endif
+}
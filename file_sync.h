@@ -0,0 +1,6 @@
+﻿#pragma once
+
+class QFile;
+
+// запись данных открытого файла на диск (fsync); false при ошибке
+bool syncFile(QFile &a_file);
@@ -0,0 +1,385 @@
+﻿#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QDataStream>
+#include "history_store.h"
+
+QString Message::encode(const QString &a_string)
+{
+    QString result;
+    std::for_each(a_string.begin(), a_string.end(), [&result](auto a_char) mutable
+        {
+            if (a_char == '\n')
+                result.append("\\n");
+            else if (a_char == '\\')
+                result.append("\\\\");
+            else
+                result.append(a_char);
+        });
+    return result;
+}
+
+QString Message::decode(const QString &a_string)
+{
+    QString result;
+    std::for_each(a_string.begin(), a_string.end(), [m_escape = false, &result](auto a_char) mutable
+        {
+            if (m_escape)
+            {
+                if (a_char == 'n')
+                    result.append('\n');
+                else if (a_char == '\\')
+                    result.append('\\');
+                m_escape = false;
+            }
+            else if (a_char == '\\')
+                m_escape = true;
+            else
+                result.append(a_char);
+        });
+    return result;
+}
+
+Message Message::fromString(const QString &a_string, bool *a_ok)
+{
+    Message result;
+    if (a_string.length() < 1 + m_dateTimeFormat.length())
+    {
+        if (a_ok != nullptr)
+            *a_ok = false;
+        return result;
+    }
+    result.m_date = QDateTime::fromString(a_string.mid(1, m_dateTimeFormat.length()), m_dateTimeFormat);
+    if ((a_string[0] != '>' && a_string[0] != '<') || !result.m_date.isValid())
+    {
+        if (a_ok != nullptr)
+            *a_ok = false;
+        return result;
+    }
+    result.m_sentToSender = a_string[0] == '>';
+    if (a_ok != nullptr)
+        *a_ok = true;
+    result.m_text = decode(a_string.mid(1 + m_dateTimeFormat.length()));
+    return result;
+}
+
+QString Message::toString() const
+{
+    return QString("%1%2%3").arg(m_sentToSender ? ">" : "<").arg(m_date.toString(m_dateTimeFormat)).arg(encode(m_text));
+}
+
+//-------------------------------------------------------------------------------------------------
+HistoryStore::HistoryStore(const QString &a_directory, const QString &a_legacyDirectory)
+{
+    m_directory = a_directory;
+    m_legacyDirectory = a_legacyDirectory;
+}
+
+QStringList HistoryStore::getContacts() const
+{
+    QStringList result;
+    for (auto &fileInfo : QDir(m_directory).entryInfoList(QStringList("*.history"), QDir::Files))
+        result.append(fileInfo.completeBaseName());
+    if (!m_legacyDirectory.isNull())
+        for (auto &fileInfo : QDir(m_legacyDirectory).entryInfoList(QDir::Files))
+            if (!result.contains(fileInfo.fileName()))
+                result.append(fileInfo.fileName());
+    return result;
+}
+
+size_t HistoryStore::getMessageCount(const QString &a_id)
+{
+    QMutexLocker locker(&m_mutex);
+    return getContact(a_id).m_count;
+}
+
+QList<Message> HistoryStore::getMessages(const QString &a_id, size_t a_first, size_t a_count)
+{
+    QList<Message> result;
+    QMutexLocker locker(&m_mutex);
+    auto &contact = getContact(a_id);
+    if (a_first >= contact.m_count || a_count == 0)
+        return result;
+    a_count = std::min(a_count, contact.m_count - a_first);
+
+    // читаются только блоки, содержащие нужные сообщения
+    auto firstBlock = a_first / g_blockSize;
+    auto endBlock = (a_first + a_count - 1) / g_blockSize + 1;
+    auto begin = contact.m_blocks[firstBlock].m_offset;
+    auto end = endBlock < contact.m_blocks.size() ? contact.m_blocks[endBlock].m_offset : contact.m_size;
+    QFile file(getFileName(a_id, "history"));
+    file.open(QIODevice::ReadOnly);
+    auto data = readHistory(file, m_writer.getUnwrittenData(file.fileName()), contact, begin, end);
+
+    qsizetype position = 0;
+    for (size_t i = firstBlock * g_blockSize; i < a_first; i++)
+        if (!readRecord(data, position, nullptr))
+            return result;
+    result.reserve(a_count);
+    for (size_t i = 0; i < a_count; i++)
+    {
+        Message message;
+        if (!readRecord(data, position, &message))
+            break;
+        result.append(message);
+    }
+    return result;
+}
+
+std::map<size_t, Message> HistoryStore::getMessages(const QString &a_id, const std::set<size_t> &a_numbers)
+{
+    std::map<size_t, Message> result;
+    QMutexLocker locker(&m_mutex);
+    auto &contact = getContact(a_id);
+    if (a_numbers.empty() || contact.m_count == 0)
+        return result;
+    QFile file(getFileName(a_id, "history"));
+    file.open(QIODevice::ReadOnly);
+    auto unwrittenData = m_writer.getUnwrittenData(file.fileName());
+    for (auto it = a_numbers.begin(); it != a_numbers.end() && *it < contact.m_count;)
+    {
+        auto block = *it / g_blockSize;
+        auto begin = contact.m_blocks[block].m_offset;
+        auto end = block + 1 < contact.m_blocks.size() ? contact.m_blocks[block + 1].m_offset : contact.m_size;
+        auto data = readHistory(file, unwrittenData, contact, begin, end);
+        qsizetype position = 0;
+        // сообщения блока разбираются по порядку, полностью - только запрошенные
+        for (auto number = block * g_blockSize; it != a_numbers.end() && *it / g_blockSize == block; number++)
+        {
+            Message message;
+            if (!readRecord(data, position, *it == number ? &message : nullptr))
+                return result;
+            if (*it != number)
+                continue;
+            result[number] = message;
+            ++it;
+        }
+    }
+    return result;
+}
+
+size_t HistoryStore::append(const QString &a_id, const Message &a_message)
+{
+    QMutexLocker locker(&m_mutex);
+    auto &contact = getContact(a_id);
+    // сначала пишется сообщение, затем индекс: после сбоя между ними индекс восстанавливается при загрузке
+    auto record = messageToRecord(a_message);
+    m_writer.write(getFileName(a_id, "history"), record);
+    Block block{ contact.m_size, a_message.m_date.toMSecsSinceEpoch() };
+    contact.m_size += record.size();
+    contact.m_count++;
+    if ((contact.m_count - 1) % g_blockSize == 0)
+        appendBlock(a_id, contact, block);
+    return contact.m_count - 1;
+}
+
+// private:
+// запись: размер, признак направления, дата в мс и текст в UTF-8
+QByteArray HistoryStore::messageToRecord(const Message &a_message)
+{
+    QByteArray body;
+    QDataStream stream(&body, QIODevice::WriteOnly);
+    stream << (quint8)a_message.m_sentToSender << (qint64)a_message.m_date.toMSecsSinceEpoch();
+    auto text = a_message.m_text.toUtf8();
+    stream.writeRawData(text.constData(), text.size());
+
+    QByteArray result;
+    QDataStream resultStream(&result, QIODevice::WriteOnly);
+    resultStream << (quint32)body.size();
+    result.append(body);
+    return result;
+}
+
+// a_message == nullptr - запись пропускается без разбора
+bool HistoryStore::readRecord(const QByteArray &a_data, qsizetype &a_position, Message *a_message)
+{
+    static const qsizetype headerSize = sizeof(quint32);
+    static const qsizetype minBodySize = sizeof(quint8) + sizeof(qint64);
+    if (a_data.size() - a_position < headerSize)
+        return false;
+    QDataStream stream(QByteArray::fromRawData(a_data.constData() + a_position, headerSize));
+    quint32 size = 0;
+    stream >> size;
+    if (size < minBodySize || a_data.size() - a_position - headerSize < (qsizetype)size)
+        return false; // запись не дописана
+    if (a_message != nullptr)
+    {
+        auto body = a_data.constData() + a_position + headerSize;
+        QDataStream bodyStream(QByteArray::fromRawData(body, minBodySize));
+        quint8 sentToSender = 0;
+        qint64 date = 0;
+        bodyStream >> sentToSender >> date;
+        a_message->m_sentToSender = sentToSender != 0;
+        a_message->m_date = QDateTime::fromMSecsSinceEpoch(date);
+        a_message->m_text = QString::fromUtf8(body + minBodySize, size - minBodySize);
+    }
+    a_position += headerSize + size;
+    return true;
+}
+
+// Чтение части истории [a_begin, a_end). Последние записи могут быть еще не записаны в файл (см. HistoryWriter),
+// тогда они берутся из a_unwrittenData, поэтому чтение не ждет фоновой записи.
+QByteArray HistoryStore::readHistory(QFile &a_file, const QByteArray &a_unwrittenData, const Contact &a_contact, quint64 a_begin, quint64 a_end)
+{
+    auto writtenSize = a_contact.m_size - a_unwrittenData.size();
+    QByteArray result;
+    if (a_begin < writtenSize)
+    {
+        // в файле за записанными данными может оказаться недописанная запись, поэтому она не читается
+        if (!a_file.seek(a_begin))
+            return result;
+        result = a_file.read(std::min(a_end, writtenSize) - a_begin);
+        if ((quint64)result.size() < std::min(a_end, writtenSize) - a_begin)
+            return result;
+    }
+    if (a_end > writtenSize)
+    {
+        auto begin = std::max(a_begin, writtenSize);
+        result.append(a_unwrittenData.mid(begin - writtenSize, a_end - begin));
+    }
+    return result;
+}
+
+QString HistoryStore::getFileName(const QString &a_id, const QString &a_suffix) const
+{
+    return QString("%1/%2.%3").arg(m_directory).arg(a_id).arg(a_suffix);
+}
+
+HistoryStore::Contact &HistoryStore::getContact(const QString &a_id)
+{
+    auto it = m_contacts.find(a_id);
+    if (it != m_contacts.end())
+        return it->second;
+    auto &contact = m_contacts[a_id];
+    migrateLegacyHistory(a_id);
+    loadContact(a_id, contact);
+    return contact;
+}
+
+// Загрузка индекса. Сообщения после начала последнего блока пересчитываются по файлу истории:
+// так восстанавливаются записи индекса и отбрасывается запись, недописанная при сбое.
+void HistoryStore::loadContact(const QString &a_id, Contact &a_contact)
+{
+    static const qint64 indexEntrySize = sizeof(Block::m_offset) + sizeof(Block::m_firstDate);
+    QFile indexFile(getFileName(a_id, "index"));
+    auto indexFileSize = indexFile.size();
+    if (indexFile.open(QIODevice::ReadOnly))
+    {
+        QDataStream stream(&indexFile);
+        while (!stream.atEnd())
+        {
+            Block block;
+            stream >> block.m_offset >> block.m_firstDate;
+            if (stream.status() != QDataStream::Ok)
+                break;
+            a_contact.m_blocks.push_back(block);
+        }
+        indexFile.close();
+    }
+
+    QFile file(getFileName(a_id, "history"));
+    if (!file.open(QIODevice::ReadWrite | QIODevice::ExistingOnly))
+    {
+        a_contact.m_blocks.clear();
+        QFile::remove(getFileName(a_id, "index"));
+        return;
+    }
+    // записи индекса за пределами файла истории недействительны
+    while (!a_contact.m_blocks.empty() && a_contact.m_blocks.back().m_offset >= (quint64)file.size())
+        a_contact.m_blocks.pop_back();
+    auto lastBlockOffset = a_contact.m_blocks.empty() ? 0 : a_contact.m_blocks.back().m_offset;
+    auto indexedBlocks = a_contact.m_blocks.size();
+    if (!file.seek(lastBlockOffset))
+        return;
+    auto data = file.read(file.size() - lastBlockOffset);
+
+    size_t count = indexedBlocks == 0 ? 0 : (indexedBlocks - 1) * g_blockSize;
+    qsizetype position = 0;
+    Message message;
+    for (;;)
+    {
+        auto recordPosition = position;
+        if (!readRecord(data, position, &message))
+            break;
+        if (count % g_blockSize == 0 && count / g_blockSize >= indexedBlocks)
+            a_contact.m_blocks.push_back(Block{ lastBlockOffset + recordPosition, message.m_date.toMSecsSinceEpoch() });
+        count++;
+    }
+    a_contact.m_count = count;
+    a_contact.m_size = lastBlockOffset + position;
+    // недописанная запись отрезается, так как новые записи дописываются в конец файла
+    if (a_contact.m_size < (quint64)file.size())
+        file.resize(a_contact.m_size);
+
+    // индекс перезаписывается, если он был неполным или поврежденным
+    if ((qint64)a_contact.m_blocks.size() * indexEntrySize == indexFileSize)
+        return;
+    QFile newIndexFile(getFileName(a_id, "index"));
+    if (!newIndexFile.open(QIODevice::WriteOnly))
+        return;
+    QDataStream stream(&newIndexFile);
+    for (auto &block : a_contact.m_blocks)
+        stream << block.m_offset << block.m_firstDate;
+}
+
+// Файл истории записывается последним, поэтому его наличие означает, что перенос завершен, даже если файл
+// прежнего формата не удалось удалить; индекс, оставшийся от прерванного переноса, перезаписывается.
+void HistoryStore::migrateLegacyHistory(const QString &a_id)
+{
+    if (m_legacyDirectory.isNull())
+        return;
+    auto legacyFileName = QString("%1/%2").arg(m_legacyDirectory).arg(a_id);
+    QFile legacyFile(legacyFileName);
+    if (!legacyFile.exists())
+        return; // история уже перенесена или ее нет
+    if (QFile::exists(getFileName(a_id, "history")))
+    {
+        // повторный перенос перезаписал бы сообщения, добавленные после первого
+        QFile::remove(legacyFileName);
+        return;
+    }
+    if (!legacyFile.open(QIODevice::ReadOnly))
+        return;
+    if (!QDir().mkpath(m_directory))
+        return;
+    Contact contact;
+    QTextStream stream(&legacyFile);
+    QByteArray data;
+    while (!stream.atEnd())
+    {
+        bool ok = false;
+        auto message = Message::fromString(stream.readLine(), &ok);
+        if (!ok)
+            continue;
+        if (contact.m_count % g_blockSize == 0)
+            contact.m_blocks.push_back(Block{ (quint64)data.size(), message.m_date.toMSecsSinceEpoch() });
+        data.append(messageToRecord(message));
+        contact.m_count++;
+    }
+    legacyFile.close();
+
+    // индекс записывается первым: без файла истории он отбрасывается при загрузке
+    QSaveFile indexFile(getFileName(a_id, "index"));
+    if (!indexFile.open(QIODevice::WriteOnly))
+        return;
+    QDataStream indexStream(&indexFile);
+    for (auto &block : contact.m_blocks)
+        indexStream << block.m_offset << block.m_firstDate;
+    if (indexStream.status() != QDataStream::Ok || !indexFile.commit())
+        return;
+    QSaveFile file(getFileName(a_id, "history"));
+    if (!file.open(QIODevice::WriteOnly) || file.write(data) != data.size() || !file.commit())
+        return;
+    QFile::remove(legacyFileName);
+}
+
+void HistoryStore::appendBlock(const QString &a_id, Contact &a_contact, const Block &a_block)
+{
+    a_contact.m_blocks.push_back(a_block);
+    QByteArray entry;
+    QDataStream stream(&entry, QIODevice::WriteOnly);
+    stream << a_block.m_offset << a_block.m_firstDate;
+    m_writer.write(getFileName(a_id, "index"), entry);
+}
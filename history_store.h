@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include <QString>
+#include <QStringList>
+#include <QDateTime>
+#include <QList>
+#include <QMutex>
+#include <map>
+#include <set>
+#include <vector>
+#include "history_writer.h"
+
+struct Message
+{
+    static QString encode(const QString &a_string);
+    static QString decode(const QString &a_string);
+    static Message fromString(const QString &a_string, bool *a_ok = nullptr);
+
+    QString toString() const;
+
+    inline static const QString m_dateTimeFormat{ "dd.MM.yyyy hh:mm:ss" };
+
+    bool m_sentToSender = false;
+    QDateTime m_date;
+    QString m_text;
+};
+
+// История сообщений.
+// Сообщения каждого собеседника дописываются в двоичный файл <id>.history, а в файл <id>.index
+// записывается начало каждого блока из g_blockSize сообщений. При запуске ничего не читается:
+// индекс собеседника загружается при первом обращении, а сообщения читаются постранично.
+// Текстовая история прежних версий переносится в новый формат при первом обращении к собеседнику.
+// Новые сообщения записываются в файлы в фоновом потоке (см. HistoryWriter), а еще не записанные читаются из его очереди.
+// Методы можно вызывать из разных потоков.
+class HistoryStore
+{
+public:
+    static constexpr size_t g_blockSize = 64;
+
+    explicit HistoryStore(const QString &a_directory, const QString &a_legacyDirectory = QString());
+
+    QStringList getContacts() const;
+    size_t getMessageCount(const QString &a_id);
+    // сообщения с номерами [a_first, a_first + a_count)
+    QList<Message> getMessages(const QString &a_id, size_t a_first, size_t a_count);
+    // сообщения с номерами a_numbers, например найденные поиском; каждый блок читается один раз
+    std::map<size_t, Message> getMessages(const QString &a_id, const std::set<size_t> &a_numbers);
+    // возвращает номер добавленного сообщения
+    size_t append(const QString &a_id, const Message &a_message);
+
+private:
+    struct Block
+    {
+        quint64 m_offset = 0;
+        qint64 m_firstDate = 0; // для поиска по дате
+    };
+
+    struct Contact
+    {
+        std::vector<Block> m_blocks;
+        size_t m_count = 0;
+        // размер файла истории без недописанной при сбое записи
+        quint64 m_size = 0;
+    };
+
+    static QByteArray messageToRecord(const Message &a_message);
+    static bool readRecord(const QByteArray &a_data, qsizetype &a_position, Message *a_message);
+    static QByteArray readHistory(QFile &a_file, const QByteArray &a_unwrittenData, const Contact &a_contact, quint64 a_begin, quint64 a_end);
+
+    QString getFileName(const QString &a_id, const QString &a_suffix) const;
+    Contact &getContact(const QString &a_id);
+    void loadContact(const QString &a_id, Contact &a_contact);
+    void migrateLegacyHistory(const QString &a_id);
+    void appendBlock(const QString &a_id, Contact &a_contact, const Block &a_block);
+
+    QString m_directory;
+    QString m_legacyDirectory;
+    QMutex m_mutex;
+    std::map<QString, Contact> m_contacts;
+    HistoryWriter m_writer;
+};
@@ -0,0 +1,181 @@
+﻿#include <QDir>
+#include <QFileInfo>
+#include <QDeadlineTimer>
+#include "history_writer.h"
+#include "file_sync.h"
+#include "settings.h"
+#include "metrics.h"
+
+static MetricCounter &g_writeErrors = Metrics::get().getCounter("history_write_errors_total", "Failed history file writes; the data is written again later");
+
+HistoryWriter::HistoryWriter()
+{
+    m_writeDelay = Settings::get().value("HistoryWriteDelay", m_writeDelay).toInt();
+    m_syncInterval = Settings::get().value("HistorySyncInterval", m_syncInterval).toInt();
+    m_syncCount = std::max(1u, Settings::get().value("HistorySyncCount", (uint)m_syncCount).toUInt());
+    m_retryInterval = Settings::get().value("HistoryRetryInterval", m_retryInterval).toInt();
+    m_maxOpenFiles = std::max(1u, Settings::get().value("HistoryMaxOpenFiles", (uint)m_maxOpenFiles).toUInt());
+    m_thread.reset(QThread::create([this]() { run(); }));
+    m_thread->start(QThread::LowPriority);
+}
+
+HistoryWriter::~HistoryWriter()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_dataReady.wakeAll();
+    }
+    m_thread->wait();
+}
+
+void HistoryWriter::write(const QString &a_fileName, const QByteArray &a_data)
+{
+    QMutexLocker locker(&m_mutex);
+    m_pendingData[a_fileName].append(a_data);
+    m_pendingCount++;
+    m_dataReady.wakeAll();
+}
+
+QByteArray HistoryWriter::getUnwrittenData(const QString &a_fileName)
+{
+    QMutexLocker locker(&m_mutex);
+    QByteArray result;
+    auto writing = m_writingData.find(a_fileName);
+    if (writing != m_writingData.end())
+        result = writing->second;
+    auto pending = m_pendingData.find(a_fileName);
+    if (pending != m_pendingData.end())
+        result.append(pending->second);
+    return result;
+}
+
+// private:
+void HistoryWriter::run()
+{
+    m_syncTimer.start();
+    QMutexLocker locker(&m_mutex);
+    for (;;)
+    {
+        while (m_pendingData.empty() && !m_stopping)
+        {
+            if (m_unsyncedCount == 0)
+            {
+                m_dataReady.wait(&m_mutex);
+                continue;
+            }
+            // новых данных нет, но записанные еще не сброшены на диск
+            auto remainingTime = m_syncInterval - m_syncTimer.elapsed();
+            if (remainingTime <= 0 || !m_dataReady.wait(&m_mutex, QDeadlineTimer(remainingTime)))
+            {
+                locker.unlock();
+                syncFiles();
+                locker.relock();
+            }
+        }
+
+        // накопление данных, пришедших вслед за первыми; после ошибки записи - ожидание перед повторной попыткой
+        QDeadlineTimer deadline(m_writeFailed ? m_retryInterval : m_writeDelay);
+        while (!m_stopping && (m_writeFailed || m_pendingCount < m_syncCount) && m_dataReady.wait(&m_mutex, deadline))
+            ;
+
+        m_writingData.swap(m_pendingData);
+        auto count = m_pendingCount;
+        auto stopping = m_stopping;
+        m_pendingCount = 0;
+        locker.unlock();
+
+        auto failedData = writeFiles(m_writingData, count);
+        if (stopping)
+        {
+            syncFiles();
+            m_files.clear();
+            m_filesOrder.clear();
+            failedData.clear(); // при завершении повторных попыток не будет
+        }
+
+        locker.relock();
+        // недописанные данные возвращаются в очередь перед пришедшими после них
+        for (auto &fileData : failedData)
+            m_pendingData[fileData.first].prepend(fileData.second);
+        m_writeFailed = !failedData.empty();
+        m_writingData.clear();
+        if (stopping && m_pendingData.empty())
+            return;
+    }
+}
+
+std::map<QString, QByteArray> HistoryWriter::writeFiles(const std::map<QString, QByteArray> &a_data, size_t a_count)
+{
+    std::map<QString, QByteArray> failedData;
+    for (auto &fileData : a_data)
+    {
+        auto file = getFile(fileData.first);
+        if (file == nullptr)
+        {
+            g_writeErrors.add();
+            failedData[fileData.first] = fileData.second;
+            continue;
+        }
+        // файл, который не удалось отрезать после прошлой ошибки, отрезается перед записью
+        auto truncation = m_truncations.find(fileData.first);
+        auto offset = truncation != m_truncations.end() ? truncation->second : file->size();
+        if ((truncation == m_truncations.end() || file->resize(offset)) &&
+            file->write(fileData.second) == fileData.second.size() && file->flush())
+        {
+            m_truncations.erase(fileData.first);
+            continue;
+        }
+        // частично записанные данные отрезаются, чтобы повторная запись легла на прежнее место
+        g_writeErrors.add();
+        if (file->resize(offset))
+            m_truncations.erase(fileData.first);
+        else
+            m_truncations[fileData.first] = offset;
+        closeFile(fileData.first); // файл будет открыт заново при следующей записи
+        failedData[fileData.first] = fileData.second;
+    }
+    m_unsyncedCount += a_count;
+    if (m_unsyncedCount >= m_syncCount || m_syncTimer.elapsed() >= m_syncInterval)
+        syncFiles();
+    return failedData;
+}
+
+QFile *HistoryWriter::getFile(const QString &a_fileName)
+{
+    auto it = m_files.find(a_fileName);
+    if (it != m_files.end())
+    {
+        m_filesOrder.remove(a_fileName);
+        m_filesOrder.push_back(a_fileName);
+        return it->second.get();
+    }
+    if (!QDir().mkpath(QFileInfo(a_fileName).path()))
+        return nullptr;
+    std::unique_ptr<QFile> file(new QFile(a_fileName));
+    if (!file->open(QIODevice::Append))
+        return nullptr;
+    if (m_files.size() >= m_maxOpenFiles)
+        closeFile(m_filesOrder.front()); // закрываем давно не использованный файл
+    m_filesOrder.push_back(a_fileName);
+    return m_files.emplace(a_fileName, std::move(file)).first->second.get();
+}
+
+// данные закрываемого файла сбрасываются на диск, так как syncFiles обходит только открытые файлы
+void HistoryWriter::closeFile(const QString &a_fileName)
+{
+    auto it = m_files.find(a_fileName);
+    if (it == m_files.end())
+        return;
+    syncFile(*it->second);
+    m_files.erase(it);
+    m_filesOrder.remove(a_fileName);
+}
+
+void HistoryWriter::syncFiles()
+{
+    for (auto &file : m_files)
+        syncFile(*file.second);
+    m_unsyncedCount = 0;
+    m_syncTimer.restart();
+}
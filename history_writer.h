@@ -0,0 +1,66 @@
+﻿#pragma once
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <QFile>
+#include <QElapsedTimer>
+#include <map>
+#include <list>
+#include <memory>
+
+// Фоновая запись истории сообщений.
+// Данные копятся в памяти и дописываются в файлы пакетами в отдельном потоке: после первой записи
+// поток ждет еще m_writeDelay мс, собирая все, что пришло за это время. Последние использованные файлы
+// (не больше m_maxOpenFiles) остаются открытыми, а сброс на диск (fsync) выполняется через m_syncCount записей
+// или через m_syncInterval мс, а также при уничтожении объекта.
+// Недописанные данные отрезаются и записываются повторно через m_retryInterval мс,
+// поэтому в файле не остается обрывков и следующие данные не сдвигаются. Если файл не удалось отрезать,
+// это повторяется перед следующей записью, а данные не пропускаются.
+class HistoryWriter
+{
+public:
+    HistoryWriter();
+    ~HistoryWriter();
+
+    void write(const QString &a_fileName, const QByteArray &a_data);
+    // данные, переданные для записи в файл, но, возможно, еще не записанные в него; в файле они следуют
+    // сразу за записанными, поэтому читатель может взять конец файла отсюда, не дожидаясь записи
+    QByteArray getUnwrittenData(const QString &a_fileName);
+
+private:
+    void run();
+    // возвращает данные, которые записать не удалось
+    std::map<QString, QByteArray> writeFiles(const std::map<QString, QByteArray> &a_data, size_t a_count);
+    QFile *getFile(const QString &a_fileName);
+    void closeFile(const QString &a_fileName);
+    void syncFiles();
+
+    int m_writeDelay = 50;
+    int m_syncInterval = 1000;
+    size_t m_syncCount = 100;
+    int m_retryInterval = 1000;
+    size_t m_maxOpenFiles = 64;
+
+    QMutex m_mutex;
+    QWaitCondition m_dataReady;
+    // данные, ожидающие записи, по именам файлов
+    std::map<QString, QByteArray> m_pendingData;
+    // данные, записываемые сейчас; поток записи читает их без блокировки, а изменяет под ней
+    std::map<QString, QByteArray> m_writingData;
+    size_t m_pendingCount = 0;
+    bool m_stopping = false;
+    // в m_pendingData есть данные, которые не удалось записать
+    bool m_writeFailed = false;
+
+    // используются только в потоке записи
+    std::map<QString, std::unique_ptr<QFile>> m_files;
+    // порядок использования открытых файлов: последний использованный - в конце
+    std::list<QString> m_filesOrder;
+    // размеры, до которых файлы нужно отрезать перед следующей записью
+    std::map<QString, qint64> m_truncations;
+    size_t m_unsyncedCount = 0;
+    QElapsedTimer m_syncTimer;
+
+    std::unique_ptr<QThread> m_thread;
+};
@@ -0,0 +1,598 @@
+﻿#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QProcess>
+#include <QTimer>
+#include <QDir>
+#include <QTemporaryDir>
+#include <QRandomGenerator>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <QTextStream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#ifdef Q_OS_LINUX
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+#include "signaling.h"
+#include "messenger_signaling.h"
+#include "file_signaling.h"
+#include "tracing.h"
+
+// Генератор нагрузки без интерфейса.
+// Запускает виртуальные узлы (Signaling, MessengerSignaling и FileSignaling) на портах base-port + номер
+// узла, соединяет их в полную сеть через localhost и создает поток сообщений, изменений информации
+// о пользователях и передач файлов. Узлы могут быть распределены по нескольким процессам: основной
+// процесс запускает дочерние и объединяет их отчеты. Отчет выводится в формате JSON.
+
+namespace
+{
+    struct Options
+    {
+        int m_peers = 10; // всего узлов
+        int m_processes = 1;
+        int m_firstPeer = 0; // узлы этого процесса
+        int m_localPeers = 0;
+        quint16 m_basePort = 20000;
+        int m_warmup = 5; // с, без измерений: узлы соединяются
+        int m_duration = 30; // с, измерение
+        double m_messageRate = 1; // сообщений в секунду на узел
+        int m_messageSize = 100;
+        double m_presenceRate = 0.1; // изменений имени в секунду на узел
+        double m_fileRate = 0; // файлов в минуту на узел
+        qint64 m_fileSize = 1024 * 1024;
+        QString m_directory; // рабочий каталог узлов
+        QString m_output; // файл отчета
+        QString m_trace; // файл трассировки интервала измерения
+        bool m_child = false;
+    };
+
+    // монотонное время, общее для процессов одного компьютера
+    qint64 getTime()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    QString getPeerId(int a_index)
+    {
+        return QString("peer-%1").arg(a_index);
+    }
+
+    // Гистограмма задержек в мкс с логарифмическими интервалами (8 на каждую степень двойки).
+    // Гистограммы процессов складываются без потери точности перцентилей.
+    class Histogram
+    {
+    public:
+        void add(qint64 a_value)
+        {
+            auto bucket = (int)std::floor(std::log2(double(std::max<qint64>(a_value, 0) + 1)) * g_bucketsPerOctave);
+            m_buckets[bucket]++;
+            m_count++;
+            m_max = std::max(m_max, a_value);
+        }
+
+        void merge(const Histogram &a_histogram)
+        {
+            for (auto &bucket : a_histogram.m_buckets)
+                m_buckets[bucket.first] += bucket.second;
+            m_count += a_histogram.m_count;
+            m_max = std::max(m_max, a_histogram.m_max);
+        }
+
+        // верхняя граница интервала, в который попадает перцентиль
+        qint64 getPercentile(double a_percentile) const
+        {
+            quint64 count = 0;
+            for (auto &bucket : m_buckets)
+            {
+                count += bucket.second;
+                if (count >= a_percentile / 100 * m_count)
+                    return std::min(m_max, (qint64)std::exp2(double(bucket.first + 1) / g_bucketsPerOctave) - 1);
+            }
+            return m_max;
+        }
+
+        quint64 getCount() const
+        {
+            return m_count;
+        }
+
+        QJsonObject toJson() const
+        {
+            QJsonObject result;
+            result["count"] = double(m_count);
+            result["max"] = double(m_max);
+            for (auto percentile : { 50.0, 90.0, 99.0, 99.9 })
+                result[QString("p%1").arg(percentile)] = double(getPercentile(percentile));
+            QJsonObject buckets;
+            for (auto &bucket : m_buckets)
+                buckets[QString::number(bucket.first)] = double(bucket.second);
+            result["buckets"] = buckets;
+            return result;
+        }
+
+        static Histogram fromJson(const QJsonObject &a_object)
+        {
+            Histogram result;
+            result.m_count = a_object["count"].toDouble();
+            result.m_max = a_object["max"].toDouble();
+            auto buckets = a_object["buckets"].toObject();
+            for (auto it = buckets.begin(); it != buckets.end(); ++it)
+                result.m_buckets[it.key().toInt()] = it.value().toDouble();
+            return result;
+        }
+
+    private:
+        static constexpr int g_bucketsPerOctave = 8;
+
+        std::map<int, quint64> m_buckets;
+        quint64 m_count = 0;
+        qint64 m_max = 0;
+    };
+
+    struct Statistics
+    {
+        quint64 m_messagesSent = 0;
+        quint64 m_messagesReceived = 0;
+        quint64 m_messageBytesReceived = 0;
+        Histogram m_messageLatency;
+        quint64 m_presenceSent = 0;
+        quint64 m_presenceReceived = 0;
+        quint64 m_filesSent = 0;
+        quint64 m_filesReceived = 0;
+        quint64 m_fileBytesReceived = 0;
+        Histogram m_fileTime; // от предложения файла до окончания приема
+    };
+
+    //-------------------------------------------------------------------------------------------------
+    class VirtualPeer : public QObject
+    {
+    public:
+        VirtualPeer(int a_index, const Options &a_options, Statistics &a_statistics) :
+            m_options(a_options),
+            m_statistics(a_statistics)
+        {
+            m_index = a_index;
+            m_directory = QString("%1/%2").arg(m_options.m_directory).arg(getPeerId(m_index));
+            m_signaling = std::make_shared<Signaling>();
+        }
+
+        bool start()
+        {
+            if (!m_signaling->start(m_options.m_basePort + m_index))
+                return false;
+            m_messenger = std::make_unique<MessengerSignaling>(m_signaling, m_directory + "/history", QString());
+            m_files = std::make_unique<FileSignaling>(m_signaling, m_directory + "/files");
+            connect(m_messenger.get(), &MessengerSignaling::userAdded, m_files.get(), &FileSignaling::onUserAdded);
+            connect(m_messenger.get(), &MessengerSignaling::userRemoved, m_files.get(), &FileSignaling::onUserRemoved);
+            connect(m_messenger.get(), &MessengerSignaling::userAdded, this, [this](QString a_id) { m_users.insert(a_id); });
+            connect(m_messenger.get(), &MessengerSignaling::userRemoved, this, [this](QString a_id) { m_users.erase(a_id); });
+            connect(m_messenger.get(), &MessengerSignaling::userRenamed, this, [this] { m_statistics.m_presenceReceived++; });
+            connect(m_messenger.get(), &MessengerSignaling::messageReceived, this, &VirtualPeer::onMessageReceived);
+            connect(m_files.get(), &FileSignaling::fileAboutToReceive, this, [this](QString a_sender, QString a_name)
+                {
+                    m_files->receiveFile(a_sender, a_name);
+                });
+            connect(m_files.get(), &FileSignaling::fileStatusChanged, this, &VirtualPeer::onFileStatusChanged);
+            connect(m_files.get(), &FileSignaling::fileFragmentReceived, this, [this](QString, QString, size_t, size_t a_size)
+                {
+                    m_statistics.m_fileBytesReceived += a_size;
+                });
+            auto id = getPeerId(m_index);
+            m_messenger->setId(id);
+            m_messenger->setName(id);
+            m_files->setId(id);
+            return true;
+        }
+
+        // соединение с узлами, информация о которых еще не получена; повторное соединение Signaling пропускает
+        void connectPeers()
+        {
+            for (int i = 0; i < m_options.m_peers; i++)
+                if (i != m_index && m_users.find(getPeerId(i)) == m_users.end())
+                    m_signaling->addPeer(QHostAddress::LocalHost, m_options.m_basePort + i);
+        }
+
+        size_t getUserCount() const
+        {
+            return m_users.size();
+        }
+
+        // события за интервал a_interval мс
+        void generateTraffic(int a_interval)
+        {
+            if (m_users.empty())
+                return;
+            for (int i = getEventCount(m_options.m_messageRate * a_interval / 1000); i > 0; i--)
+                sendMessage();
+            for (int i = getEventCount(m_options.m_presenceRate * a_interval / 1000); i > 0; i--)
+            {
+                m_messenger->setName(QString("%1 (%2)").arg(getPeerId(m_index)).arg(++m_renameCount));
+                m_statistics.m_presenceSent++;
+            }
+            for (int i = getEventCount(m_options.m_fileRate * a_interval / 60000); i > 0; i--)
+                sendFile();
+        }
+
+    private:
+        // число событий с пуассоновским распределением
+        static int getEventCount(double a_expected)
+        {
+            int result = 0;
+            auto limit = std::exp(-a_expected);
+            for (auto product = QRandomGenerator::global()->generateDouble(); product > limit; product *= QRandomGenerator::global()->generateDouble())
+                result++;
+            return result;
+        }
+
+        QString getRandomUser() const
+        {
+            auto it = m_users.begin();
+            std::advance(it, QRandomGenerator::global()->bounded((int)m_users.size()));
+            return *it;
+        }
+
+        // время отправки передается в начале текста
+        void sendMessage()
+        {
+            auto text = QString::number(getTime()) + ' ';
+            text += QString(std::max<qsizetype>(m_options.m_messageSize - text.size(), 0), 'x');
+            m_messenger->sendMessage(getRandomUser(), text);
+            m_statistics.m_messagesSent++;
+        }
+
+        void sendFile()
+        {
+            auto name = QString("%1/outgoing/%2.bin").arg(m_directory).arg(++m_fileCount);
+            if (!QDir().mkpath(QFileInfo(name).path()))
+                return;
+            QFile file(name);
+            if (!file.open(QIODevice::WriteOnly))
+                return;
+            QByteArray block(64 * 1024, Qt::Uninitialized);
+            for (qint64 size = 0; size < m_options.m_fileSize; size += block.size())
+            {
+                QRandomGenerator::global()->fillRange(reinterpret_cast<quint32 *>(block.data()), block.size() / sizeof(quint32));
+                file.write(block.constData(), std::min<qint64>(block.size(), m_options.m_fileSize - size));
+            }
+            file.close();
+            if (m_files->sendFile(getRandomUser(), name))
+                m_statistics.m_filesSent++;
+        }
+
+        void onMessageReceived(QString, QDateTime, QString a_text)
+        {
+            bool ok = false;
+            auto sendTime = a_text.section(' ', 0, 0).toLongLong(&ok);
+            if (!ok)
+                return;
+            m_statistics.m_messagesReceived++;
+            m_statistics.m_messageBytesReceived += a_text.size();
+            m_statistics.m_messageLatency.add((getTime() - sendTime) / 1000);
+        }
+
+        void onFileStatusChanged(QString a_sender, QString a_name)
+        {
+            auto fileName = m_files->getFileName(FileId{ FileActionType::Receive, a_sender, a_name });
+            auto status = m_files->getReceivingFileInfo(fileName).m_status;
+            auto key = a_sender + '/' + a_name;
+            if (status == FileInfo::Status::Pending || status == FileInfo::Status::Queued)
+                m_fileStartTimes.emplace(key, getTime());
+            if (status != FileInfo::Status::Finished)
+                return;
+            m_statistics.m_filesReceived++;
+            auto it = m_fileStartTimes.find(key);
+            if (it == m_fileStartTimes.end())
+                return;
+            m_statistics.m_fileTime.add((getTime() - it->second) / 1000);
+            m_fileStartTimes.erase(it);
+            // принятые файлы не нужны, а место на диске ограничено; удаляются после выхода из обработчика FileSignaling
+            QTimer::singleShot(0, this, [this, a_sender, a_name] { m_files->removeFile(a_sender, a_name); });
+        }
+
+        int m_index = 0;
+        const Options &m_options;
+        Statistics &m_statistics;
+        QString m_directory;
+        std::shared_ptr<Signaling> m_signaling;
+        std::unique_ptr<MessengerSignaling> m_messenger;
+        std::unique_ptr<FileSignaling> m_files;
+        std::set<QString> m_users;
+        std::map<QString, qint64> m_fileStartTimes;
+        int m_renameCount = 0;
+        int m_fileCount = 0;
+    };
+
+    //-------------------------------------------------------------------------------------------------
+    struct ProcessUsage
+    {
+        double m_cpuTime = 0; // с
+        qint64 m_rss = 0; // КиБ
+        qint64 m_peakRss = 0;
+    };
+
+    ProcessUsage getProcessUsage()
+    {
+        ProcessUsage result;
+#ifdef Q_OS_LINUX
+        rusage usage{};
+        if (getrusage(RUSAGE_SELF, &usage) == 0)
+        {
+            result.m_cpuTime = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+            result.m_peakRss = usage.ru_maxrss;
+        }
+        QFile statm("/proc/self/statm");
+        if (statm.open(QIODevice::ReadOnly))
+            result.m_rss = QString(statm.readAll()).section(' ', 1, 1).toLongLong() * (sysconf(_SC_PAGESIZE) / 1024);
+#endif
+        return result;
+    }
+
+    QJsonObject createReport(const Options &a_options, const Statistics &a_statistics, const ProcessUsage &a_usage, int a_connectedPeers)
+    {
+        QJsonObject messages;
+        messages["sent"] = double(a_statistics.m_messagesSent);
+        messages["received"] = double(a_statistics.m_messagesReceived);
+        messages["received_per_s"] = a_statistics.m_messagesReceived / double(a_options.m_duration);
+        messages["received_bytes_per_s"] = a_statistics.m_messageBytesReceived / double(a_options.m_duration);
+        messages["latency_us"] = a_statistics.m_messageLatency.toJson();
+        QJsonObject presence;
+        presence["sent"] = double(a_statistics.m_presenceSent);
+        presence["received"] = double(a_statistics.m_presenceReceived);
+        QJsonObject files;
+        files["sent"] = double(a_statistics.m_filesSent);
+        files["received"] = double(a_statistics.m_filesReceived);
+        files["received_bytes_per_s"] = a_statistics.m_fileBytesReceived / double(a_options.m_duration);
+        files["time_us"] = a_statistics.m_fileTime.toJson();
+        QJsonObject process;
+        process["cpu_s"] = a_usage.m_cpuTime;
+        process["cpu_percent"] = a_usage.m_cpuTime * 100 / a_options.m_duration;
+        process["rss_kib"] = double(a_usage.m_rss);
+        process["peak_rss_kib"] = double(a_usage.m_peakRss);
+
+        QJsonObject report;
+        report["peers"] = a_options.m_peers;
+        report["processes"] = a_options.m_processes;
+        report["duration_s"] = a_options.m_duration;
+        // узлы этого процесса, соединенные со всеми остальными к началу измерения
+        report["fully_connected_peers"] = a_connectedPeers;
+        report["messages"] = messages;
+        report["presence"] = presence;
+        report["files"] = files;
+        report["process"] = process;
+        return report;
+    }
+
+    // Отчеты дочерних процессов: счетчики и гистограммы складываются, перцентили вычисляются заново
+    QJsonObject mergeReports(const Options &a_options, const std::vector<QJsonObject> &a_reports)
+    {
+        Statistics statistics;
+        ProcessUsage usage;
+        int connectedPeers = 0;
+        for (auto &report : a_reports)
+        {
+            auto messages = report["messages"].toObject();
+            auto presence = report["presence"].toObject();
+            auto files = report["files"].toObject();
+            auto process = report["process"].toObject();
+            statistics.m_messagesSent += messages["sent"].toDouble();
+            statistics.m_messagesReceived += messages["received"].toDouble();
+            statistics.m_messageBytesReceived += messages["received_bytes_per_s"].toDouble() * a_options.m_duration;
+            statistics.m_messageLatency.merge(Histogram::fromJson(messages["latency_us"].toObject()));
+            statistics.m_presenceSent += presence["sent"].toDouble();
+            statistics.m_presenceReceived += presence["received"].toDouble();
+            statistics.m_filesSent += files["sent"].toDouble();
+            statistics.m_filesReceived += files["received"].toDouble();
+            statistics.m_fileBytesReceived += files["received_bytes_per_s"].toDouble() * a_options.m_duration;
+            statistics.m_fileTime.merge(Histogram::fromJson(files["time_us"].toObject()));
+            usage.m_cpuTime += process["cpu_s"].toDouble();
+            usage.m_rss += process["rss_kib"].toDouble();
+            usage.m_peakRss += process["peak_rss_kib"].toDouble();
+            connectedPeers += report["fully_connected_peers"].toInt();
+        }
+        return createReport(a_options, statistics, usage, connectedPeers);
+    }
+
+    bool writeReport(const Options &a_options, const QJsonObject &a_report)
+    {
+        auto data = QJsonDocument(a_report).toJson();
+        if (a_options.m_output.isEmpty())
+        {
+            QTextStream(stdout) << data;
+            return true;
+        }
+        QFile file(a_options.m_output);
+        return file.open(QIODevice::WriteOnly) && file.write(data) == data.size();
+    }
+
+    //-------------------------------------------------------------------------------------------------
+    // Узлы этого процесса: соединение, прогрев, измерение
+    int runPeers(QCoreApplication &a_application, const Options &a_options)
+    {
+        static const int trafficInterval = 10;
+        Statistics statistics;
+        std::vector<std::unique_ptr<VirtualPeer>> peers;
+        for (int i = a_options.m_firstPeer; i < a_options.m_firstPeer + a_options.m_localPeers; i++)
+        {
+            peers.push_back(std::make_unique<VirtualPeer>(i, a_options, statistics));
+            if (!peers.back()->start())
+            {
+                qCritical("loadgen: port %d is busy", a_options.m_basePort + i);
+                return 1;
+            }
+        }
+
+        // узлы других процессов могут запуститься позже, поэтому соединение повторяется
+        QTimer connectTimer;
+        QObject::connect(&connectTimer, &QTimer::timeout, [&peers]
+            {
+                for (auto &peer : peers)
+                    peer->connectPeers();
+            });
+        connectTimer.start(1000);
+        for (auto &peer : peers)
+            peer->connectPeers();
+
+        QTimer trafficTimer;
+        QObject::connect(&trafficTimer, &QTimer::timeout, [&peers]
+            {
+                for (auto &peer : peers)
+                    peer->generateTraffic(trafficInterval);
+            });
+
+        int connectedPeers = 0;
+        ProcessUsage startUsage;
+        QTimer::singleShot(a_options.m_warmup * 1000, [&]
+            {
+                // прогрев не учитывается
+                statistics = Statistics();
+                startUsage = getProcessUsage();
+                connectedPeers = std::count_if(peers.begin(), peers.end(), [&a_options](auto &a_peer)
+                    {
+                        return a_peer->getUserCount() + 1 == (size_t)a_options.m_peers;
+                    });
+                trafficTimer.start(trafficInterval);
+                if (!a_options.m_trace.isEmpty())
+                    Tracing::get().setEnabled(true);
+            });
+        QTimer::singleShot((a_options.m_warmup + a_options.m_duration) * 1000, &a_application, &QCoreApplication::quit);
+        a_application.exec();
+        trafficTimer.stop();
+        Tracing::get().setEnabled(false);
+        if (!a_options.m_trace.isEmpty() && !Tracing::get().save(a_options.m_trace))
+        {
+            qCritical("loadgen: cannot write trace file");
+            return 1;
+        }
+
+        auto usage = getProcessUsage();
+        usage.m_cpuTime -= startUsage.m_cpuTime;
+        return writeReport(a_options, createReport(a_options, statistics, usage, connectedPeers)) ? 0 : 1;
+    }
+
+    // События трассировки процессов различаются по pid, поэтому файлы объединяются в один
+    bool mergeTraces(const std::vector<QString> &a_fileNames, const QString &a_output)
+    {
+        QJsonArray events;
+        for (auto &fileName : a_fileNames)
+        {
+            QFile file(fileName);
+            if (!file.open(QIODevice::ReadOnly))
+                return false;
+            for (auto event : QJsonDocument::fromJson(file.readAll()).object()["traceEvents"].toArray())
+                events.append(event);
+        }
+        auto data = QJsonDocument(QJsonObject{ { "traceEvents", events }, { "displayTimeUnit", "ms" } }).toJson(QJsonDocument::Compact);
+        QFile file(a_output);
+        return file.open(QIODevice::WriteOnly) && file.write(data) == data.size();
+    }
+
+    // Основной процесс при нескольких процессах: запуск дочерних и объединение их отчетов
+    int runProcesses(const Options &a_options)
+    {
+        std::vector<std::unique_ptr<QProcess>> processes;
+        std::vector<QString> reportFileNames;
+        std::vector<QString> traceFileNames;
+        auto firstPeer = 0;
+        for (int i = 0; i < a_options.m_processes; i++)
+        {
+            auto localPeers = a_options.m_peers / a_options.m_processes + (i < a_options.m_peers % a_options.m_processes ? 1 : 0);
+            reportFileNames.push_back(QString("%1/report-%2.json").arg(a_options.m_directory).arg(i));
+            QStringList arguments = QCoreApplication::arguments().mid(1);
+            arguments << "--child" << "--first-peer" << QString::number(firstPeer) << "--local-peers" << QString::number(localPeers)
+                << "--directory" << a_options.m_directory << "-o" << reportFileNames.back();
+            if (!a_options.m_trace.isEmpty())
+            {
+                traceFileNames.push_back(QString("%1/trace-%2.json").arg(a_options.m_directory).arg(i));
+                arguments << "--trace" << traceFileNames.back();
+            }
+            processes.push_back(std::make_unique<QProcess>());
+            processes.back()->setProcessChannelMode(QProcess::ForwardedErrorChannel);
+            processes.back()->start(QCoreApplication::applicationFilePath(), arguments);
+            firstPeer += localPeers;
+        }
+        std::vector<QJsonObject> reports;
+        for (size_t i = 0; i < processes.size(); i++)
+        {
+            processes[i]->waitForFinished(-1);
+            QFile file(reportFileNames[i]);
+            if (processes[i]->exitCode() != 0 || !file.open(QIODevice::ReadOnly))
+            {
+                qCritical("loadgen: process %d failed", (int)i);
+                return 1;
+            }
+            reports.push_back(QJsonDocument::fromJson(file.readAll()).object());
+        }
+        if (!traceFileNames.empty() && !mergeTraces(traceFileNames, a_options.m_trace))
+        {
+            qCritical("loadgen: cannot write trace file");
+            return 1;
+        }
+        return writeReport(a_options, mergeReports(a_options, reports)) ? 0 : 1;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication application(argc, argv);
+    QCoreApplication::setOrganizationName("MSIprog");
+    QCoreApplication::setApplicationName("MessengerLoadgen");
+
+    Options options;
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Headless load generator: N virtual peers connected in a full mesh over localhost");
+    parser.addHelpOption();
+    QCommandLineOption peersOption("peers", "Total number of virtual peers", "n", QString::number(options.m_peers));
+    QCommandLineOption processesOption("processes", "Number of processes to distribute peers over", "n", QString::number(options.m_processes));
+    QCommandLineOption basePortOption("base-port", "Port of the first peer; peer i listens on base-port + i", "port", QString::number(options.m_basePort));
+    QCommandLineOption warmupOption("warmup", "Seconds to connect peers before measuring", "s", QString::number(options.m_warmup));
+    QCommandLineOption durationOption("duration", "Measurement time, seconds", "s", QString::number(options.m_duration));
+    QCommandLineOption messageRateOption("message-rate", "Chat messages per second per peer", "rate", QString::number(options.m_messageRate));
+    QCommandLineOption messageSizeOption("message-size", "Chat message size, characters", "size", QString::number(options.m_messageSize));
+    QCommandLineOption presenceRateOption("presence-rate", "User info changes per second per peer", "rate", QString::number(options.m_presenceRate));
+    QCommandLineOption fileRateOption("file-rate", "Files per minute per peer", "rate", QString::number(options.m_fileRate));
+    QCommandLineOption fileSizeOption("file-size", "File size, bytes", "size", QString::number(options.m_fileSize));
+    QCommandLineOption directoryOption("directory", "Working directory for history and files (a temporary one by default)", "dir");
+    QCommandLineOption outputOption("o", "JSON report file (stdout by default)", "file");
+    QCommandLineOption traceOption("trace", "Chrome trace event file for the measurement interval", "file");
+    QCommandLineOption childOption("child");
+    QCommandLineOption firstPeerOption("first-peer", "", "n");
+    QCommandLineOption localPeersOption("local-peers", "", "n");
+    childOption.setFlags(QCommandLineOption::HiddenFromHelp);
+    firstPeerOption.setFlags(QCommandLineOption::HiddenFromHelp);
+    localPeersOption.setFlags(QCommandLineOption::HiddenFromHelp);
+    parser.addOptions({ peersOption, processesOption, basePortOption, warmupOption, durationOption, messageRateOption, messageSizeOption,
+        presenceRateOption, fileRateOption, fileSizeOption, directoryOption, outputOption, traceOption, childOption, firstPeerOption, localPeersOption });
+    // параметры Settings (--cfg) передаются Signaling и FileSignaling
+    parser.addOption(QCommandLineOption("cfg", "Configuration file", "file"));
+    parser.process(application);
+
+    options.m_peers = std::max(parser.value(peersOption).toInt(), 2);
+    options.m_processes = std::clamp(parser.value(processesOption).toInt(), 1, options.m_peers);
+    options.m_basePort = parser.value(basePortOption).toUShort();
+    options.m_warmup = std::max(parser.value(warmupOption).toInt(), 0);
+    options.m_duration = std::max(parser.value(durationOption).toInt(), 1);
+    options.m_messageRate = parser.value(messageRateOption).toDouble();
+    options.m_messageSize = parser.value(messageSizeOption).toInt();
+    options.m_presenceRate = parser.value(presenceRateOption).toDouble();
+    options.m_fileRate = parser.value(fileRateOption).toDouble();
+    options.m_fileSize = parser.value(fileSizeOption).toLongLong();
+    options.m_output = parser.value(outputOption);
+    options.m_trace = parser.value(traceOption);
+    options.m_child = parser.isSet(childOption);
+    options.m_firstPeer = options.m_child ? parser.value(firstPeerOption).toInt() : 0;
+    options.m_localPeers = options.m_child ? parser.value(localPeersOption).toInt() : options.m_peers;
+
+    QTemporaryDir temporaryDirectory;
+    options.m_directory = parser.isSet(directoryOption) ? parser.value(directoryOption) : temporaryDirectory.path();
+    if (options.m_directory.isEmpty() || !QDir().mkpath(options.m_directory))
+    {
+        qCritical("loadgen: cannot create working directory");
+        return 1;
+    }
+    if (!options.m_child && options.m_processes > 1)
+        return runProcesses(options);
+    return runPeers(application, options);
+}
@@ -0,0 +1,33 @@
+TARGET = loadgen
+TEMPLATE = app
+QT = core network
+CONFIG += console
+CONFIG -= app_bundle
+INCLUDEPATH += ..
+SOURCES += loadgen.cpp \
+    ../signaling.cpp \
+    ../block_queue.cpp \
+    ../settings.cpp \
+    ../messenger_signaling.cpp \
+    ../history_store.cpp \
+    ../history_writer.cpp \
+    ../search_index.cpp \
+    ../file_signaling.cpp \
+    ../file_hash.cpp \
+    ../file_sync.cpp \
+    ../metrics.cpp \
+    ../tracing.cpp
+HEADERS += ../signaling.h \
+    ../signaling_protocol.h \
+    ../block_queue.h \
+    ../settings.h \
+    ../attribute_signal.h \
+    ../messenger_signaling.h \
+    ../history_store.h \
+    ../history_writer.h \
+    ../search_index.h \
+    ../file_signaling.h \
+    ../file_hash.h \
+    ../file_sync.h \
+    ../metrics.h \
+    ../tracing.h
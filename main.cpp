@@ -1,6 +1,8 @@
 #include <QApplication>
 #include "user_list_widget.h"
 #include "signaling_facade.h"
+#include "settings.h"
+#include "tracing.h"
 
 int main(int argc, char *argv[])
 {
@@ -13,8 +15,17 @@ int main(int argc, char *argv[])
         return 1;
     auto messengerSignaling = std::make_shared<MessengerSignaling>(signalingFacade.getSignaling());
     auto fileSignaling = std::make_shared<FileSignaling>(signalingFacade.getSignaling());
+    // при отключении пользователя фрагменты, запрошенные у него, запрашиваются у других отправителей
+    QObject::connect(messengerSignaling.get(), &MessengerSignaling::userAdded, fileSignaling.get(), &FileSignaling::onUserAdded);
+    QObject::connect(messengerSignaling.get(), &MessengerSignaling::userRemoved, fileSignaling.get(), &FileSignaling::onUserRemoved);
+    signalingFacade.moveToFileThread(fileSignaling.get());
 
     UserListWidget w(messengerSignaling, fileSignaling);
     w.show();
-    return a.exec();
+    auto result = a.exec();
+    signalingFacade.stopThreads();
+    // трассировка, включенная настройкой TraceEnabled, сохраняется при выходе
+    if (Tracing::get().isEnabled())
+        Tracing::get().save(Settings::get().value("TraceFile", "trace.json").toString());
+    return result;
 }
@@ -1,9 +1,12 @@
 ﻿#include <QScrollBar>
 #include <QDateTime>
+#include <QClipboard>
+#include <QAction>
 #include "message_form.h"
 #include "ui_message_form.h"
 #include "resource_holder.h"
 #include "settings.h"
+#include "tracing.h"
 
 MessageForm::MessageForm(std::shared_ptr<MessengerSignaling> a_signaling, QWidget *a_parent) :
     QWidget(a_parent, Qt::Window | Qt::CustomizeWindowHint | Qt::WindowMaximizeButtonHint | Qt::WindowCloseButtonHint),
@@ -21,6 +24,24 @@ MessageForm::MessageForm(std::shared_ptr<MessengerSignaling> a_signaling, QWidge
     m_ui->tabBar->setTabsClosable(true);
     connect(m_ui->tabBar, &QTabBar::currentChanged, this, &MessageForm::showHistory);
     connect(m_ui->tabBar, &QTabBar::tabCloseRequested, this, &MessageForm::closeTab);
+    m_ui->dialogField->setItemDelegate(new MessageDelegate(m_ui->dialogField));
+    connect(m_ui->dialogField->verticalScrollBar(), &QScrollBar::valueChanged, this, &MessageForm::onDialogScrolled);
+    auto copyAction = new QAction(m_ui->dialogField);
+    copyAction->setShortcut(QKeySequence::Copy);
+    copyAction->setShortcutContext(Qt::WidgetShortcut);
+    m_ui->dialogField->addAction(copyAction);
+    connect(copyAction, &QAction::triggered, this, &MessageForm::copySelectedMessages);
+    m_ui->searchResultsList->hide();
+    m_ui->searchFromDateEdit->setDate(m_ui->searchFromDateEdit->minimumDate());
+    m_ui->searchToDateEdit->setDate(m_ui->searchToDateEdit->minimumDate());
+    m_searchTimer.setSingleShot(true);
+    m_searchTimer.setInterval(Settings::get().value("SearchDelay", 300).toInt());
+    connect(&m_searchTimer, &QTimer::timeout, this, &MessageForm::searchMessages);
+    connect(m_ui->searchField, &QLineEdit::textChanged, &m_searchTimer, qOverload<>(&QTimer::start));
+    connect(m_ui->searchCurrentDialogCheckBox, &QCheckBox::toggled, this, &MessageForm::searchMessages);
+    connect(m_ui->searchFromDateEdit, &QDateEdit::dateChanged, this, &MessageForm::searchMessages);
+    connect(m_ui->searchToDateEdit, &QDateEdit::dateChanged, this, &MessageForm::searchMessages);
+    connect(m_ui->searchResultsList, &QListWidget::itemActivated, this, &MessageForm::showSearchResult);
     connect(&m_blinkTimer, &QTimer::timeout, this, &MessageForm::changeIcons);
     m_blinkTimer.start(500);
 
@@ -109,10 +130,19 @@ void MessageForm::showHistory(int a_tabIndex)
     if (a_tabIndex == -1)
         return;
     auto id = getUserId(a_tabIndex);
-    if (!m_history.contains(id))
+    auto model = getModel(id);
+    if (model == nullptr)
         return;
-    m_ui->dialogField->setHtml(m_history[id]);
-    m_ui->dialogField->moveCursor(QTextCursor::End);
+    // представление размещает только загруженную страницу, а не всю историю
+    m_ui->dialogField->setModel(model);
+    m_ui->dialogField->doItemsLayout();
+    // если страница помещается целиком, прокрутить вверх для подгрузки нельзя
+    while (m_ui->dialogField->verticalScrollBar()->maximum() == 0 && model->hasOlderMessages())
+    {
+        model->loadOlderMessages();
+        m_ui->dialogField->doItemsLayout();
+    }
+    m_ui->dialogField->scrollToBottom();
     onMessagesRead(id);
 }
 
@@ -127,9 +157,7 @@ void MessageForm::sendText(const QString &a_text)
 {
     QString receiver = getCurrentUserId();
     m_signaling->sendMessage(receiver, a_text);
-    auto message = formatMessage(false, m_signaling->getName(), QDateTime::currentDateTime(), a_text);
-    m_history[receiver] += message;
-    appendHTML(message);
+    appendMessage(receiver, Message{ false, QDateTime::currentDateTime(), a_text }, true);
 }
 
 void MessageForm::sendTyping(bool a_typing)
@@ -139,16 +167,91 @@ void MessageForm::sendTyping(bool a_typing)
 
 void MessageForm::onMessageReceived(QString a_sender, QDateTime a_date, QString a_text)
 {
-    auto message = formatMessage(true, m_signaling->getUserName(a_sender), a_date, a_text);
-    m_history[a_sender] += message;
-    if (getCurrentUserId() == a_sender)
-        appendHTML(message);
+    // сообщение прокручивается в видимую область, если пользователь не просматривает историю
+    auto scrollBar = m_ui->dialogField->verticalScrollBar();
+    appendMessage(a_sender, Message{ true, a_date, a_text }, scrollBar->value() == scrollBar->maximum());
     if (!isVisible() || getCurrentUserId() != a_sender || !(windowState() & Qt::WindowActive))
         m_unreadSenders.insert(a_sender);
     else
         onMessagesRead(a_sender);
 }
 
+void MessageForm::onDialogScrolled(int a_value)
+{
+    if (a_value != m_ui->dialogField->verticalScrollBar()->minimum())
+        return;
+    auto model = getModel(getCurrentUserId());
+    if (model == nullptr || !model->hasOlderMessages())
+        return;
+    // видимое сообщение остается на месте после добавления страницы над ним
+    auto count = model->loadOlderMessages();
+    m_ui->dialogField->scrollTo(model->index(count, 0), QAbstractItemView::PositionAtTop);
+}
+
+void MessageForm::copySelectedMessages()
+{
+    auto indexes = m_ui->dialogField->selectionModel()->selectedIndexes();
+    std::sort(indexes.begin(), indexes.end());
+    QStringList texts;
+    for (auto &index : indexes)
+        texts.append(index.data(MessageModel::TextRole).toString());
+    if (!texts.isEmpty())
+        QGuiApplication::clipboard()->setText(texts.join("\n\n"));
+}
+
+void MessageForm::searchMessages()
+{
+    m_ui->searchResultsList->clear();
+    auto query = m_ui->searchField->text();
+    m_ui->searchResultsList->setVisible(!query.trimmed().isEmpty());
+    if (query.trimmed().isEmpty())
+        return;
+    // дата, равная минимальной, означает отсутствие ограничения
+    QDateTime from, to;
+    if (m_ui->searchFromDateEdit->date() != m_ui->searchFromDateEdit->minimumDate())
+        from = m_ui->searchFromDateEdit->date().startOfDay();
+    if (m_ui->searchToDateEdit->date() != m_ui->searchToDateEdit->minimumDate())
+        to = m_ui->searchToDateEdit->date().endOfDay();
+    auto id = m_ui->searchCurrentDialogCheckBox->isChecked() ? getCurrentUserId() : QString();
+    auto results = m_signaling->searchMessages(query, id, from, to);
+    // тексты найденных сообщений читаются одним запросом на собеседника
+    std::map<QString, std::set<size_t>> numbers;
+    for (auto &result : results)
+        numbers[result.m_id].insert(result.m_number);
+    std::map<QString, std::map<size_t, Message>> messages;
+    for (auto &contactNumbers : numbers)
+        messages[contactNumbers.first] = m_signaling->getMessages(contactNumbers.first, contactNumbers.second);
+    for (auto &result : results)
+    {
+        auto &contactMessages = messages[result.m_id];
+        auto message = contactMessages.find(result.m_number);
+        if (message == contactMessages.end())
+            continue;
+        auto name = m_signaling->getUserName(result.m_id);
+        auto item = new QListWidgetItem(QString("%1 (%2): %3")
+            .arg(name.isEmpty() ? result.m_id : name)
+            .arg(result.m_date.toString(Message::m_dateTimeFormat))
+            .arg(message->second.m_text.simplified()), m_ui->searchResultsList);
+        item->setData(Qt::UserRole, result.m_id);
+        item->setData(Qt::UserRole + 1, (qulonglong)result.m_number);
+    }
+}
+
+void MessageForm::showSearchResult(QListWidgetItem *a_item)
+{
+    auto id = a_item->data(Qt::UserRole).toString();
+    addDialog(id);
+    auto model = getModel(id);
+    if (model == nullptr)
+        return;
+    auto row = model->loadMessage(a_item->data(Qt::UserRole + 1).toULongLong());
+    if (row == -1)
+        return;
+    auto index = model->index(row, 0);
+    m_ui->dialogField->setCurrentIndex(index);
+    m_ui->dialogField->scrollTo(index, QAbstractItemView::PositionAtCenter);
+}
+
 void MessageForm::changeIcons()
 {
     for (int i = 0; i < m_ui->tabBar->count(); i++)
@@ -191,28 +294,27 @@ void MessageForm::onMessagesRead(const QString &a_sender)
 
 void MessageForm::receiveHistory(const QString &a_id)
 {
-    auto &messages = m_history[a_id];
-    messages.clear();
-    for (auto &message : m_signaling->getMessages(a_id))
-        messages.append(formatMessage(message.m_sentToSender, message.m_sentToSender ? m_signaling->getUserName(a_id) : m_signaling->getName(), message.m_date, message.m_text));
+    m_history[a_id].reset(new MessageModel(m_signaling, a_id));
 }
 
-void MessageForm::appendHTML(const QString &a_text)
+void MessageForm::appendMessage(const QString &a_id, const Message &a_message, bool a_scroll)
 {
-    QTextCursor cursor = m_ui->dialogField->textCursor();
-    cursor.movePosition(QTextCursor::End);
-    cursor.insertHtml(a_text);
-    m_ui->dialogField->moveCursor(QTextCursor::End);
+    TraceSpan span("MessageForm.appendMessage", "ui");
+    // история закрытых диалогов загружается при открытии
+    auto model = getModel(a_id);
+    if (model == nullptr)
+        return;
+    model->appendMessage(a_message);
+    if (a_scroll && getCurrentUserId() == a_id)
+        m_ui->dialogField->scrollToBottom();
 }
 
-QString MessageForm::formatMessage(bool a_sentToSender, const QString &a_name, const QDateTime &a_date, QString a_text)
+MessageModel *MessageForm::getModel(const QString &a_id)
 {
-    a_text.replace("\n", "<br>");
-    return QString("<font color=%1><b>%2</b></font> <font color=gray>(%3)</font><br>%4<br><br>")
-        .arg(a_sentToSender ? "red" : "blue")
-        .arg(a_name)
-        .arg(a_date.toString("dd.MM.yyyy hh:mm:ss"))
-        .arg(a_text);
+    auto it = m_history.find(a_id);
+    if (it == m_history.end())
+        return nullptr;
+    return it->second.get();
 }
 
 int MessageForm::getTabIndex(const QString &a_id)
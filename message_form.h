@@ -3,7 +3,9 @@
 
 #include <QWidget>
 #include <QMap>
+#include <QListWidgetItem>
 #include "messenger_signaling.h"
+#include "message_view.h"
 
 namespace Ui
 {
@@ -34,23 +36,29 @@ private slots:
     void sendText(const QString &a_text);
     void sendTyping(bool a_typing);
     void onMessageReceived(QString a_sender, QDateTime a_date, QString a_text);
+    void onDialogScrolled(int a_value);
+    void copySelectedMessages();
+    void searchMessages();
+    void showSearchResult(QListWidgetItem *a_item);
     void changeIcons();
 
 private:
     void changeEvent(QEvent *a_event) override;
     void onMessagesRead(const QString &a_sender);
     void receiveHistory(const QString &a_id);
-    void appendHTML(const QString &a_text);
-    static QString formatMessage(bool a_sentToSender, const QString &a_name, const QDateTime &date, QString a_text);
+    void appendMessage(const QString &a_id, const Message &a_message, bool a_scroll);
+    MessageModel *getModel(const QString &a_id);
     int getTabIndex(const QString &a_id);
     QString getUserId(int a_tabIndex);
     QString getCurrentUserId();
 
     Ui::MessageForm *m_ui = nullptr;
     std::shared_ptr<MessengerSignaling> m_signaling;
-    QMap<QString, QString> m_history; // история сообщений в форматированном виде
+    std::map<QString, std::unique_ptr<MessageModel>> m_history; // загруженная часть истории по диалогам
     std::set<QString> m_unreadSenders; // отправители, сообщения которых не прочитаны пользователем
     QTimer m_blinkTimer;
+    // поиск выполняется после паузы в наборе запроса
+    QTimer m_searchTimer;
     bool m_blinkState = false;
 };
 
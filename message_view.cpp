@@ -0,0 +1,141 @@
+﻿#include <QApplication>
+#include <QPainter>
+#include <QtMath>
+#include <QTextDocument>
+#include <QAbstractItemView>
+#include "message_view.h"
+
+MessageModel::MessageModel(std::shared_ptr<MessengerSignaling> a_signaling, const QString &a_id, QObject *a_parent) :
+    QAbstractListModel(a_parent)
+{
+    m_signaling = a_signaling;
+    m_id = a_id;
+    auto count = m_signaling->getMessageCount(m_id);
+    m_first = count > g_pageSize ? count - g_pageSize : 0;
+    m_messages = m_signaling->getMessages(m_id, m_first, count - m_first);
+}
+
+int MessageModel::rowCount(const QModelIndex &a_parent) const
+{
+    return a_parent.isValid() ? 0 : m_messages.size();
+}
+
+QVariant MessageModel::data(const QModelIndex &a_index, int a_role) const
+{
+    if (!a_index.isValid() || a_index.row() >= m_messages.size())
+        return QVariant();
+    auto &message = m_messages[a_index.row()];
+    switch (a_role)
+    {
+    case Qt::DisplayRole:
+    {
+        auto text = message.m_text;
+        text.replace("\n", "<br>");
+        return QString("<font color=%1><b>%2</b></font> <font color=gray>(%3)</font><br>%4")
+            .arg(message.m_sentToSender ? "red" : "blue")
+            .arg(getSenderName(message))
+            .arg(message.m_date.toString(Message::m_dateTimeFormat))
+            .arg(text);
+    }
+    case TextRole:
+        return QString("%1 (%2)\n%3").arg(getSenderName(message)).arg(message.m_date.toString(Message::m_dateTimeFormat)).arg(message.m_text);
+    default:
+        return QVariant();
+    }
+}
+
+bool MessageModel::hasOlderMessages() const
+{
+    return m_first > 0;
+}
+
+int MessageModel::loadOlderMessages()
+{
+    auto first = m_first > g_pageSize ? m_first - g_pageSize : 0;
+    auto messages = m_signaling->getMessages(m_id, first, m_first - first);
+    if (messages.isEmpty())
+        return 0;
+    beginInsertRows(QModelIndex(), 0, messages.size() - 1);
+    m_first = first;
+    m_messages = messages + m_messages;
+    endInsertRows();
+    return messages.size();
+}
+
+int MessageModel::loadMessage(size_t a_number)
+{
+    while (a_number < m_first)
+        if (loadOlderMessages() == 0)
+            return -1;
+    if (a_number - m_first >= (size_t)m_messages.size())
+        return -1;
+    return a_number - m_first;
+}
+
+void MessageModel::appendMessage(const Message &a_message)
+{
+    beginInsertRows(QModelIndex(), m_messages.size(), m_messages.size());
+    m_messages.append(a_message);
+    endInsertRows();
+}
+
+// private:
+QString MessageModel::getSenderName(const Message &a_message) const
+{
+    return a_message.m_sentToSender ? m_signaling->getUserName(m_id) : m_signaling->getName();
+}
+
+//-------------------------------------------------------------------------------------------------
+void MessageDelegate::paint(QPainter *a_painter, const QStyleOptionViewItem &a_option, const QModelIndex &a_index) const
+{
+    QStyleOptionViewItem option = a_option;
+    initStyleOption(&option, a_index);
+    option.text.clear();
+    auto style = option.widget != nullptr ? option.widget->style() : QApplication::style();
+    style->drawPrimitive(QStyle::PE_PanelItemViewItem, &option, a_painter, option.widget);
+
+    auto document = getDocument(option, a_index);
+    a_painter->save();
+    a_painter->translate(option.rect.topLeft());
+    document->drawContents(a_painter);
+    a_painter->restore();
+}
+
+QSize MessageDelegate::sizeHint(const QStyleOptionViewItem &a_option, const QModelIndex &a_index) const
+{
+    auto document = getDocument(a_option, a_index);
+    return QSize(m_width, qCeil(document->size().height()));
+}
+
+// private:
+// ширина сообщения равна ширине области просмотра, чтобы текст переносился по ней
+int MessageDelegate::getWidth(const QStyleOptionViewItem &a_option)
+{
+    auto view = qobject_cast<const QAbstractItemView *>(a_option.widget);
+    if (view == nullptr)
+        return a_option.rect.width();
+    return view->viewport()->width();
+}
+
+// документ действителен до следующего вызова
+QTextDocument *MessageDelegate::getDocument(const QStyleOptionViewItem &a_option, const QModelIndex &a_index) const
+{
+    auto width = getWidth(a_option);
+    if (width != m_width || a_option.font != m_font)
+    {
+        // разбивка на строки изменилась у всех сообщений
+        m_documents.clear();
+        m_width = width;
+        m_font = a_option.font;
+    }
+    auto html = a_index.data().toString();
+    auto document = m_documents.object(html);
+    if (document != nullptr)
+        return document;
+    document = new QTextDocument;
+    document->setDefaultFont(m_font);
+    document->setHtml(html);
+    document->setTextWidth(m_width);
+    m_documents.insert(html, document);
+    return document;
+}
@@ -0,0 +1,69 @@
+﻿#ifndef MESSAGE_VIEW_H
+#define MESSAGE_VIEW_H
+
+#include <QAbstractListModel>
+#include <QStyledItemDelegate>
+#include <QTextDocument>
+#include <QCache>
+#include "messenger_signaling.h"
+
+// Сообщения одного диалога.
+// Загружается только последняя страница истории, более ранние страницы подгружаются
+// по запросу при прокрутке вверх. Сообщения форматируются при отображении.
+class MessageModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    static constexpr size_t g_pageSize = 100;
+
+    enum Role
+    {
+        TextRole = Qt::UserRole // текст сообщения без форматирования
+    };
+
+    MessageModel(std::shared_ptr<MessengerSignaling> a_signaling, const QString &a_id, QObject *a_parent = nullptr);
+
+    int rowCount(const QModelIndex &a_parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex &a_index, int a_role = Qt::DisplayRole) const override;
+
+    bool hasOlderMessages() const;
+    // возвращает число загруженных сообщений
+    int loadOlderMessages();
+    // загружает страницы до сообщения с номером a_number в истории и возвращает его строку или -1
+    int loadMessage(size_t a_number);
+    void appendMessage(const Message &a_message);
+
+private:
+    QString getSenderName(const Message &a_message) const;
+
+    std::shared_ptr<MessengerSignaling> m_signaling;
+    QString m_id;
+    size_t m_first = 0; // номер первого загруженного сообщения в истории
+    QList<Message> m_messages;
+};
+
+// Отрисовка сообщения в формате HTML.
+// Разметка сообщений кэшируется и пересчитывается только при изменении ширины области просмотра или шрифта.
+class MessageDelegate : public QStyledItemDelegate
+{
+    Q_OBJECT
+
+public:
+    using QStyledItemDelegate::QStyledItemDelegate;
+
+    void paint(QPainter *a_painter, const QStyleOptionViewItem &a_option, const QModelIndex &a_index) const override;
+    QSize sizeHint(const QStyleOptionViewItem &a_option, const QModelIndex &a_index) const override;
+
+private:
+    static int getWidth(const QStyleOptionViewItem &a_option);
+    QTextDocument *getDocument(const QStyleOptionViewItem &a_option, const QModelIndex &a_index) const;
+
+    // размеченные сообщения по тексту HTML; одинаковые сообщения размечаются одинаково
+    mutable QCache<QString, QTextDocument> m_documents{ 1000 };
+    // ширина и шрифт, с которыми размечены сообщения в кэше
+    mutable int m_width = -1;
+    mutable QFont m_font;
+};
+
+#endif // MESSAGE_VIEW_H
@@ -1,74 +1,16 @@
 ﻿#include <QUuid>
-#include <QFile>
-#include <QDir>
+#include <stdexcept>
 #include "messenger_signaling.h"
+#include "attribute_signal.h"
+#include "metrics.h"
+#include "tracing.h"
 
-QString Message::encode(const QString &a_string)
-{
-    QString result;
-    std::for_each(a_string.begin(), a_string.end(), [&result](auto a_char) mutable
-        {
-            if (a_char == '\n')
-                result.append("\\n");
-            else if (a_char == '\\')
-                result.append("\\\\");
-            else
-                result.append(a_char);
-        });
-    return result;
-}
-
-QString Message::decode(const QString &a_string)
-{
-    QString result;
-    std::for_each(a_string.begin(), a_string.end(), [m_escape = false, &result](auto a_char) mutable
-        {
-            if (m_escape)
-            {
-                if (a_char == 'n')
-                    result.append('\n');
-                else if (a_char == '\\')
-                    result.append('\\');
-                m_escape = false;
-            }
-            else if (a_char == '\\')
-                m_escape = true;
-            else
-                result.append(a_char);
-        });
-    return result;
-}
-
-Message Message::fromString(const QString &a_string, bool *a_ok)
-{
-    Message result;
-    if (a_string.length() < 1 + m_dateTimeFormat.length())
-    {
-        if (a_ok != nullptr)
-            *a_ok = false;
-        return result;
-    }
-    result.m_date = QDateTime::fromString(a_string.mid(1, m_dateTimeFormat.length()), m_dateTimeFormat);
-    if ((a_string[0] != '>' && a_string[0] != '<') || !result.m_date.isValid())
-    {
-        if (a_ok != nullptr)
-            *a_ok = false;
-        return result;
-    }
-    result.m_sentToSender = a_string[0] == '>';
-    if (a_ok != nullptr)
-        *a_ok = true;
-    result.m_text = decode(a_string.mid(1 + m_dateTimeFormat.length()));
-    return result;
-}
-
-QString Message::toString() const
-{
-    return QString("%1%2%3").arg(m_sentToSender ? ">" : "<").arg(m_date.toString(m_dateTimeFormat)).arg(encode(m_text));
-}
+static MetricCounter &g_sentMessages = Metrics::get().getCounter("messenger_sent_messages_total", "Chat messages sent");
+static MetricCounter &g_receivedMessages = Metrics::get().getCounter("messenger_received_messages_total", "Chat messages received");
+static MetricCounter &g_decodeErrors = Metrics::get().getCounter("messenger_decode_errors_total", "Messenger signals of unknown version");
 
 //-------------------------------------------------------------------------------------------------
-struct UserInfoSignal : AttributeContainer
+struct UserInfoSignal : AttributeSignal<UserInfoSignal>
 {
     ATTRIBUTE(QString, id);
     ATTRIBUTE(QString, name);
@@ -81,13 +23,23 @@ struct UserInfoSignal : AttributeContainer
         set_online(a_online);
     }
 
-    explicit UserInfoSignal(const QVariant &a_value) : AttributeContainer(a_value) {}
+    explicit UserInfoSignal(const QVariant &a_value)
+    {
+        fromQVariant(a_value);
+    }
+
+    template<typename S, typename V> static void visitAttributes(S &a_signal, V &&a_visitor)
+    {
+        VISIT_ATTRIBUTE(id);
+        VISIT_ATTRIBUTE(name);
+        VISIT_ATTRIBUTE(online);
+    }
 
     static constexpr char g_signalName[]{ "UserInfo" };
 };
 
 //-------------------------------------------------------------------------------------------------
-struct MessageSignal : AttributeContainer
+struct MessageSignal : AttributeSignal<MessageSignal>
 {
     ATTRIBUTE(QString, sender);
     ATTRIBUTE(QString, text);
@@ -98,13 +50,22 @@ struct MessageSignal : AttributeContainer
         set_text(a_text);
     }
 
-    explicit MessageSignal(const QVariant &a_value) : AttributeContainer(a_value) {}
+    explicit MessageSignal(const QVariant &a_value)
+    {
+        fromQVariant(a_value);
+    }
+
+    template<typename S, typename V> static void visitAttributes(S &a_signal, V &&a_visitor)
+    {
+        VISIT_ATTRIBUTE(sender);
+        VISIT_ATTRIBUTE(text);
+    }
 
     static constexpr char g_signalName[]{ "Message" };
 };
 
 //-------------------------------------------------------------------------------------------------
-struct TypingSignal : AttributeContainer
+struct TypingSignal : AttributeSignal<TypingSignal>
 {
     ATTRIBUTE(QString, sender);
     ATTRIBUTE(bool, typing);
@@ -115,35 +76,34 @@ struct TypingSignal : AttributeContainer
         set_typing(a_typing);
     }
 
-    explicit TypingSignal(const QVariant &a_value) : AttributeContainer(a_value) {}
+    explicit TypingSignal(const QVariant &a_value)
+    {
+        fromQVariant(a_value);
+    }
+
+    template<typename S, typename V> static void visitAttributes(S &a_signal, V &&a_visitor)
+    {
+        VISIT_ATTRIBUTE(sender);
+        VISIT_ATTRIBUTE(typing);
+    }
 
     static constexpr char g_signalName[]{ "Typing" };
 };
 
 //-------------------------------------------------------------------------------------------------
-MessengerSignaling::MessengerSignaling(std::shared_ptr<Signaling> a_signaling)
+MessengerSignaling::MessengerSignaling(std::shared_ptr<Signaling> a_signaling, const QString &a_historyDirectory, const QString &a_legacyHistoryDirectory) :
+    m_history(a_historyDirectory, a_legacyHistoryDirectory),
+    m_searchIndex(m_history, a_historyDirectory)
 {
     m_signaling = a_signaling;
-    connect(m_signaling.get(), &Signaling::signalReceived, this, &MessengerSignaling::onSignalReceived);
-    m_signaling->subscribe(UserInfoSignal::g_signalName);
-    connect(&m_sendTimer, &QTimer::timeout, this, &MessengerSignaling::sendUserInfo);
-    connect(&m_kickTimer, &QTimer::timeout, this, &MessengerSignaling::autoKickUser);
-    m_kickTimer.start(1000);
-
-    for (auto fileInfo : QDir("messages").entryInfoList(QDir::Files))
-    {
-        QFile file(fileInfo.absoluteFilePath());
-        if (!file.open(QIODevice::ReadOnly))
-            continue;
-        QTextStream stream(&file);
-        while (!stream.atEnd())
-        {
-            bool ok = false;
-            auto message = Message::fromString(stream.readLine(), &ok);
-            if (ok)
-                m_history[fileInfo.fileName()].push_back(message);
-        }
-    }
+    // информация о пользователе отправляется при ее изменении и новым подписчикам (узлам прежних версий - каждую секунду),
+    // а об отключении пользователя сообщает разрыв соединения с ним
+    connect(m_signaling.get(), &Signaling::subscriberAdded, this, &MessengerSignaling::onSubscriberAdded);
+    connect(m_signaling.get(), &Signaling::peerDisconnected, this, &MessengerSignaling::onPeerDisconnected);
+    connect(&m_legacyUserInfoTimer, &QTimer::timeout, this, &MessengerSignaling::sendLegacyUserInfo);
+    m_legacyUserInfoTimer.start(1000);
+    subscribe<UserInfoSignal>(UserInfoSignal::g_signalName);
+    m_userInfoTopic = m_signaling->getTopicId(UserInfoSignal::g_signalName);
 }
 
 QString MessengerSignaling::getId() const
@@ -156,9 +116,10 @@ void MessengerSignaling::setId(const QString &a_id)
     m_signaling->unsubscribe(getSignalName(MessageSignal::g_signalName, m_id));
     m_signaling->unsubscribe(getSignalName(TypingSignal::g_signalName, m_id));
     m_id = a_id;
-    m_signaling->subscribe(getSignalName(MessageSignal::g_signalName, m_id));
-    m_signaling->subscribe(getSignalName(TypingSignal::g_signalName, m_id));
-    m_sendTimer.start(1000);
+    m_userInfoMessage = {};
+    subscribe<MessageSignal>(getSignalName(MessageSignal::g_signalName, m_id));
+    subscribe<TypingSignal>(getSignalName(TypingSignal::g_signalName, m_id));
+    sendUserInfo();
 }
 
 QString MessengerSignaling::getName() const
@@ -168,14 +129,20 @@ QString MessengerSignaling::getName() const
 
 void MessengerSignaling::setName(const QString &a_name)
 {
+    if (m_name == a_name)
+        return;
     m_name = a_name;
+    m_userInfoMessage = {};
+    sendUserInfo();
 }
 
 void MessengerSignaling::setOnline(bool a_online)
 {
+    if (m_online == a_online)
+        return;
     m_online = a_online;
-    if (m_online)
-        m_sendTimer.start(1000);
+    m_userInfoMessage = {};
+    sendUserInfo();
 }
 
 bool MessengerSignaling::userIsOnline(const QString &a_id)
@@ -193,15 +160,33 @@ QString MessengerSignaling::getUserName(const QString &a_id)
     return it->second.m_name;
 }
 
-QList<Message> MessengerSignaling::getMessages(const QString &a_sender)
+size_t MessengerSignaling::getMessageCount(const QString &a_id)
+{
+    return m_history.getMessageCount(a_id);
+}
+
+QList<Message> MessengerSignaling::getMessages(const QString &a_id, size_t a_first, size_t a_count)
 {
-    return m_history[a_sender];
+    return m_history.getMessages(a_id, a_first, a_count);
+}
+
+std::map<size_t, Message> MessengerSignaling::getMessages(const QString &a_id, const std::set<size_t> &a_numbers)
+{
+    return m_history.getMessages(a_id, a_numbers);
+}
+
+std::vector<SearchResult> MessengerSignaling::searchMessages(const QString &a_query, const QString &a_id, const QDateTime &a_from, const QDateTime &a_to, size_t a_limit)
+{
+    return m_searchIndex.search(a_query, a_id, a_from, a_to, a_limit);
 }
 
 void MessengerSignaling::sendMessage(const QString &a_receiver, const QString &a_text)
 {
-    m_signaling->sendSignal(getSignalName(MessageSignal::g_signalName, a_receiver), MessageSignal(m_id, a_text).toQVariant());
+    TraceSpan span("MessengerSignaling.sendMessage", "messenger");
+    span.setArgument("chars", a_text.size());
+    m_signaling->sendSignal(getSignalName(MessageSignal::g_signalName, a_receiver), MessageSignal(m_id, a_text));
     addMessageToHistory(a_receiver, Message{ false, QDateTime::currentDateTime(), a_text });
+    g_sentMessages.add();
 }
 
 bool MessengerSignaling::isTyping(const QString &a_sender)
@@ -213,55 +198,76 @@ bool MessengerSignaling::isTyping(const QString &a_sender)
 
 void MessengerSignaling::sendTyping(const QString &a_receiver, bool a_typing)
 {
-    m_signaling->sendSignal(getSignalName(TypingSignal::g_signalName, a_receiver), TypingSignal(m_id, a_typing).toQVariant());
+    m_signaling->sendSignal(getSignalName(TypingSignal::g_signalName, a_receiver), TypingSignal(m_id, a_typing));
 }
 
 // private slots:
-void MessengerSignaling::sendUserInfo()
-{
-    m_signaling->sendSignal(UserInfoSignal::g_signalName, UserInfoSignal(m_id, m_name, m_online).toQVariant());
-}
-
-void MessengerSignaling::onSignalReceived(QString a_signal, QVariant a_value)
+void MessengerSignaling::onSubscriberAdded(Signaling::TopicId a_topic, QTcpSocket *a_peer)
 {
-    tryHandleSignal<UserInfoSignal>(a_signal, a_value) ||
-        tryHandleSignal<MessageSignal>(a_signal, a_value) ||
-        tryHandleSignal<TypingSignal>(a_signal, a_value);
+    // новый узел получает информацию о пользователе один раз
+    if (a_topic == m_userInfoTopic)
+        sendUserInfo(a_peer);
 }
 
-void MessengerSignaling::autoKickUser()
+void MessengerSignaling::onPeerDisconnected(QTcpSocket *a_peer)
 {
     std::vector<QString> removingIds;
     for (auto &user : m_users)
-        if (user.second.m_refresh_time.secsTo(QDateTime::currentDateTime()) >= 2)
+        if (user.second.m_peer == a_peer)
             removingIds.push_back(user.first);
     for (auto &id : removingIds)
     {
         m_users.erase(id);
+        m_typing.remove(id);
         emit userRemoved(id);
     }
 }
 
+void MessengerSignaling::sendLegacyUserInfo()
+{
+    // пользователь не в сети: узлы прежних версий получили об этом сигнал и больше его не ждут
+    if (m_id.isNull() || !m_online || !m_signaling->hasLegacyPeers())
+        return;
+    if (m_userInfoMessage.m_message.isEmpty())
+        m_userInfoMessage = m_signaling->prepareSignal(m_userInfoTopic, UserInfoSignal(m_id, m_name, m_online));
+    m_signaling->sendPreparedSignalToLegacyPeers(m_userInfoTopic, m_userInfoMessage);
+}
+
 // private:
 QString MessengerSignaling::getSignalName(const QString &a_prefix, const QString &a_id)
 {
-    return QString("%1_%2").arg(a_prefix).arg(a_id);
+    return a_prefix + '_' + a_id;
 }
 
-template<typename T> bool MessengerSignaling::tryHandleSignal(const QString &a_signal, const QVariant &a_value)
+void MessengerSignaling::sendUserInfo(QTcpSocket *a_peer)
 {
-    if (a_signal.left(QString(T::g_signalName).length()) != T::g_signalName)
-        return false;
-    handleSignal<T>(T(a_value));
-    return true;
+    if (m_id.isNull())
+        return; // пользователь еще не вошел
+    if (m_userInfoMessage.m_message.isEmpty())
+        m_userInfoMessage = m_signaling->prepareSignal(m_userInfoTopic, UserInfoSignal(m_id, m_name, m_online));
+    m_signaling->sendPreparedSignal(m_userInfoTopic, m_userInfoMessage, a_peer);
+}
+
+// сигналы темы передаются обработчику в потоке MessengerSignaling без сравнения имен тем
+template<typename T> void MessengerSignaling::subscribe(const QString &a_name)
+{
+    m_signaling->subscribe(a_name, this, [this](const QVariant &a_value, QTcpSocket *a_peer)
+        {
+            TraceSpan span(T::g_signalName, "messenger");
+            T signal(a_value);
+            if (signal.isValid())
+                handleSignal<T>(a_peer, signal);
+            else
+                g_decodeErrors.add(); // сигналы неизвестной версии пропускаются
+        });
 }
 
-template<typename T> void MessengerSignaling::handleSignal(const T &)
+template<typename T> void MessengerSignaling::handleSignal(QTcpSocket *, const T &)
 {
-    throw std::exception("MessengerSignaling.handleSignal: undefined signal handler");
+    throw std::runtime_error("MessengerSignaling.handleSignal: undefined signal handler");
 }
 
-template<> void MessengerSignaling::handleSignal(const UserInfoSignal &a_data)
+template<> void MessengerSignaling::handleSignal(QTcpSocket *a_peer, const UserInfoSignal &a_data)
 {
     auto id = a_data.get_id();
     if (id == m_id)
@@ -273,34 +279,38 @@ template<> void MessengerSignaling::handleSignal(const UserInfoSignal &a_data)
 
     if (!a_data.get_online())
     {
-        m_users.erase(id);
-        emit userRemoved(id);
+        if (m_users.erase(id) != 0)
+            emit userRemoved(id);
         return;
     }
     auto it = m_users.find(id);
     if (it != m_users.end())
     {
-        it->second.m_refresh_time = QDateTime::currentDateTime();
+        it->second.m_peer = a_peer;
         auto name = a_data.get_name();
         if (it->second.m_name != name)
+        {
+            it->second.m_name = name;
             emit userRenamed(id, name);
+        }
         return;
     }
     UserInfo user;
     user.m_name = a_data.get_name();
-    user.m_refresh_time = QDateTime::currentDateTime();
+    user.m_peer = a_peer;
     m_users[id] = user;
     emit userAdded(id, user.m_name);
 }
 
-template<> void MessengerSignaling::handleSignal(const MessageSignal &a_data)
+template<> void MessengerSignaling::handleSignal(QTcpSocket *, const MessageSignal &a_data)
 {
     auto date = QDateTime::currentDateTime();
     addMessageToHistory(a_data.get_sender(), Message{ true, date, a_data.get_text() });
+    g_receivedMessages.add();
     emit messageReceived(a_data.get_sender(), date, a_data.get_text());
 }
 
-template<> void MessengerSignaling::handleSignal(const TypingSignal &a_data)
+template<> void MessengerSignaling::handleSignal(QTcpSocket *, const TypingSignal &a_data)
 {
     m_typing[a_data.get_sender()] = a_data.get_typing();
     emit typing(a_data.get_sender(), a_data.get_typing());
@@ -308,13 +318,6 @@ template<> void MessengerSignaling::handleSignal(const TypingSignal &a_data)
 
 void MessengerSignaling::addMessageToHistory(const QString &a_id, const Message &a_message)
 {
-    m_history[a_id].append(a_message);
-
-    // сохраняем в файл
-    if (!QDir().mkpath("messages"))
-        return;
-    QFile file(QString("messages") + QDir::separator() + a_id);
-    if (!file.open(QIODevice::Append))
-        return;
-    QTextStream(&file) << a_message.toString() << '\n';
+    TraceSpan span("MessengerSignaling.addMessageToHistory", "messenger");
+    m_searchIndex.addMessage(a_id, m_history.append(a_id, a_message), a_message);
 }
@@ -4,47 +4,14 @@
 #include <QTimer>
 #include <QDateTime>
 #include "signaling.h"
+#include "history_store.h"
+#include "search_index.h"
 
 struct UserInfo
 {
     QString m_name;
-    QDateTime m_refresh_time;
-};
-
-struct Message
-{
-    static QString encode(const QString &a_string);
-    static QString decode(const QString &a_string);
-    static Message fromString(const QString &a_string, bool *a_ok = nullptr);
-
-    QString toString() const;
-
-    inline static const QString m_dateTimeFormat{ "dd.MM.yyyy hh:mm:ss" };
-
-    bool m_sentToSender = false;
-    QDateTime m_date;
-    QString m_text;
-};
-
-#define ATTRIBUTE(type,name) \
-   type get_##name() const { return m_container[#name].value<type>(); }\
-   void set_##name(const type &a_value) { m_container[#name] = a_value; }
-
-struct AttributeContainer
-{
-    AttributeContainer() {}
-
-    explicit AttributeContainer(const QVariant &a_value)
-    {
-        m_container = a_value.toMap();
-    }
-
-    QVariant toQVariant() const
-    {
-        return m_container;
-    }
-
-    QMap<QString, QVariant> m_container;
+    // соединение, через которое получена информация о пользователе
+    QTcpSocket *m_peer = nullptr;
 };
 
 class MessengerSignaling : public QObject
@@ -52,7 +19,9 @@ class MessengerSignaling : public QObject
     Q_OBJECT
 
 public:
-    MessengerSignaling(std::shared_ptr<Signaling> a_signaling);
+    // a_historyDirectory - каталог истории сообщений, a_legacyHistoryDirectory - каталог истории прежних версий
+    MessengerSignaling(std::shared_ptr<Signaling> a_signaling, const QString &a_historyDirectory = "history",
+        const QString &a_legacyHistoryDirectory = "messages");
 
     QString getId() const;
     void setId(const QString &a_id);
@@ -61,7 +30,11 @@ public:
     void setOnline(bool a_online);
     bool userIsOnline(const QString &a_id);
     QString getUserName(const QString &a_id);
-    QList<Message> getMessages(const QString &a_id);
+    size_t getMessageCount(const QString &a_id);
+    QList<Message> getMessages(const QString &a_id, size_t a_first, size_t a_count);
+    std::map<size_t, Message> getMessages(const QString &a_id, const std::set<size_t> &a_numbers);
+    std::vector<SearchResult> searchMessages(const QString &a_query, const QString &a_id = QString(),
+        const QDateTime &a_from = QDateTime(), const QDateTime &a_to = QDateTime(), size_t a_limit = 100);
     void sendMessage(const QString &a_receiver, const QString &a_text);
     bool isTyping(const QString &a_receiver);
     void sendTyping(const QString &a_receiver, bool a_typing);
@@ -75,24 +48,31 @@ signals:
     void typing(QString a_sender, bool a_typing);
 
 private slots:
-    void sendUserInfo();
-    void onSignalReceived(QString a_signal, QVariant a_value);
-    void autoKickUser();
+    void onSubscriberAdded(Signaling::TopicId a_topic, QTcpSocket *a_peer);
+    void onPeerDisconnected(QTcpSocket *a_peer);
+    void sendLegacyUserInfo();
 
 private:
     static QString getSignalName(const QString &a_prefix, const QString &a_id);
 
-    template<typename T> bool tryHandleSignal(const QString &a_signal, const QVariant &a_value);
-    template<typename T> void handleSignal(const T &a_signal);
+    void sendUserInfo(QTcpSocket *a_peer = nullptr);
+    // подписка на тему с обработчиком сигнала T
+    template<typename T> void subscribe(const QString &a_name);
+    template<typename T> void handleSignal(QTcpSocket *a_peer, const T &a_signal);
     void addMessageToHistory(const QString &a_id, const Message &a_message);
 
     std::shared_ptr<Signaling> m_signaling;
+    Signaling::TopicId m_userInfoTopic;
+    // подготовленный сигнал UserInfo, сбрасывается при изменении идентификатора, имени или состояния
+    Signaling::PreparedSignal m_userInfoMessage;
+    // узлы прежних версий удаляют пользователя, от которого 2 секунды не было UserInfo,
+    // поэтому им информация о пользователе по-прежнему отправляется каждую секунду
+    QTimer m_legacyUserInfoTimer;
     QString m_id;
     QString m_name;
     bool m_online = true;
-    std::map<QString, QList<Message>> m_history;
-    QTimer m_sendTimer; // таймер для sendUserInfo
+    HistoryStore m_history;
+    SearchIndex m_searchIndex;
     QMap<QString, bool> m_typing;
     std::map<QString, UserInfo> m_users;
-    QTimer m_kickTimer; // таймер для очистки m_users
 };
@@ -0,0 +1,222 @@
+﻿#include <QLocalServer>
+#include <QLocalSocket>
+#include <QSaveFile>
+#include <QTextStream>
+#include <stdexcept>
+#include "metrics.h"
+#include "settings.h"
+
+Metric::Metric(const QString &a_name, const QString &a_help, const QString &a_labels)
+{
+    m_name = a_name;
+    m_help = a_help;
+    m_labels = a_labels;
+}
+
+QString Metric::escapeLabelValue(const QString &a_value)
+{
+    QString result;
+    result.reserve(a_value.size());
+    for (auto character : a_value)
+    {
+        if (character == '\\')
+            result.append("\\\\");
+        else if (character == '"')
+            result.append("\\\"");
+        else if (character == '\n')
+            result.append("\\n");
+        else
+            result.append(character);
+    }
+    return result;
+}
+
+// метки передаются уже в формате Prometheus, значения в них экранируются при создании метрики (escapeLabelValue)
+QString Metric::getSeriesName(const QString &a_suffix, const QString &a_extraLabel) const
+{
+    QStringList labels;
+    if (!m_labels.isEmpty())
+        labels.append(m_labels);
+    if (!a_extraLabel.isEmpty())
+        labels.append(a_extraLabel);
+    if (labels.isEmpty())
+        return m_name + a_suffix;
+    return QString("%1%2{%3}").arg(m_name).arg(a_suffix).arg(labels.join(','));
+}
+
+//-------------------------------------------------------------------------------------------------
+void MetricCounter::write(QTextStream &a_stream) const
+{
+    a_stream << getSeriesName() << ' ' << m_value.load(std::memory_order_relaxed) << '\n';
+}
+
+void MetricGauge::write(QTextStream &a_stream) const
+{
+    a_stream << getSeriesName() << ' ' << m_value.load(std::memory_order_relaxed) << '\n';
+}
+
+//-------------------------------------------------------------------------------------------------
+MetricHistogram::MetricHistogram(const QString &a_name, const QString &a_help, const QString &a_labels, const std::vector<qint64> &a_bounds) :
+    Metric(a_name, a_help, a_labels),
+    m_bounds(a_bounds),
+    m_buckets(new std::atomic<quint64>[a_bounds.size() + 1])
+{
+    std::sort(m_bounds.begin(), m_bounds.end());
+    for (size_t i = 0; i <= m_bounds.size(); i++)
+        m_buckets[i] = 0;
+}
+
+// интервалы в формате Prometheus накопительные
+void MetricHistogram::write(QTextStream &a_stream) const
+{
+    quint64 count = 0;
+    for (size_t i = 0; i <= m_bounds.size(); i++)
+    {
+        count += m_buckets[i].load(std::memory_order_relaxed);
+        auto bound = i < m_bounds.size() ? QString::number(m_bounds[i]) : QString("+Inf");
+        a_stream << getSeriesName("_bucket", QString("le=\"%1\"").arg(bound)) << ' ' << count << '\n';
+    }
+    a_stream << getSeriesName("_sum") << ' ' << m_sum.load(std::memory_order_relaxed) << '\n';
+    a_stream << getSeriesName("_count") << ' ' << count << '\n';
+}
+
+std::vector<qint64> MetricHistogram::getExponentialBounds(qint64 a_first, double a_factor, int a_count)
+{
+    std::vector<qint64> result;
+    double bound = a_first;
+    for (int i = 0; i < a_count; i++, bound *= a_factor)
+        if (result.empty() || (qint64)bound > result.back())
+            result.push_back((qint64)bound);
+    return result;
+}
+
+//-------------------------------------------------------------------------------------------------
+Metrics &Metrics::get()
+{
+    static Metrics instance;
+    return instance;
+}
+
+MetricCounter &Metrics::getCounter(const QString &a_name, const QString &a_help, const QString &a_labels)
+{
+    return getMetric<MetricCounter>(a_name, a_help, a_labels);
+}
+
+MetricGauge &Metrics::getGauge(const QString &a_name, const QString &a_help, const QString &a_labels)
+{
+    return getMetric<MetricGauge>(a_name, a_help, a_labels);
+}
+
+MetricHistogram &Metrics::getHistogram(const QString &a_name, const QString &a_help, const std::vector<qint64> &a_bounds, const QString &a_labels)
+{
+    return getMetric<MetricHistogram>(a_name, a_help, a_labels, a_bounds);
+}
+
+void Metrics::remove(const Metric &a_metric)
+{
+    QMutexLocker locker(&m_mutex);
+    auto it = std::find_if(m_metrics.begin(), m_metrics.end(), [&a_metric](auto &a_item)
+        {
+            return a_item.get() == &a_metric;
+        });
+    if (it != m_metrics.end())
+        m_metrics.erase(it);
+}
+
+QByteArray Metrics::toText() const
+{
+    QByteArray result;
+    QTextStream stream(&result);
+    QMutexLocker locker(&m_mutex);
+    // серии одной метрики с разными метками выводятся под одним заголовком
+    std::vector<const Metric *> metrics;
+    for (auto &metric : m_metrics)
+        metrics.push_back(metric.get());
+    std::stable_sort(metrics.begin(), metrics.end(), [](auto a_left, auto a_right)
+        {
+            return a_left->m_name < a_right->m_name;
+        });
+    for (size_t i = 0; i < metrics.size(); i++)
+    {
+        if (i == 0 || metrics[i]->m_name != metrics[i - 1]->m_name)
+        {
+            stream << "# HELP " << metrics[i]->m_name << ' ' << metrics[i]->m_help << '\n';
+            stream << "# TYPE " << metrics[i]->m_name << ' ' << metrics[i]->getType() << '\n';
+        }
+        metrics[i]->write(stream);
+    }
+    stream.flush();
+    return result;
+}
+
+// private:
+template<typename T, typename... A> T &Metrics::getMetric(const QString &a_name, const QString &a_help, const QString &a_labels, A&&... a_arguments)
+{
+    QMutexLocker locker(&m_mutex);
+    for (auto &metric : m_metrics)
+    {
+        if (metric->m_name != a_name || metric->m_labels != a_labels)
+            continue;
+        auto result = dynamic_cast<T *>(metric.get());
+        if (result == nullptr)
+            throw std::runtime_error("Metrics.getMetric: metric is registered with another type");
+        return *result;
+    }
+    auto metric = new T(a_name, a_help, a_labels, std::forward<A>(a_arguments)...);
+    m_metrics.emplace_back(metric);
+    return *metric;
+}
+
+//-------------------------------------------------------------------------------------------------
+MetricsExporter::MetricsExporter()
+{
+    connect(&m_fileTimer, &QTimer::timeout, this, &MetricsExporter::writeFile);
+}
+
+MetricsExporter::~MetricsExporter()
+{
+    writeFile();
+}
+
+bool MetricsExporter::start()
+{
+    auto socketName = Settings::get().value("MetricsSocket").toString();
+    m_fileName = Settings::get().value("MetricsFile").toString();
+    if (!m_fileName.isEmpty())
+        m_fileTimer.start(std::max(Settings::get().value("MetricsFileInterval", 10000).toInt(), 1000));
+    if (socketName.isEmpty())
+        return true;
+    m_server = std::make_unique<QLocalServer>();
+    // сокет, оставшийся после аварийного завершения, мешает запуску сервера
+    QLocalServer::removeServer(socketName);
+    if (!m_server->listen(socketName))
+    {
+        m_server = nullptr;
+        return false;
+    }
+    connect(m_server.get(), &QLocalServer::newConnection, this, &MetricsExporter::onClientConnected);
+    return true;
+}
+
+// private slots:
+void MetricsExporter::onClientConnected()
+{
+    while (m_server->hasPendingConnections())
+    {
+        auto client = m_server->nextPendingConnection();
+        connect(client, &QLocalSocket::disconnected, client, &QObject::deleteLater);
+        client->write(Metrics::get().toText());
+        client->disconnectFromServer();
+    }
+}
+
+void MetricsExporter::writeFile()
+{
+    if (m_fileName.isEmpty())
+        return;
+    QSaveFile file(m_fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+    file.write(Metrics::get().toText());
+    file.commit();
+}
@@ -0,0 +1,177 @@
+﻿#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <QObject>
+#include <QMutex>
+#include <QTimer>
+#include <QString>
+
+class QLocalServer;
+class QTextStream;
+
+// Метрика с именем и метками в формате Prometheus, например peer="10.0.0.2:5000".
+class Metric
+{
+public:
+    Metric(const QString &a_name, const QString &a_help, const QString &a_labels);
+    virtual ~Metric() = default;
+
+    // значение метки с экранированными \, " и переводами строк, например адрес или имя узла
+    static QString escapeLabelValue(const QString &a_value);
+
+    QString getName() const
+    {
+        return m_name;
+    }
+
+    QString getLabels() const
+    {
+        return m_labels;
+    }
+
+    virtual const char *getType() const = 0;
+    virtual void write(QTextStream &a_stream) const = 0;
+
+protected:
+    QString getSeriesName(const QString &a_suffix = QString(), const QString &a_extraLabel = QString()) const;
+
+    QString m_name;
+    QString m_help;
+    QString m_labels;
+
+    friend class Metrics;
+};
+
+// Монотонно растущий счетчик
+class MetricCounter : public Metric
+{
+public:
+    using Metric::Metric;
+
+    void add(quint64 a_value = 1)
+    {
+        m_value.fetch_add(a_value, std::memory_order_relaxed);
+    }
+
+    const char *getType() const override
+    {
+        return "counter";
+    }
+
+    void write(QTextStream &a_stream) const override;
+
+private:
+    std::atomic<quint64> m_value = 0;
+};
+
+// Текущее значение: размер очереди, скорость и т.п.
+class MetricGauge : public Metric
+{
+public:
+    using Metric::Metric;
+
+    void set(qint64 a_value)
+    {
+        m_value.store(a_value, std::memory_order_relaxed);
+    }
+
+    void add(qint64 a_value)
+    {
+        m_value.fetch_add(a_value, std::memory_order_relaxed);
+    }
+
+    const char *getType() const override
+    {
+        return "gauge";
+    }
+
+    void write(QTextStream &a_stream) const override;
+
+private:
+    std::atomic<qint64> m_value = 0;
+};
+
+// Распределение значений по интервалам с заданными верхними границами
+class MetricHistogram : public Metric
+{
+public:
+    MetricHistogram(const QString &a_name, const QString &a_help, const QString &a_labels, const std::vector<qint64> &a_bounds);
+
+    void observe(qint64 a_value)
+    {
+        auto bucket = std::lower_bound(m_bounds.begin(), m_bounds.end(), a_value) - m_bounds.begin();
+        m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(a_value, std::memory_order_relaxed);
+    }
+
+    const char *getType() const override
+    {
+        return "histogram";
+    }
+
+    void write(QTextStream &a_stream) const override;
+
+    // границы a_first, a_first * a_factor, ... - всего a_count
+    static std::vector<qint64> getExponentialBounds(qint64 a_first, double a_factor, int a_count);
+
+private:
+    std::vector<qint64> m_bounds;
+    // последний интервал - значения больше всех границ
+    std::unique_ptr<std::atomic<quint64>[]> m_buckets;
+    std::atomic<qint64> m_sum = 0;
+};
+
+// Реестр метрик.
+// Значения метрик изменяются атомарными операциями без блокировок, поэтому их можно обновлять
+// из любого потока на горячем пути. Регистрация и выгрузка выполняются под мьютексом: метрики
+// регистрируются один раз, а обновляющий код хранит ссылки на них.
+class Metrics
+{
+public:
+    static Metrics &get();
+
+    // повторная регистрация с теми же именем и метками возвращает ту же метрику
+    MetricCounter &getCounter(const QString &a_name, const QString &a_help, const QString &a_labels = QString());
+    MetricGauge &getGauge(const QString &a_name, const QString &a_help, const QString &a_labels = QString());
+    MetricHistogram &getHistogram(const QString &a_name, const QString &a_help, const std::vector<qint64> &a_bounds,
+        const QString &a_labels = QString());
+    // удаление метрики с метками, например узла, который отключился; ссылки на нее становятся недействительными
+    void remove(const Metric &a_metric);
+
+    // текстовый формат Prometheus
+    QByteArray toText() const;
+
+private:
+    Metrics() {}
+
+    template<typename T, typename... A> T &getMetric(const QString &a_name, const QString &a_help, const QString &a_labels, A&&... a_arguments);
+
+    mutable QMutex m_mutex;
+    std::vector<std::unique_ptr<Metric>> m_metrics;
+};
+
+// Выгрузка метрик по запросу: клиент локального сокета получает текст метрик и соединение закрывается.
+// Если задан файл, метрики записываются в него периодически и при уничтожении объекта.
+class MetricsExporter : public QObject
+{
+    Q_OBJECT
+
+public:
+    MetricsExporter();
+    ~MetricsExporter();
+
+    // настройки MetricsSocket, MetricsFile и MetricsFileInterval; пустые имена отключают выгрузку
+    bool start();
+
+private slots:
+    void onClientConnected();
+    void writeFile();
+
+private:
+    std::unique_ptr<QLocalServer> m_server;
+    QString m_fileName;
+    QTimer m_fileTimer;
+};
@@ -0,0 +1,316 @@
+﻿#include <QRegularExpression>
+#include <QFile>
+#include <QDataStream>
+#include <QDeadlineTimer>
+#include <tuple>
+#include "search_index.h"
+#include "settings.h"
+
+SearchIndex::SearchIndex(HistoryStore &a_history, const QString &a_directory) :
+    m_history(a_history)
+{
+    m_directory = a_directory;
+    m_saveInterval = Settings::get().value("SearchIndexSaveInterval", m_saveInterval).toInt();
+    m_thread.reset(QThread::create([this]() { run(); }));
+    m_thread->start(QThread::LowPriority);
+}
+
+SearchIndex::~SearchIndex()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_stopping = true;
+        m_stopRequested.wakeAll();
+    }
+    m_thread->wait();
+}
+
+void SearchIndex::addMessage(const QString &a_id, size_t a_number, const Message &a_message)
+{
+    QMutexLocker locker(&m_mutex);
+    auto &contact = m_contacts[getContactNumber(a_id)];
+    if (contact.m_loaded && contact.m_dates.size() == a_number)
+        indexMessage(contact, a_message);
+}
+
+std::vector<SearchResult> SearchIndex::search(const QString &a_query, const QString &a_id, const QDateTime &a_from, const QDateTime &a_to, size_t a_limit)
+{
+    std::vector<SearchResult> results;
+    auto words = getWords(a_query);
+    if (words.isEmpty())
+        return results;
+    auto from = a_from.isValid() ? a_from.toMSecsSinceEpoch() : std::numeric_limits<qint64>::min();
+    auto to = a_to.isValid() ? a_to.toMSecsSinceEpoch() : std::numeric_limits<qint64>::max();
+    QMutexLocker locker(&m_mutex);
+    quint32 firstContact = 0;
+    quint32 endContact = m_contacts.size();
+    if (!a_id.isNull())
+    {
+        auto it = m_contactNumbers.find(a_id);
+        if (it == m_contactNumbers.end())
+            return results;
+        firstContact = *it;
+        endContact = *it + 1;
+    }
+
+    // дата, собеседник и номер найденного сообщения
+    std::vector<std::tuple<qint64, quint32, quint32>> found;
+    for (auto contactNumber = firstContact; contactNumber < endContact; contactNumber++)
+    {
+        auto &contact = m_contacts[contactNumber];
+        std::vector<const std::vector<quint32> *> lists;
+        for (auto &word : words)
+        {
+            auto it = contact.m_words.constFind(word);
+            if (it == contact.m_words.constEnd())
+                break;
+            lists.push_back(&*it);
+        }
+        if (lists.size() != (size_t)words.size())
+            continue; // у собеседника нет сообщений с каким-то из слов
+        // перебирается самый короткий список, остальные проверяются двоичным поиском
+        std::sort(lists.begin(), lists.end(), [](auto a_left, auto a_right)
+            {
+                return a_left->size() < a_right->size();
+            });
+        for (auto number : *lists.front())
+        {
+            auto date = contact.m_dates[number];
+            if (date < from || date > to)
+                continue;
+            if (std::all_of(lists.begin() + 1, lists.end(), [number](auto a_list) { return std::binary_search(a_list->begin(), a_list->end(), number); }))
+                found.emplace_back(date, contactNumber, number);
+        }
+    }
+    auto count = std::min(a_limit, found.size());
+    std::partial_sort(found.begin(), found.begin() + count, found.end(), [](auto &a_left, auto &a_right)
+        {
+            return std::get<0>(a_left) > std::get<0>(a_right);
+        });
+    results.reserve(count);
+    for (size_t i = 0; i < count; i++)
+        results.push_back(SearchResult{ m_contacts[std::get<1>(found[i])].m_id, std::get<2>(found[i]), QDateTime::fromMSecsSinceEpoch(std::get<0>(found[i])) });
+    return results;
+}
+
+// private:
+QStringList SearchIndex::getWords(const QString &a_text)
+{
+    static const QRegularExpression separator("[^\\w]+", QRegularExpression::UseUnicodePropertiesOption);
+    auto words = a_text.toLower().split(separator, Qt::SkipEmptyParts);
+    words.removeDuplicates();
+    return words;
+}
+
+void SearchIndex::run()
+{
+    // начальное индексирование; собеседники, которым пришли сообщения за это время, обходятся повторно
+    auto ids = m_history.getContacts();
+    for (;;)
+    {
+        for (auto &id : ids)
+        {
+            loadSegment(id);
+            // изменения сохраняются после каждой страницы, чтобы не держать в памяти слова всей истории
+            while (indexNextPage(id))
+                saveSegment(id);
+            saveSegment(id);
+            if (isStopping())
+            {
+                saveSegments();
+                return;
+            }
+        }
+        QMutexLocker locker(&m_mutex);
+        ids.clear();
+        for (auto &contact : m_contacts)
+            if (!contact.m_loaded)
+                ids.append(contact.m_id);
+        if (ids.isEmpty())
+        {
+            m_initialized = true;
+            break;
+        }
+    }
+
+    // далее измененные индексы сохраняются периодически и при завершении
+    QMutexLocker locker(&m_mutex);
+    while (!m_stopping)
+    {
+        m_stopRequested.wait(&m_mutex, QDeadlineTimer(m_saveInterval));
+        locker.unlock();
+        saveSegments();
+        locker.relock();
+    }
+}
+
+bool SearchIndex::isStopping()
+{
+    QMutexLocker locker(&m_mutex);
+    return m_stopping;
+}
+
+QString SearchIndex::getSegmentFileName(const QString &a_id) const
+{
+    return QString("%1/%2.search").arg(m_directory).arg(a_id);
+}
+
+// Файл индекса: версия, затем части, дописанные при сохранениях, - номер первого сообщения части, их число,
+// даты и слова сообщений. Читаются только целые части, идущие подряд. Файл действителен, если история
+// не короче его и последнее проиндексированное сообщение на месте, иначе собеседник индексируется заново.
+void SearchIndex::loadSegment(const QString &a_id)
+{
+    Contact segment;
+    QFile file(getSegmentFileName(a_id));
+    if (file.open(QIODevice::ReadOnly))
+    {
+        QDataStream stream(&file);
+        stream.setVersion(QDataStream::Qt_6_0);
+        quint32 version = 0;
+        stream >> version;
+        if (stream.status() == QDataStream::Ok && version == g_segmentVersion)
+        {
+            segment.m_savedSize = file.pos();
+            for (;;)
+            {
+                quint64 first = 0;
+                quint32 count = 0;
+                stream >> first >> count;
+                if (stream.status() != QDataStream::Ok || first != segment.m_dates.size())
+                    break;
+                std::vector<std::pair<qint64, QStringList>> messages;
+                for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; i++)
+                {
+                    std::pair<qint64, QStringList> message;
+                    stream >> message.first >> message.second;
+                    messages.push_back(std::move(message));
+                }
+                if (stream.status() != QDataStream::Ok)
+                    break;
+                for (auto &message : messages)
+                    addWords(segment, message.first, message.second);
+                segment.m_savedSize = file.pos();
+            }
+        }
+        auto count = segment.m_dates.size();
+        auto valid = segment.m_savedSize > 0 && count <= m_history.getMessageCount(a_id);
+        if (valid && count > 0)
+        {
+            auto messages = m_history.getMessages(a_id, count - 1, 1);
+            valid = !messages.isEmpty() && messages.front().m_date.toMSecsSinceEpoch() == segment.m_dates.back();
+        }
+        if (!valid)
+            segment = Contact();
+    }
+
+    QMutexLocker locker(&m_mutex);
+    auto &contact = m_contacts[getContactNumber(a_id)];
+    if (contact.m_loaded)
+        return;
+    contact.m_dates = std::move(segment.m_dates);
+    contact.m_words = std::move(segment.m_words);
+    contact.m_savedSize = segment.m_savedSize;
+    contact.m_loaded = true;
+}
+
+// Под блокировкой копируются только несохраненные сообщения; они сериализуются и дописываются в файл без нее.
+// Недействительный файл перезаписывается, а часть, недописанная при сбое, отрезается.
+void SearchIndex::saveSegment(const QString &a_id)
+{
+    std::vector<QStringList> words;
+    std::vector<qint64> dates;
+    quint64 first = 0;
+    qint64 savedSize = 0;
+    {
+        QMutexLocker locker(&m_mutex);
+        auto &contact = m_contacts[getContactNumber(a_id)];
+        if (!contact.m_loaded || contact.m_unsavedWords.empty())
+            return;
+        words = contact.m_unsavedWords;
+        first = contact.m_dates.size() - words.size();
+        dates.assign(contact.m_dates.begin() + first, contact.m_dates.end());
+        savedSize = contact.m_savedSize;
+    }
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_6_0);
+    if (savedSize == 0)
+        stream << g_segmentVersion;
+    stream << first << (quint32)words.size();
+    for (size_t i = 0; i < words.size(); i++)
+        stream << dates[i] << words[i];
+    QFile file(getSegmentFileName(a_id));
+    if (!file.open(QIODevice::ReadWrite) || !file.resize(savedSize) || !file.seek(savedSize) ||
+        file.write(data) != data.size() || !file.flush())
+        return;
+    QMutexLocker locker(&m_mutex);
+    auto &contact = m_contacts[getContactNumber(a_id)];
+    contact.m_unsavedWords.erase(contact.m_unsavedWords.begin(), contact.m_unsavedWords.begin() + words.size());
+    contact.m_savedSize = savedSize + data.size();
+}
+
+void SearchIndex::saveSegments()
+{
+    QStringList ids;
+    {
+        QMutexLocker locker(&m_mutex);
+        for (auto &contact : m_contacts)
+            if (contact.m_loaded && !contact.m_unsavedWords.empty())
+                ids.append(contact.m_id);
+    }
+    for (auto &id : ids)
+        saveSegment(id);
+}
+
+// возвращает false, если история собеседника проиндексирована или индексирование прервано
+bool SearchIndex::indexNextPage(const QString &a_id)
+{
+    static const size_t pageSize = 1000;
+    size_t first = 0;
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_stopping)
+            return false;
+        first = m_contacts[getContactNumber(a_id)].m_dates.size();
+    }
+    // история читается без блокировки индекса, чтобы не задерживать поиск
+    auto messages = m_history.getMessages(a_id, first, pageSize);
+    if (messages.isEmpty())
+        return false;
+
+    QMutexLocker locker(&m_mutex);
+    auto &contact = m_contacts[getContactNumber(a_id)];
+    if (contact.m_dates.size() != first)
+        return true; // страница уже проиндексирована при добавлении сообщений
+    for (auto &message : messages)
+        indexMessage(contact, message);
+    return true;
+}
+
+quint32 SearchIndex::getContactNumber(const QString &a_id)
+{
+    auto it = m_contactNumbers.find(a_id);
+    if (it != m_contactNumbers.end())
+        return *it;
+    quint32 number = m_contacts.size();
+    m_contacts.push_back(Contact{ a_id });
+    // история собеседника, появившегося после начального индексирования, пуста
+    m_contacts.back().m_loaded = m_initialized;
+    m_contactNumbers.insert(a_id, number);
+    return number;
+}
+
+void SearchIndex::indexMessage(Contact &a_contact, const Message &a_message)
+{
+    auto words = getWords(a_message.m_text);
+    addWords(a_contact, a_message.m_date.toMSecsSinceEpoch(), words);
+    a_contact.m_unsavedWords.push_back(words);
+}
+
+void SearchIndex::addWords(Contact &a_contact, qint64 a_date, const QStringList &a_words)
+{
+    quint32 number = a_contact.m_dates.size();
+    a_contact.m_dates.push_back(a_date);
+    for (auto &word : a_words)
+        a_contact.m_words[word].push_back(number);
+}
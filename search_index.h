@@ -0,0 +1,84 @@
+﻿#pragma once
+
+#include <QMutex>
+#include <QWaitCondition>
+#include <QHash>
+#include <QThread>
+#include <QDateTime>
+#include <vector>
+#include <memory>
+#include "history_store.h"
+
+struct SearchResult
+{
+    QString m_id; // собеседник
+    size_t m_number = 0; // номер сообщения в истории собеседника
+    QDateTime m_date;
+};
+
+// Полнотекстовый индекс истории сообщений.
+// Для каждого собеседника и слова хранится список сообщений, в которых оно встречается. Сообщения каждого
+// собеседника индексируются строго по порядку, поэтому списки упорядочены без сортировки.
+// В файл <id>.search дописываются даты и слова сообщений, проиндексированных после предыдущего сохранения,
+// поэтому сохранение не зависит от размера индекса; при запуске фоновый поток восстанавливает по этим файлам
+// списки слов и читает из HistoryStore только сообщения после сохраненных.
+// Новые сообщения добавляются в индекс по мере записи в историю, а индекс собеседника, который еще
+// не загружен, дополняется фоновым потоком. Изменения сохраняются раз в m_saveInterval мс
+// и при уничтожении объекта.
+class SearchIndex
+{
+public:
+    // a_directory - каталог файлов индекса
+    SearchIndex(HistoryStore &a_history, const QString &a_directory);
+    ~SearchIndex();
+
+    void addMessage(const QString &a_id, size_t a_number, const Message &a_message);
+    // сообщения, содержащие все слова запроса, начиная с последних;
+    // пустой a_id - поиск по всем собеседникам, недействительная дата - без ограничения
+    std::vector<SearchResult> search(const QString &a_query, const QString &a_id = QString(),
+        const QDateTime &a_from = QDateTime(), const QDateTime &a_to = QDateTime(), size_t a_limit = 100);
+
+private:
+    static constexpr quint32 g_segmentVersion = 2;
+
+    struct Contact
+    {
+        QString m_id;
+        std::vector<qint64> m_dates; // даты проиндексированных сообщений
+        // номера сообщений, содержащих слово, по возрастанию
+        QHash<QString, std::vector<quint32>> m_words;
+        // файл индекса загружен или его нет; до этого новые сообщения собеседника не индексируются
+        bool m_loaded = false;
+        // слова последних сообщений, еще не сохраненных в файл индекса
+        std::vector<QStringList> m_unsavedWords;
+        // размер сохраненной части файла индекса; дальше может остаться часть, недописанная при сбое
+        qint64 m_savedSize = 0;
+    };
+
+    static QStringList getWords(const QString &a_text);
+    static void addWords(Contact &a_contact, qint64 a_date, const QStringList &a_words);
+
+    void run();
+    bool isStopping();
+    QString getSegmentFileName(const QString &a_id) const;
+    void loadSegment(const QString &a_id);
+    void saveSegment(const QString &a_id);
+    void saveSegments();
+    bool indexNextPage(const QString &a_id);
+    quint32 getContactNumber(const QString &a_id);
+    void indexMessage(Contact &a_contact, const Message &a_message);
+
+    HistoryStore &m_history;
+    QString m_directory;
+    int m_saveInterval = 60000;
+
+    QMutex m_mutex;
+    QWaitCondition m_stopRequested;
+    std::vector<Contact> m_contacts;
+    QHash<QString, quint32> m_contactNumbers;
+    // начальное индексирование завершено: у собеседников, появившихся после него, загружать нечего
+    bool m_initialized = false;
+    bool m_stopping = false;
+
+    std::unique_ptr<QThread> m_thread;
+};
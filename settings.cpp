@@ -13,9 +13,9 @@ void Settings::setValue(QAnyStringView a_key, const QVariant &a_value)
     m_settings->setValue(a_key, a_value);
 }
 
-QVariant Settings::value(QAnyStringView a_key)
+QVariant Settings::value(QAnyStringView a_key, const QVariant &a_defaultValue)
 {
-    return m_settings->value(a_key);
+    return m_settings->value(a_key, a_defaultValue);
 }
 
 Settings::Settings()
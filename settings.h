@@ -8,7 +8,7 @@ public:
     static Settings &get();
 
     void setValue(QAnyStringView a_key, const QVariant &a_value);
-    QVariant value(QAnyStringView a_key);
+    QVariant value(QAnyStringView a_key, const QVariant &a_defaultValue = QVariant());
 
 private:
     Settings();
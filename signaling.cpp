@@ -1,119 +1,172 @@
 ﻿#include <QTcpSocket>
-#include <QBuffer>
 #include <QNetworkInterface>
+#include <QThread>
+#include <QtEndian>
+#include <stdexcept>
 #include "signaling.h"
-
-struct DataSignal
+#include "signaling_protocol.h"
+#include "settings.h"
+#include "metrics.h"
+#include "tracing.h"
+
+// метрики всех экземпляров Signaling
+static MetricGauge &g_peerCount = Metrics::get().getGauge("signaling_peers", "Connected peers");
+static MetricCounter &g_sentControlSignals = Metrics::get().getCounter("signaling_sent_signals_total", "Signals written to peers", "priority=\"control\"");
+static MetricCounter &g_sentBulkChunks = Metrics::get().getCounter("signaling_sent_signals_total", "Signals written to peers", "priority=\"bulk_chunk\"");
+static MetricCounter &g_sentBulkSignals = Metrics::get().getCounter("signaling_sent_signals_total", "Signals written to peers", "priority=\"bulk\"");
+static MetricCounter &g_decodeErrors = Metrics::get().getCounter("signaling_decode_errors_total", "Received messages that could not be decoded");
+static MetricCounter &g_oversizedMessages = Metrics::get().getCounter("signaling_oversized_messages_total", "Received messages exceeding MaxMessageSize; the peer is disconnected");
+
+// счетчики принятых сигналов по кодам
+static MetricCounter &getReceivedSignalCounter(char a_code)
 {
-    explicit DataSignal(const QString &a_name, const QVariant &a_value)
-    {
-        m_name = a_name;
-        m_value = a_value;
-    }
+    static const char *names[]{ "data", "subscribe", "unsubscribe", "topic", "keep_alive", "bulk_chunk", "capabilities", "compressed", "topic_data" };
+    static auto counters = []
+        {
+            std::vector<MetricCounter *> result;
+            for (auto name : names)
+                result.push_back(&Metrics::get().getCounter("signaling_received_signals_total", "Signals received from peers", QString("type=\"%1\"").arg(name)));
+            return result;
+        }();
+    return *counters[a_code];
+}
 
-    explicit DataSignal(QDataStream &a_stream)
-    {
-        a_stream >> m_name >> m_value;
-    }
+// узел прежней версии принимает только DataSignal с атрибутами по именам
+static bool isLegacyPeer(quint32 a_capabilities)
+{
+    static const quint32 required = CapabilitiesSignal::CompactAttributes | CapabilitiesSignal::TopicIds;
+    return (a_capabilities & required) != required;
+}
 
-    void toQDataStream(QDataStream &a_stream) const
-    {
-        a_stream << m_name << m_value;
-    }
+bool Signaling::start(quint16 a_port)
+{
+    // сервер и таймер - дочерние объекты, чтобы переноситься в поток Signaling вместе с ним
+    m_server = std::make_unique<QTcpServer>(this);
+    if (!m_server->listen(QHostAddress::AnyIPv4, a_port))
+        return false;
+    connect(m_server.get(), &QTcpServer::newConnection, this, &Signaling::onClientConencted);
 
-    static constexpr char g_signalCode = 0;
-    QString m_name;
-    QVariant m_value;
-};
+    m_bulkChunkSize = std::max(Settings::get().value("BulkChunkSize", m_bulkChunkSize).toLongLong(), 1024LL);
+    m_bulkBufferLimit = Settings::get().value("BulkBufferLimit", m_bulkBufferLimit).toLongLong();
+    m_socketSendBufferSize = Settings::get().value("SocketSendBufferSize", m_socketSendBufferSize).toInt();
+    m_maxBulkQueueSize = Settings::get().value("MaxBulkQueueSize", m_maxBulkQueueSize).toLongLong();
+    m_compression = Settings::get().value("Compression", m_compression).toBool();
+    m_minCompressedSize = Settings::get().value("MinCompressedSize", m_minCompressedSize).toLongLong();
+    m_maxMessageSize = Settings::get().value("MaxMessageSize", m_maxMessageSize).toLongLong();
+
+    m_clock.start();
+    m_keepAliveTimer = std::make_unique<QTimer>(this);
+    connect(m_keepAliveTimer.get(), &QTimer::timeout, this, &Signaling::checkPeers);
+    setKeepAlive(Settings::get().value("KeepAliveInterval", m_keepAliveInterval).toInt(),
+        Settings::get().value("KeepAliveMissedIntervals", m_missedKeepAliveIntervals).toInt());
+    return true;
+}
 
-//-------------------------------------------------------------------------------------------------
-struct SubscribeSignal
+quint16 Signaling::getPort()
 {
-    explicit SubscribeSignal(const QString &a_name)
-    {
-        m_name = a_name;
-    }
-
-    explicit SubscribeSignal(QDataStream &a_stream)
-    {
-        a_stream >> m_name;
-    }
+    return m_server->serverPort();
+}
 
-    void toQDataStream(QDataStream &a_stream) const
-    {
-        a_stream << m_name;
-    }
+Signaling::TopicId Signaling::getTopicId(const QString &a_name)
+{
+    QMutexLocker locker(&m_topicMutex);
+    auto topic = addTopic(a_name);
+    m_localTopics.insert(topic);
+    return topic;
+}
 
-    static constexpr char g_signalCode = 1;
-    QString m_name;
-};
+void Signaling::sendSignal(TopicId a_topic, const QVariant &a_value, Priority a_priority, const QVariant &a_legacyValue)
+{
+    sendMessage(a_topic, prepareSignal(a_topic, a_value, a_legacyValue), a_priority);
+}
 
-//-------------------------------------------------------------------------------------------------
-struct UnsubscribeSignal
+void Signaling::sendSignal(const QString &a_name, const QVariant &a_value, Priority a_priority)
 {
-    explicit UnsubscribeSignal(const QString &a_name)
-    {
-        m_name = a_name;
-    }
+    sendSignal(getTopicId(a_name), a_value, a_priority);
+}
 
-    explicit UnsubscribeSignal(QDataStream &a_stream)
-    {
-        a_stream >> m_name;
-    }
+Signaling::PreparedSignal Signaling::prepareSignal(TopicId a_topic, const QVariant &a_value, const QVariant &a_legacyValue)
+{
+    // сигнал сериализуется и сжимается в потоке вызывающего, чтобы не задерживать обмен данными
+    TraceSpan span("Signaling.encode", "signaling");
+    PreparedSignal result;
+    result.m_message = signalToByteArray(TopicDataSignal(a_topic, a_value));
+    span.setArgument("bytes", result.m_message.size());
+    if (m_compressionPeerCount > 0 && hasCompressionSubscribers(a_topic))
+        result.m_compressedMessage = compressMessage(result.m_message);
+    if (a_legacyValue.isValid() || m_legacyPeerCount > 0)
+        result.m_legacyMessage = signalToByteArray(DataSignal(getTopicName(a_topic), a_legacyValue.isValid() ? a_legacyValue : a_value));
+    return result;
+}
 
-    void toQDataStream(QDataStream &a_stream) const
-    {
-        a_stream << m_name;
-    }
+void Signaling::sendPreparedSignal(TopicId a_topic, const PreparedSignal &a_signal, QTcpSocket *a_peer)
+{
+    if (invokeInOwnThread([=] { sendPreparedSignal(a_topic, a_signal, a_peer); }))
+        return;
+    auto it = m_subscribers.find(a_topic);
+    if (it == m_subscribers.end())
+        return;
+    if (a_peer == nullptr)
+        writeToPeers(it->second, a_signal);
+    else if (it->second.find(a_peer) != it->second.end())
+        a_peer->write(selectMessage(a_peer, a_signal));
+}
 
-    static constexpr char g_signalCode = 2;
-    QString m_name;
-};
+void Signaling::sendPreparedSignalToLegacyPeers(TopicId a_topic, const PreparedSignal &a_signal)
+{
+    if (invokeInOwnThread([=] { sendPreparedSignalToLegacyPeers(a_topic, a_signal); }))
+        return;
+    auto it = m_subscribers.find(a_topic);
+    if (it == m_subscribers.end())
+        return;
+    for (auto peer : it->second)
+        if (isLegacyPeer(getPeerCapabilities(peer)))
+            sendPreparedSignal(a_topic, a_signal, peer);
+}
 
-//-------------------------------------------------------------------------------------------------
-bool Signaling::start()
+bool Signaling::hasLegacyPeers() const
 {
-    m_server = std::make_unique<QTcpServer>();
-    if (!m_server->listen(QHostAddress::AnyIPv4))
-        return false;
-    connect(m_server.get(), &QTcpServer::newConnection, this, &Signaling::onClientConencted);
-    return true;
+    return m_legacyPeerCount > 0;
 }
 
-quint16 Signaling::getPort()
+void Signaling::subscribe(const QString &a_name)
 {
-    return m_server->serverPort();
+    subscribe(a_name, nullptr, nullptr);
 }
 
-void Signaling::sendSignal(const QString &a_name, const QVariant &a_value)
+void Signaling::subscribe(const QString &a_name, QObject *a_context, Handler a_handler)
 {
-    std::vector<QTcpSocket *> subscribedPeers;
-    for (auto& peer : m_peerSubscriptions)
-        if (peer.second.contains(a_name))
-            subscribedPeers.push_back(peer.first);
-    if (subscribedPeers.empty())
+    if (invokeInOwnThread([=] { subscribe(a_name, a_context, a_handler); }))
         return;
-    auto data = signalToByteArray(DataSignal(a_name, a_value));
-    for (auto peer : subscribedPeers)
-        peer->write(data);
+    m_subscriptions[getTopicId(a_name)] = Subscription{ a_context, std::move(a_handler) };
+    writeToPeers(m_peers, { signalToByteArray(SubscribeSignal(a_name)) });
 }
 
-void Signaling::subscribe(const QString &a_name)
+void Signaling::unsubscribe(const QString &a_name)
 {
-    m_subscriptions.insert(a_name);
-    auto data = signalToByteArray(SubscribeSignal(a_name));
-    for (auto peer : m_peers)
-        peer->write(data);
+    if (invokeInOwnThread([=] { unsubscribe(a_name); }))
+        return;
+    if (m_subscriptions.erase(getTopicId(a_name)) == 0)
+        return;
+    writeToPeers(m_peers, { signalToByteArray(UnsubscribeSignal(a_name)) });
 }
 
-void Signaling::unsubscribe(const QString &a_name)
+void Signaling::setKeepAlive(int a_interval, int a_missedIntervals)
 {
-    if (m_subscriptions.find(a_name) == m_subscriptions.end())
+    if (invokeInOwnThread([=] { setKeepAlive(a_interval, a_missedIntervals); }))
         return;
-    m_subscriptions.erase(a_name);
-    auto data = signalToByteArray(UnsubscribeSignal(a_name));
-    for (auto peer : m_peers)
-        peer->write(data);
+    m_keepAliveInterval = std::max(a_interval, 100);
+    m_missedKeepAliveIntervals = std::max(a_missedIntervals, 1);
+    if (m_keepAliveTimer != nullptr)
+        m_keepAliveTimer->start(m_keepAliveInterval);
+}
+
+bool Signaling::isWritable(TopicId a_topic)
+{
+    if (m_queuedBulkSize >= m_maxBulkQueueSize)
+        return false;
+    QMutexLocker locker(&m_blockedTopicsMutex);
+    return m_blockedTopics.find(a_topic) == m_blockedTopics.end();
 }
 
 void Signaling::addPeer(QHostAddress a_address, quint16 a_port)
@@ -128,8 +181,22 @@ void Signaling::addPeer(QHostAddress a_address, quint16 a_port)
     if (thisAddressString == anotherAddressString && m_server->serverPort() > a_port)
         return;
 
+    // узел может быть найден повторно, пока соединение с ним устанавливается или уже установлено
+    auto isSamePeer = [&a_address, a_port](const QHostAddress &a_peerAddress, quint16 a_peerPort)
+        {
+            return a_peerPort == a_port && a_peerAddress.isEqual(a_address, QHostAddress::TolerantConversion);
+        };
+    for (auto &connectingSocket : m_connectingSockets)
+        if (isSamePeer(connectingSocket.second.first, connectingSocket.second.second))
+            return;
+    for (auto peer : m_peers)
+        if (isSamePeer(peer->peerAddress(), peer->peerPort()))
+            return;
+
     auto socket = new QTcpSocket(this);
     connect(socket, &QTcpSocket::connected, this, &Signaling::onConnectedToHost);
+    connect(socket, &QTcpSocket::errorOccurred, this, &Signaling::onConnectionFailed);
+    m_connectingSockets[socket] = { a_address, a_port };
     socket->connectToHost(a_address, a_port);
 }
 
@@ -144,17 +211,25 @@ void Signaling::onConnectedToHost()
     auto peer = qobject_cast<QTcpSocket *>(sender());
     if (peer == nullptr)
         return;
+    m_connectingSockets.erase(peer);
     addSocket(peer);
 }
 
+void Signaling::onConnectionFailed()
+{
+    // ошибки установленных соединений обрабатываются при их разрыве
+    auto socket = qobject_cast<QTcpSocket *>(sender());
+    if (socket == nullptr || m_connectingSockets.erase(socket) == 0)
+        return;
+    socket->deleteLater();
+}
+
 void Signaling::onPeerDisconnected()
 {
     auto peer = qobject_cast<QTcpSocket *>(sender());
     if (peer == nullptr)
         return;
-    m_peers.erase(peer);
-    m_peerSubscriptions.erase(peer);
-    peer->deleteLater();
+    removePeer(peer);
 }
 
 void Signaling::onDataReceived()
@@ -162,18 +237,60 @@ void Signaling::onDataReceived()
     auto peer = qobject_cast<QTcpSocket *>(sender());
     if (peer == nullptr)
         return;
+    TraceSpan span("Signaling.receive", "signaling");
+    m_lastReceived[peer] = m_clock.elapsed();
     auto &data = m_socketData[peer];
-    data.appendRawData(peer->readAll());
-    while (data.messageIsReady())
+    auto size = data.appendRawData(peer);
+    span.setArgument("bytes", size);
+    // узел может быть отключен при обработке сообщения, тогда его очередь уже удалена
+    while (m_peers.find(peer) != m_peers.end())
+    {
+        // размер проверяется сразу после чтения, иначе очередь росла бы до получения всего сообщения
+        auto messageSize = data.getNextMessageSize();
+        if (messageSize.has_value() && messageSize.value() > m_maxMessageSize)
+        {
+            g_oversizedMessages.add();
+            removePeer(peer);
+            peer->abort();
+            return;
+        }
+        if (!data.messageIsReady())
+            break;
+        handleMessage(peer, data.takeMessage());
+    }
+    // узел мог быть удален при обработке сообщения
+    auto metrics = m_peerMetrics.find(peer);
+    if (metrics == m_peerMetrics.end())
+        return;
+    metrics->second.m_receivedBytes->add(std::max<qint64>(size, 0));
+    metrics->second.m_receiveQueueSize->set(data.getSize());
+}
+
+void Signaling::onBytesWritten(qint64 a_bytes)
+{
+    auto peer = qobject_cast<QTcpSocket *>(sender());
+    if (peer == nullptr)
+        return;
+    auto metrics = m_peerMetrics.find(peer);
+    if (metrics != m_peerMetrics.end())
+        metrics->second.m_sentBytes->add(a_bytes);
+    writeBulkData(peer);
+}
+
+void Signaling::checkPeers()
+{
+    // узлы, от которых давно ничего не приходило, считаются отключенными
+    auto now = m_clock.elapsed();
+    std::vector<QTcpSocket *> silentPeers;
+    for (auto peer : m_peers)
+        if (now - m_lastReceived[peer] > (qint64)m_keepAliveInterval * m_missedKeepAliveIntervals)
+            silentPeers.push_back(peer);
+    for (auto peer : silentPeers)
     {
-        QByteArray message = data.takeMessage();
-        QDataStream stream(message);
-        char code;
-        stream >> code;
-        tryHandleSignal<DataSignal>(peer, code, stream) ||
-            tryHandleSignal<SubscribeSignal>(peer, code, stream) ||
-            tryHandleSignal<UnsubscribeSignal>(peer, code, stream);
+        removePeer(peer);
+        peer->abort();
     }
+    writeToPeers(m_peers, { signalToByteArray(KeepAliveSignal()) });
 }
 
 QHostAddress Signaling::getThisSubnetAddress(const QHostAddress &a_anotherAddress)
@@ -185,50 +302,472 @@ QHostAddress Signaling::getThisSubnetAddress(const QHostAddress &a_anotherAddres
     return QHostAddress();
 }
 
+// Сжатый сигнал или пустой массив, если сжимать не нужно: сигнал короткий или уже сжат
+// (архивы, изображения). Сжимаемость проверяется по началу сигнала, чтобы не тратить время на весь.
+QByteArray Signaling::compressMessage(const QByteArray &a_message) const
+{
+    static const qsizetype sampleSize = 16 * 1024;
+    static const double maxRatio = 0.9;
+    auto data = reinterpret_cast<const uchar *>(a_message.constData()) + sizeof(MessageQueue::MessageSize);
+    auto size = a_message.size() - (qsizetype)sizeof(MessageQueue::MessageSize);
+    if (!m_compression || size < m_minCompressedSize)
+        return QByteArray();
+    if (size > 2 * sampleSize && qCompress(data, sampleSize, 1).size() > sampleSize * maxRatio)
+        return QByteArray();
+    // быстрый уровень сжатия: скорость важнее степени сжатия
+    auto compressedData = qCompress(data, size, 1);
+    if (compressedData.size() > size * maxRatio)
+        return QByteArray();
+    return signalToByteArray(CompressedSignal(compressedData));
+}
+
+void Signaling::sendMessage(TopicId a_topic, const PreparedSignal &a_signal, Priority a_priority)
+{
+    // сигналы Bulk из других потоков учитываются в isWritable, пока ожидают потока Signaling
+    qint64 size = a_priority == Priority::Bulk ? a_signal.m_message.size() : 0;
+    if (QThread::currentThread() != thread())
+        m_queuedBulkSize += size;
+    if (invokeInOwnThread([=] { releaseQueuedBulkSize(size); sendMessage(a_topic, a_signal, a_priority); }))
+        return;
+    auto it = m_subscribers.find(a_topic);
+    if (it == m_subscribers.end() || it->second.empty())
+        return;
+    writeToPeers(it->second, a_signal, a_priority);
+}
+
+template<typename F> bool Signaling::invokeInOwnThread(F &&a_function)
+{
+    if (QThread::currentThread() == thread())
+        return false;
+    QMetaObject::invokeMethod(this, std::forward<F>(a_function), Qt::QueuedConnection);
+    return true;
+}
+
+QString Signaling::getTopicName(TopicId a_topic)
+{
+    QMutexLocker locker(&m_topicMutex);
+    return m_topicNames.value(a_topic);
+}
+
+// вызывается под m_topicMutex
+Signaling::TopicId Signaling::addTopic(const QString &a_name)
+{
+    auto it = m_topicIds.constFind(a_name);
+    if (it != m_topicIds.constEnd())
+        return it.value();
+    auto topic = m_nextTopicId++;
+    m_topicNames.insert(topic, a_name);
+    m_topicIds.insert(a_name, topic);
+    return topic;
+}
+
+// тема подписки другого узла; освобождается в removeSubscriber, если этот узел ее не использует
+Signaling::TopicId Signaling::getRemoteTopicId(const QString &a_name)
+{
+    QMutexLocker locker(&m_topicMutex);
+    return addTopic(a_name);
+}
+
+// идентификатор без добавления темы
+std::optional<Signaling::TopicId> Signaling::findTopicId(const QString &a_name)
+{
+    QMutexLocker locker(&m_topicMutex);
+    auto it = m_topicIds.constFind(a_name);
+    if (it == m_topicIds.constEnd())
+        return std::nullopt;
+    return it.value();
+}
+
+void Signaling::removeSubscriber(TopicId a_topic, QTcpSocket *a_peer)
+{
+    auto it = m_subscribers.find(a_topic);
+    if (it == m_subscribers.end() || it->second.erase(a_peer) == 0)
+        return;
+    countCompressionSubscriber(a_topic, a_peer, -1);
+    if (!it->second.empty())
+        return;
+    m_subscribers.erase(it);
+    QMutexLocker locker(&m_topicMutex);
+    if (m_localTopics.find(a_topic) == m_localTopics.end())
+        m_topicIds.remove(m_topicNames.take(a_topic));
+}
+
 void Signaling::addSocket(QTcpSocket *a_peer)
 {
     m_peers.insert(a_peer);
+    m_lastReceived[a_peer] = m_clock.elapsed();
     connect(a_peer, &QTcpSocket::disconnected, this, &Signaling::onPeerDisconnected);
     connect(a_peer, &QTcpSocket::readyRead, this, &Signaling::onDataReceived);
+    connect(a_peer, &QTcpSocket::bytesWritten, this, &Signaling::onBytesWritten);
+    a_peer->setSocketOption(QAbstractSocket::LowDelayOption, 1);
+    if (m_socketSendBufferSize > 0)
+        a_peer->setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, m_socketSendBufferSize);
+    createPeerMetrics(a_peer);
+    // до получения CapabilitiesSignal узел считается узлом прежней версии
+    m_peerCapabilities[a_peer] = 0;
+    countPeerCapabilities(0, 1);
+
+    a_peer->write(signalToByteArray(CapabilitiesSignal((m_compression ? CapabilitiesSignal::Compression : 0) |
+        CapabilitiesSignal::CompactAttributes | CapabilitiesSignal::TopicIds | CapabilitiesSignal::BulkChunks)));
+    for (auto &subscription : m_subscriptions)
+        a_peer->write(signalToByteArray(SubscribeSignal(getTopicName(subscription.first))));
+}
+
+void Signaling::removePeer(QTcpSocket *a_peer)
+{
+    if (m_peers.erase(a_peer) == 0)
+        return;
+    for (auto topic : m_peerSubscriptions[a_peer])
+        removeSubscriber(topic, a_peer);
+    m_peerSubscriptions.erase(a_peer);
+    m_peerTopics.erase(a_peer);
+    m_socketData.erase(a_peer);
+    m_bulkOutputs.erase(a_peer);
+    m_bulkInputs.erase(a_peer);
+    m_lastReceived.erase(a_peer);
+    removePeerMetrics(a_peer);
+    auto capabilities = m_peerCapabilities.find(a_peer);
+    if (capabilities != m_peerCapabilities.end())
+    {
+        countPeerCapabilities(capabilities->second, -1);
+        m_peerCapabilities.erase(capabilities);
+    }
+    if (m_blockedPeers.erase(a_peer) != 0)
+    {
+        updateBlockedTopics();
+        emit writable();
+    }
+    a_peer->deleteLater();
+    emit peerDisconnected(a_peer);
+}
+
+quint32 Signaling::getPeerCapabilities(QTcpSocket *a_peer) const
+{
+    auto it = m_peerCapabilities.find(a_peer);
+    return it != m_peerCapabilities.end() ? it->second : 0;
+}
+
+// счетчики читаются в потоках отправителей, чтобы не формировать форматы, которые никому не нужны
+bool Signaling::hasCompressionSubscribers(TopicId a_topic)
+{
+    QMutexLocker locker(&m_compressionTopicsMutex);
+    return m_compressionSubscriberCounts.find(a_topic) != m_compressionSubscriberCounts.end();
+}
+
+void Signaling::countCompressionSubscriber(TopicId a_topic, QTcpSocket *a_peer, int a_delta)
+{
+    if ((getPeerCapabilities(a_peer) & CapabilitiesSignal::Compression) == 0)
+        return;
+    QMutexLocker locker(&m_compressionTopicsMutex);
+    if ((m_compressionSubscriberCounts[a_topic] += a_delta) == 0)
+        m_compressionSubscriberCounts.erase(a_topic);
+}
+
+void Signaling::countPeerCapabilities(quint32 a_capabilities, int a_delta)
+{
+    if (a_capabilities & CapabilitiesSignal::Compression)
+        m_compressionPeerCount += a_delta;
+    if (isLegacyPeer(a_capabilities))
+        m_legacyPeerCount += a_delta;
+}
+
+// формат сигнала, который поддерживает узел
+const QByteArray &Signaling::selectMessage(QTcpSocket *a_peer, const PreparedSignal &a_signal) const
+{
+    auto capabilities = getPeerCapabilities(a_peer);
+    if (!a_signal.m_legacyMessage.isEmpty() && isLegacyPeer(capabilities))
+        return a_signal.m_legacyMessage;
+    if (!a_signal.m_compressedMessage.isEmpty() && (capabilities & CapabilitiesSignal::Compression))
+        return a_signal.m_compressedMessage;
+    return a_signal.m_message;
+}
+
+// все узлы получают один и тот же массив: QTcpSocket не копирует большие массивы в буфер записи
+void Signaling::writeToPeers(const std::set<QTcpSocket *> &a_peers, const PreparedSignal &a_signal, Priority a_priority)
+{
+    TraceSpan span("Signaling.write", "signaling");
+    span.setArgument("bytes", a_signal.m_message.size());
+    for (auto peer : a_peers)
+    {
+        auto &data = selectMessage(peer, a_signal);
+        if (a_priority == Priority::Control)
+        {
+            peer->write(data);
+            g_sentControlSignals.add();
+            continue;
+        }
+        auto &output = m_bulkOutputs[peer];
+        output.m_messages.push_back(data);
+        output.m_size += data.size() - sizeof(MessageQueue::MessageSize);
+        if (output.m_size >= m_maxBulkQueueSize && m_blockedPeers.insert(peer).second)
+            updateBlockedTopics();
+        writeBulkData(peer);
+    }
+}
+
+void Signaling::releaseQueuedBulkSize(qint64 a_size)
+{
+    if (a_size == 0)
+        return;
+    auto size = m_queuedBulkSize -= a_size;
+    if (size < m_maxBulkQueueSize / 2 && size + a_size >= m_maxBulkQueueSize / 2)
+        emit writable();
+}
+
+// части сигналов Bulk добавляются в буфер записи понемногу, по мере его освобождения
+void Signaling::writeBulkData(QTcpSocket *a_peer)
+{
+    auto it = m_bulkOutputs.find(a_peer);
+    if (it == m_bulkOutputs.end())
+        return;
+    TraceSpan span("Signaling.writeBulk", "signaling");
+    auto &output = it->second;
+    span.setArgument("queued_bytes", output.m_size);
+    auto chunks = (getPeerCapabilities(a_peer) & CapabilitiesSignal::BulkChunks) != 0;
+    while (!output.m_messages.empty() && a_peer->bytesToWrite() < m_bulkBufferLimit)
+    {
+        auto &message = output.m_messages.front();
+        if (!chunks && output.m_offset == 0)
+        {
+            // узел не принимает части: сигнал отправляется целиком, но по-прежнему после освобождения буфера
+            a_peer->write(message);
+            g_sentBulkSignals.add();
+            output.m_size -= message.size() - sizeof(MessageQueue::MessageSize);
+            output.m_messages.pop_front();
+            continue;
+        }
+        // размер сообщения не передается: получатель собирает части до последней
+        if (output.m_offset == 0)
+            output.m_offset = sizeof(MessageQueue::MessageSize);
+        auto size = std::min(m_bulkChunkSize, message.size() - output.m_offset);
+        auto last = output.m_offset + size == message.size();
+        a_peer->write(signalToByteArray(BulkChunkSignal(last, QByteArray::fromRawData(message.constData() + output.m_offset, size))));
+        g_sentBulkChunks.add();
+        output.m_offset += size;
+        output.m_size -= size;
+        if (!last)
+            continue;
+        output.m_messages.pop_front();
+        output.m_offset = 0;
+    }
+    if (output.m_size < m_maxBulkQueueSize / 2 && m_blockedPeers.erase(a_peer) != 0)
+    {
+        updateBlockedTopics();
+        emit writable();
+    }
+    auto metrics = m_peerMetrics.find(a_peer);
+    if (metrics != m_peerMetrics.end())
+        metrics->second.m_bulkQueueSize->set(output.m_size);
+    if (output.m_messages.empty())
+        m_bulkOutputs.erase(it);
+}
 
-    for (auto &signal : m_subscriptions)
-        a_peer->write(signalToByteArray(SubscribeSignal(signal)));
+void Signaling::updateBlockedTopics()
+{
+    std::set<TopicId> blockedTopics;
+    for (auto peer : m_blockedPeers)
+    {
+        auto &topics = m_peerSubscriptions[peer];
+        blockedTopics.insert(topics.begin(), topics.end());
+    }
+    QMutexLocker locker(&m_blockedTopicsMutex);
+    m_blockedTopics = std::move(blockedTopics);
+}
+
+void Signaling::createPeerMetrics(QTcpSocket *a_peer)
+{
+    // номер соединения различает повторные соединения с одним адресом и узлы нескольких экземпляров Signaling
+    static std::atomic<quint64> connectionNumber = 0;
+    auto labels = QString("peer=\"%1:%2\",connection=\"%3\"").arg(Metric::escapeLabelValue(a_peer->peerAddress().toString())).arg(a_peer->peerPort()).arg(++connectionNumber);
+    auto &metrics = m_peerMetrics[a_peer];
+    metrics.m_receivedBytes = &Metrics::get().getCounter("signaling_peer_received_bytes_total", "Bytes received from the peer", labels);
+    metrics.m_sentBytes = &Metrics::get().getCounter("signaling_peer_sent_bytes_total", "Bytes written to the peer socket", labels);
+    metrics.m_receiveQueueSize = &Metrics::get().getGauge("signaling_peer_receive_queue_bytes", "Received bytes waiting for the rest of a message", labels);
+    metrics.m_bulkQueueSize = &Metrics::get().getGauge("signaling_peer_bulk_queue_bytes", "Bulk signal bytes waiting to be written", labels);
+    g_peerCount.add(1);
+}
+
+void Signaling::removePeerMetrics(QTcpSocket *a_peer)
+{
+    auto it = m_peerMetrics.find(a_peer);
+    if (it == m_peerMetrics.end())
+        return;
+    Metrics::get().remove(*it->second.m_receivedBytes);
+    Metrics::get().remove(*it->second.m_sentBytes);
+    Metrics::get().remove(*it->second.m_receiveQueueSize);
+    Metrics::get().remove(*it->second.m_bulkQueueSize);
+    m_peerMetrics.erase(it);
+    g_peerCount.add(-1);
 }
 
-template<typename T> QByteArray Signaling::signalToByteArray(const T &a_signal)
+void Signaling::handleMessage(QTcpSocket *a_peer, const QByteArray &a_message)
 {
-    QBuffer buffer;
-    buffer.open(QIODevice::WriteOnly);
-    QDataStream stream(&buffer);
-    stream << T::g_signalCode;
-    a_signal.toQDataStream(stream);
-    return MessageQueue::createMessage(buffer.buffer());
+    QDataStream stream(a_message);
+    char code;
+    stream >> code;
+    auto handled = tryHandleSignal<DataSignal>(a_peer, code, stream) ||
+        tryHandleSignal<SubscribeSignal>(a_peer, code, stream) ||
+        tryHandleSignal<UnsubscribeSignal>(a_peer, code, stream) ||
+        tryHandleSignal<TopicSignal>(a_peer, code, stream) ||
+        tryHandleSignal<KeepAliveSignal>(a_peer, code, stream) ||
+        tryHandleSignal<BulkChunkSignal>(a_peer, code, stream) ||
+        tryHandleSignal<CapabilitiesSignal>(a_peer, code, stream) ||
+        tryHandleSignal<CompressedSignal>(a_peer, code, stream) ||
+        tryHandleSignal<TopicDataSignal>(a_peer, code, stream);
+    if (!handled)
+        g_decodeErrors.add(); // сигнал более новой версии или поврежденные данные
 }
 
 template<typename T> bool Signaling::tryHandleSignal(QTcpSocket *a_peer, char a_code, QDataStream &a_stream)
 {
     if (a_code != T::g_signalCode)
         return false;
-    handleSignal<T>(a_peer, T(a_stream));
+    getReceivedSignalCounter(a_code).add();
+    TraceSpan span("Signaling.decode", "signaling");
+    span.setArgument("code", a_code);
+    T signal(a_stream);
+    if (a_stream.status() != QDataStream::Ok)
+    {
+        g_decodeErrors.add();
+        return true; // сигнал не дописан или поврежден
+    }
+    span.finish(); // обработка сигнала - отдельные интервалы
+    handleSignal<T>(a_peer, signal);
     return true;
 }
 
 template<typename T> void Signaling::handleSignal(QTcpSocket *, const T &)
 {
-    throw std::exception("Signaling.handleSignal: undefined signal handler");
+    throw std::runtime_error("Signaling.handleSignal: undefined signal handler");
+}
+
+void Signaling::dispatchSignal(TopicId a_topic, const QVariant &a_value, QTcpSocket *a_peer)
+{
+    auto subscription = m_subscriptions.find(a_topic);
+    if (subscription == m_subscriptions.end())
+        return; // подписка уже отменена
+    // обработчики в других потоках получают сигнал через очередь событий и трассируются отдельно
+    TraceSpan span("Signaling.dispatch", "signaling");
+    if (!subscription->second.m_handler)
+    {
+        emit signalReceived(getTopicName(a_topic), a_value, a_peer);
+        return;
+    }
+    auto context = subscription->second.m_context.data();
+    if (context == nullptr)
+        return; // получатель уничтожен
+    // копия: обработчик может отменить подписку
+    auto handler = subscription->second.m_handler;
+    if (context->thread() == QThread::currentThread())
+        handler(a_value, a_peer);
+    else
+        QMetaObject::invokeMethod(context, [handler, a_value, a_peer] { handler(a_value, a_peer); }, Qt::QueuedConnection);
+}
+
+template<> void Signaling::handleSignal(QTcpSocket *a_peer, const DataSignal &a_data)
+{
+    // тема, на которую подписан этот узел, уже добавлена, поэтому имена из сигналов не добавляются
+    auto topic = findTopicId(a_data.m_name);
+    if (topic.has_value())
+        dispatchSignal(topic.value(), a_data.m_value, a_peer);
 }
 
-template<> void Signaling::handleSignal(QTcpSocket *, const DataSignal &a_data)
+template<> void Signaling::handleSignal(QTcpSocket *a_peer, const TopicDataSignal &a_data)
 {
-    emit signalReceived(a_data.m_name, a_data.m_value);
+    auto &peerTopics = m_peerTopics[a_peer];
+    auto it = peerTopics.find(a_data.m_topic);
+    if (it == peerTopics.end())
+        return; // неизвестная тема
+    dispatchSignal(it->second, a_data.m_value, a_peer);
 }
 
 template<> void Signaling::handleSignal(QTcpSocket *a_peer, const SubscribeSignal &a_data)
 {
-    m_peerSubscriptions[a_peer].insert(a_data.m_name);
+    auto topic = getRemoteTopicId(a_data.m_name);
+    if (m_subscribers[topic].insert(a_peer).second)
+        countCompressionSubscriber(topic, a_peer, 1);
+    m_peerSubscriptions[a_peer].insert(topic);
+    if (m_blockedPeers.find(a_peer) != m_blockedPeers.end())
+        updateBlockedTopics();
+    // сообщаем идентификатор темы до отправки ее данных
+    a_peer->write(signalToByteArray(TopicSignal(a_data.m_name, topic)));
+    emit subscriberAdded(topic, a_peer);
 }
 
 template<> void Signaling::handleSignal(QTcpSocket *a_peer, const UnsubscribeSignal &a_data)
 {
-    m_peerSubscriptions[a_peer].remove(a_data.m_name);
+    auto topic = findTopicId(a_data.m_name);
+    if (!topic.has_value() || m_peerSubscriptions[a_peer].erase(topic.value()) == 0)
+        return;
+    removeSubscriber(topic.value(), a_peer);
+    if (m_blockedPeers.find(a_peer) != m_blockedPeers.end())
+        updateBlockedTopics();
+}
+
+template<> void Signaling::handleSignal(QTcpSocket *a_peer, const TopicSignal &a_data)
+{
+    // идентификаторы принимаются только для тем, на которые подписан этот узел
+    auto topic = findTopicId(a_data.m_name);
+    if (topic.has_value() && m_subscriptions.find(topic.value()) != m_subscriptions.end())
+        m_peerTopics[a_peer][a_data.m_topic] = topic.value();
+}
+
+template<> void Signaling::handleSignal(QTcpSocket *, const KeepAliveSignal &)
+{
+    // время получения уже обновлено в onDataReceived
+}
+
+template<> void Signaling::handleSignal(QTcpSocket *a_peer, const BulkChunkSignal &a_data)
+{
+    auto &input = m_bulkInputs[a_peer];
+    if (input.size() + a_data.m_data.size() > m_maxMessageSize)
+    {
+        // собранный сигнал занял бы слишком много памяти
+        g_oversizedMessages.add();
+        removePeer(a_peer);
+        a_peer->abort();
+        return;
+    }
+    input.append(a_data.m_data);
+    if (!a_data.m_last)
+        return;
+    auto message = std::move(input);
+    m_bulkInputs.erase(a_peer);
+    handleMessage(a_peer, message);
+}
+
+template<> void Signaling::handleSignal(QTcpSocket *a_peer, const CapabilitiesSignal &a_data)
+{
+    // подписки узла учитываются в m_compressionSubscriberCounts с его прежними возможностями
+    for (auto topic : m_peerSubscriptions[a_peer])
+        countCompressionSubscriber(topic, a_peer, -1);
+    auto capabilities = m_peerCapabilities.find(a_peer);
+    if (capabilities != m_peerCapabilities.end())
+        countPeerCapabilities(capabilities->second, -1);
+    m_peerCapabilities[a_peer] = a_data.m_capabilities;
+    countPeerCapabilities(a_data.m_capabilities, 1);
+    for (auto topic : m_peerSubscriptions[a_peer])
+        countCompressionSubscriber(topic, a_peer, 1);
+}
+
+template<> void Signaling::handleSignal(QTcpSocket *a_peer, const CompressedSignal &a_data)
+{
+    // qUncompress выделяет память под размер из заголовка данных, поэтому он проверяется заранее
+    if (a_data.m_data.size() < 4 || qFromBigEndian<quint32>(a_data.m_data.constData()) > m_maxMessageSize)
+    {
+        g_oversizedMessages.add();
+        removePeer(a_peer);
+        a_peer->abort();
+        return;
+    }
+    TraceSpan span("Signaling.decompress", "signaling");
+    span.setArgument("bytes", a_data.m_data.size());
+    auto message = qUncompress(a_data.m_data);
+    span.finish();
+    if (message.isEmpty())
+    {
+        g_decodeErrors.add(); // поврежденные данные
+        return;
+    }
+    handleMessage(a_peer, message);
 }
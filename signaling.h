@@ -2,50 +2,225 @@
 #define SIGNALING_H
 
 #include <set>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
+#include <optional>
+#include <atomic>
+#include <functional>
 #include <QObject>
 #include <QVariant>
 #include <QHostAddress>
 #include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QPointer>
 #include "block_queue.h"
 
-class QTcpSocket;
+class MetricCounter;
+class MetricGauge;
 
+// Сигнализация между узлами.
+// Может работать в отдельном потоке: открытые методы можно вызывать из любого потока,
+// вызовы из других потоков выполняются в потоке Signaling в порядке поступления.
 class Signaling : public QObject
 {
     Q_OBJECT
+    friend class SignalingBenchmark;
 
 public:
-    bool start();
+    // идентификатор темы, действительный только на этом узле
+    using TopicId = quint32;
+    // обработчик сигналов одной темы
+    using Handler = std::function<void(const QVariant &a_value, QTcpSocket *a_peer)>;
+
+    // Сигналы Control отправляются сразу, а Bulk - частями, между которыми проходят сигналы Control,
+    // поэтому сообщения не ждут передачи больших массивов данных через то же соединение.
+    enum class Priority
+    {
+        Control,
+        Bulk
+    };
+
+    // Сигнал, сериализованный во всех форматах, которые могут понадобиться подписчикам.
+    struct PreparedSignal
+    {
+        QByteArray m_message;
+        // для узлов, принимающих сжатые сигналы; пустой, если сжимать не нужно
+        QByteArray m_compressedMessage;
+        // DataSignal с именем темы и атрибутами по именам (AttributeContainer) для узлов прежних версий;
+        // пустой, если не нужен
+        QByteArray m_legacyMessage;
+    };
+
+    // a_port = 0 - любой свободный порт
+    bool start(quint16 a_port = 0);
     quint16 getPort();
-    void sendSignal(const QString &a_name, const QVariant &a_value);
+    TopicId getTopicId(const QString &a_name);
+    // a_legacyValue - значение для узлов прежних версий, если оно отличается от a_value
+    void sendSignal(TopicId a_topic, const QVariant &a_value, Priority a_priority = Priority::Control, const QVariant &a_legacyValue = QVariant());
+    void sendSignal(const QString &a_name, const QVariant &a_value, Priority a_priority = Priority::Control);
+    // сигнал с атрибутами (AttributeSignal); прежний формат формируется, только если есть узлы прежних версий
+    template<typename T> void sendSignal(const QString &a_name, const T &a_signal, Priority a_priority = Priority::Control)
+    {
+        sendSignal(getTopicId(a_name), a_signal.toQVariant(), a_priority, m_legacyPeerCount > 0 ? a_signal.toLegacyQVariant() : QVariant());
+    }
+    // подготовленный сигнал можно отправлять многократно, пока не изменятся его данные
+    PreparedSignal prepareSignal(TopicId a_topic, const QVariant &a_value, const QVariant &a_legacyValue = QVariant());
+    template<typename T> PreparedSignal prepareSignal(TopicId a_topic, const T &a_signal)
+    {
+        // прежний формат нужен всегда: узлы прежних версий могут подключиться, пока сигнал используется
+        return prepareSignal(a_topic, a_signal.toQVariant(), a_signal.toLegacyQVariant());
+    }
+    // a_peer - отправка только одному подписчику
+    void sendPreparedSignal(TopicId a_topic, const PreparedSignal &a_signal, QTcpSocket *a_peer = nullptr);
+    // отправка только подписчикам прежних версий (без CompactAttributes или TopicIds)
+    void sendPreparedSignalToLegacyPeers(TopicId a_topic, const PreparedSignal &a_signal);
+    bool hasLegacyPeers() const;
+    // сигналы темы передаются в signalReceived
     void subscribe(const QString &a_name);
+    // сигналы темы передаются только обработчику, без signalReceived и сравнения имен тем получателями;
+    // обработчик вызывается в потоке a_context и не вызывается после его уничтожения
+    void subscribe(const QString &a_name, QObject *a_context, Handler a_handler);
     void unsubscribe(const QString &a_name);
+    // узел отключается, если от него ничего не приходило a_missedIntervals интервалов подряд
+    void setKeepAlive(int a_interval, int a_missedIntervals);
+    // false, если очередь сигналов Bulk какого-либо подписчика темы заполнена или слишком много сигналов Bulk
+    // еще не передано в поток Signaling; отправитель должен дождаться сигнала writable, иначе память будет расти с каждым сигналом
+    bool isWritable(TopicId a_topic);
 
 public slots:
     void addPeer(QHostAddress a_address, quint16 a_port);
 
 signals:
-    void signalReceived(QString a_name, QVariant a_value);
+    void signalReceived(QString a_name, QVariant a_value, QTcpSocket *a_peer);
+    void subscriberAdded(Signaling::TopicId a_topic, QTcpSocket *a_peer);
+    void peerDisconnected(QTcpSocket *a_peer);
+    // очередь Bulk одного из узлов освободилась, isWritable мог измениться
+    void writable();
 
 private slots:
     void onClientConencted();
     void onConnectedToHost();
+    void onConnectionFailed();
     void onPeerDisconnected();
     void onDataReceived();
+    void onBytesWritten(qint64 a_bytes);
+    void checkPeers();
 
 private:
     static QHostAddress getThisSubnetAddress(const QHostAddress &a_anotherAddress);
 
+    template<typename F> bool invokeInOwnThread(F &&a_function);
+    QByteArray compressMessage(const QByteArray &a_message) const;
+    void sendMessage(TopicId a_topic, const PreparedSignal &a_signal, Priority a_priority);
+    QString getTopicName(TopicId a_topic);
+    TopicId addTopic(const QString &a_name);
+    TopicId getRemoteTopicId(const QString &a_name);
+    std::optional<TopicId> findTopicId(const QString &a_name);
+    void removeSubscriber(TopicId a_topic, QTcpSocket *a_peer);
+    void dispatchSignal(TopicId a_topic, const QVariant &a_value, QTcpSocket *a_peer);
     void addSocket(QTcpSocket *a_socket);
-    template<typename T> QByteArray signalToByteArray(const T &a_signal);
+    void removePeer(QTcpSocket *a_peer);
+    quint32 getPeerCapabilities(QTcpSocket *a_peer) const;
+    void countPeerCapabilities(quint32 a_capabilities, int a_delta);
+    bool hasCompressionSubscribers(TopicId a_topic);
+    void countCompressionSubscriber(TopicId a_topic, QTcpSocket *a_peer, int a_delta);
+    const QByteArray &selectMessage(QTcpSocket *a_peer, const PreparedSignal &a_signal) const;
+    void writeToPeers(const std::set<QTcpSocket *> &a_peers, const PreparedSignal &a_signal, Priority a_priority = Priority::Control);
+    void writeBulkData(QTcpSocket *a_peer);
+    void releaseQueuedBulkSize(qint64 a_size);
+    void handleMessage(QTcpSocket *a_peer, const QByteArray &a_message);
+    void updateBlockedTopics();
+    void createPeerMetrics(QTcpSocket *a_peer);
+    void removePeerMetrics(QTcpSocket *a_peer);
     template<typename T> bool tryHandleSignal(QTcpSocket *a_peer, char a_code, QDataStream &a_stream);
     template<typename T> void handleSignal(QTcpSocket *a_peer, const T &a_signal);
 
     std::unique_ptr<QTcpServer> m_server;
-    std::set<QString> m_subscriptions;
+    // имена тем по идентификаторам и идентификаторы по именам
+    QMutex m_topicMutex;
+    QHash<TopicId, QString> m_topicNames;
+    QHash<QString, TopicId> m_topicIds;
+    // идентификаторы освобожденных тем не используются повторно
+    TopicId m_nextTopicId = 0;
+    // темы, которые публикует или на которые подписан этот узел; остальные темы известны только по подпискам
+    // других узлов и освобождаются вместе с последней из них
+    std::unordered_set<TopicId> m_localTopics;
+    // темы, на которые подписан этот узел, и их обработчики
+    struct Subscription
+    {
+        QPointer<QObject> m_context;
+        Handler m_handler;
+    };
+    std::unordered_map<TopicId, Subscription> m_subscriptions;
     std::set<QTcpSocket *> m_peers;
+    // исходящие соединения, которые еще устанавливаются, и адреса, к которым они подключаются
+    std::map<QTcpSocket *, std::pair<QHostAddress, quint16>> m_connectingSockets;
+    // время последнего получения данных от узлов по m_clock
+    std::map<QTcpSocket *, qint64> m_lastReceived;
+    QElapsedTimer m_clock;
+    std::unique_ptr<QTimer> m_keepAliveTimer;
+    int m_keepAliveInterval = 5000;
+    int m_missedKeepAliveIntervals = 3;
     std::map<QTcpSocket *, MessageQueue> m_socketData;
-    std::map<QTcpSocket *, QSet<QString>> m_peerSubscriptions;
+    // сигналы Bulk, ожидающие отправки, и смещение в первом из них
+    struct BulkOutput
+    {
+        std::deque<QByteArray> m_messages;
+        qsizetype m_offset = 0;
+        // неотправленный объем
+        qint64 m_size = 0;
+    };
+    std::map<QTcpSocket *, BulkOutput> m_bulkOutputs;
+    // принимаемые по частям сигналы Bulk
+    std::map<QTcpSocket *, QByteArray> m_bulkInputs;
+    // узел, приславший сообщение больше этого размера, отключается
+    qint64 m_maxMessageSize = 64 * 1024 * 1024;
+    // размер части сигнала Bulk; сигнал Control ждет не больше одной части
+    qsizetype m_bulkChunkSize = 16 * 1024;
+    // части добавляются в буфер записи сокета, пока он меньше этого размера
+    qint64 m_bulkBufferLimit = 64 * 1024;
+    // ограничение буфера отправки системы, в котором сигналы Control тоже ждали бы данных Bulk
+    int m_socketSendBufferSize = 256 * 1024;
+    // при таком объеме очереди Bulk узел считается заполненным, а при вдвое меньшем - снова свободным
+    qint64 m_maxBulkQueueSize = 8 * 1024 * 1024;
+    // объем сигналов Bulk, отправленных из других потоков и еще не добавленных в очереди узлов
+    std::atomic<qint64> m_queuedBulkSize = 0;
+    std::set<QTcpSocket *> m_blockedPeers;
+    // темы, у которых есть заполненные подписчики; читаются из других потоков в isWritable
+    QMutex m_blockedTopicsMutex;
+    std::set<TopicId> m_blockedTopics;
+    // возможности узлов, объявленные в CapabilitiesSignal
+    std::map<QTcpSocket *, quint32> m_peerCapabilities;
+    // количество узлов, принимающих сжатые сигналы; если их нет, сигналы не сжимаются
+    std::atomic<int> m_compressionPeerCount = 0;
+    // количество подписчиков тем, принимающих сжатые сигналы; читается из других потоков в prepareSignal,
+    // сигналы тем без таких подписчиков не сжимаются
+    QMutex m_compressionTopicsMutex;
+    std::unordered_map<TopicId, int> m_compressionSubscriberCounts;
+    // количество узлов прежних версий (без CompactAttributes или TopicIds); если их нет, прежний формат не формируется
+    std::atomic<int> m_legacyPeerCount = 0;
+    bool m_compression = true;
+    // более короткие сигналы не сжимаются
+    qsizetype m_minCompressedSize = 1024;
+    // подписчики тем
+    std::unordered_map<TopicId, std::set<QTcpSocket *>> m_subscribers;
+    // темы, на которые подписаны узлы
+    std::map<QTcpSocket *, std::set<TopicId>> m_peerSubscriptions;
+    // идентификаторы тем, назначенные узлами, и соответствующие им идентификаторы этого узла
+    std::map<QTcpSocket *, std::unordered_map<TopicId, TopicId>> m_peerTopics;
+    // метрики узлов (Metrics), удаляются при отключении
+    struct PeerMetrics
+    {
+        MetricCounter *m_receivedBytes = nullptr;
+        MetricCounter *m_sentBytes = nullptr;
+        MetricGauge *m_receiveQueueSize = nullptr;
+        MetricGauge *m_bulkQueueSize = nullptr;
+    };
+    std::map<QTcpSocket *, PeerMetrics> m_peerMetrics;
 };
 
 #endif // SIGNALING_H
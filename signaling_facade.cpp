@@ -1,7 +1,10 @@
+#include <QCoreApplication>
 #include "signaling_facade.h"
 
 SignalingFacade::SignalingFacade(quint16 a_port)
 {
+    m_metricsExporter.start();
+
     m_signaling = std::make_shared<Signaling>();
     if (!m_signaling->start())
     {
@@ -17,4 +20,51 @@ SignalingFacade::SignalingFacade(quint16 a_port)
     QObject::connect(&m_detectionServer, &DetectionServer::peerFound, m_signaling.get(), &Signaling::addPeer);
 
     m_seekerClient.start(m_signaling->getPort(), a_port);
+
+    m_networkThread.setObjectName("Signaling");
+    m_networkThread.start();
+    m_signaling->moveToThread(&m_networkThread);
+}
+
+SignalingFacade::~SignalingFacade()
+{
+    stopThreads();
+}
+
+void SignalingFacade::moveToFileThread(QObject *a_object)
+{
+    if (!m_fileThread.isRunning())
+    {
+        m_fileThread.setObjectName("FileSignaling");
+        m_fileThread.start();
+    }
+    a_object->moveToThread(&m_fileThread);
+    m_fileThreadObjects.push_back(a_object);
+}
+
+void SignalingFacade::stopThreads()
+{
+    // объекты удаляются в основном потоке, поэтому перед остановкой потоков возвращаются в него
+    for (auto object : m_fileThreadObjects)
+        moveToMainThread(object);
+    m_fileThreadObjects.clear();
+    if (m_signaling != nullptr && m_signaling->thread() == &m_networkThread)
+        moveToMainThread(m_signaling.get());
+    m_fileThread.quit();
+    m_fileThread.wait();
+    m_networkThread.quit();
+    m_networkThread.wait();
+}
+
+// private:
+void SignalingFacade::moveToMainThread(QObject *a_object)
+{
+    auto mainThread = QCoreApplication::instance()->thread();
+    if (a_object->thread() == mainThread)
+        return;
+    // moveToThread можно вызвать только из текущего потока объекта
+    QMetaObject::invokeMethod(a_object, [a_object, mainThread]
+        {
+            a_object->moveToThread(mainThread);
+        }, Qt::BlockingQueuedConnection);
 }
@@ -1,21 +1,36 @@
 #pragma once
 
+#include <QThread>
 #include "signaling.h"
 #include "detection_server.h"
 #include "seeker_client.h"
+#include "metrics.h"
 
 class SignalingFacade
 {
 public:
     SignalingFacade(quint16 a_port = 1234);
+    ~SignalingFacade();
 
     std::shared_ptr<Signaling> getSignaling()
     {
         return m_signaling;
     }
 
+    // переносит объект в поток работы с файлами
+    void moveToFileThread(QObject *a_object);
+    // возвращает объекты в основной поток и останавливает рабочие потоки
+    void stopThreads();
+
 private:
+    static void moveToMainThread(QObject *a_object);
+
     DetectionServer m_detectionServer;
     SeekerClient m_seekerClient;
     std::shared_ptr<Signaling> m_signaling;
+    // разбор сообщений и работа с сокетами выполняются вне потока интерфейса
+    QThread m_networkThread;
+    QThread m_fileThread;
+    std::vector<QObject *> m_fileThreadObjects;
+    MetricsExporter m_metricsExporter;
 };
@@ -0,0 +1,240 @@
+﻿#pragma once
+
+#include <QBuffer>
+#include <QDataStream>
+#include "signaling.h"
+
+// Сигналы протокола Signaling. Сообщение состоит из размера (MessageQueue::MessageSize),
+// кода сигнала (g_signalCode) и данных сигнала в формате QDataStream.
+
+// Данные темы с ее именем. Узлы прежних версий отправляют и принимают только такие сигналы.
+struct DataSignal
+{
+    explicit DataSignal(const QString &a_name, const QVariant &a_value)
+    {
+        m_name = a_name;
+        m_value = a_value;
+    }
+
+    explicit DataSignal(QDataStream &a_stream)
+    {
+        a_stream >> m_name >> m_value;
+    }
+
+    void toQDataStream(QDataStream &a_stream) const
+    {
+        a_stream << m_name << m_value;
+    }
+
+    static constexpr char g_signalCode = 0;
+    QString m_name;
+    QVariant m_value;
+};
+
+//-------------------------------------------------------------------------------------------------
+struct SubscribeSignal
+{
+    explicit SubscribeSignal(const QString &a_name)
+    {
+        m_name = a_name;
+    }
+
+    explicit SubscribeSignal(QDataStream &a_stream)
+    {
+        a_stream >> m_name;
+    }
+
+    void toQDataStream(QDataStream &a_stream) const
+    {
+        a_stream << m_name;
+    }
+
+    static constexpr char g_signalCode = 1;
+    QString m_name;
+};
+
+//-------------------------------------------------------------------------------------------------
+struct UnsubscribeSignal
+{
+    explicit UnsubscribeSignal(const QString &a_name)
+    {
+        m_name = a_name;
+    }
+
+    explicit UnsubscribeSignal(QDataStream &a_stream)
+    {
+        a_stream >> m_name;
+    }
+
+    void toQDataStream(QDataStream &a_stream) const
+    {
+        a_stream << m_name;
+    }
+
+    static constexpr char g_signalCode = 2;
+    QString m_name;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Ответ на подписку: идентификатор, которым отправитель будет помечать данные темы.
+struct TopicSignal
+{
+    explicit TopicSignal(const QString &a_name, Signaling::TopicId a_topic)
+    {
+        m_name = a_name;
+        m_topic = a_topic;
+    }
+
+    explicit TopicSignal(QDataStream &a_stream)
+    {
+        a_stream >> m_name >> m_topic;
+    }
+
+    void toQDataStream(QDataStream &a_stream) const
+    {
+        a_stream << m_name << m_topic;
+    }
+
+    static constexpr char g_signalCode = 3;
+    QString m_name;
+    Signaling::TopicId m_topic;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Проверка соединения. Отправляется каждому узлу раз в интервал, чтобы узел знал, что соединение активно.
+struct KeepAliveSignal
+{
+    KeepAliveSignal() {}
+
+    explicit KeepAliveSignal(QDataStream &) {}
+
+    void toQDataStream(QDataStream &) const {}
+
+    static constexpr char g_signalCode = 4;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Часть сигнала с приоритетом Bulk: сообщение без размера, разделенное на части.
+// Части одного сигнала идут подряд, между ними могут быть только сигналы Control.
+// Отправляется только узлам с возможностью BulkChunks.
+struct BulkChunkSignal
+{
+    explicit BulkChunkSignal(bool a_last, const QByteArray &a_data)
+    {
+        m_last = a_last;
+        m_data = a_data;
+    }
+
+    explicit BulkChunkSignal(QDataStream &a_stream)
+    {
+        a_stream >> m_last >> m_data;
+    }
+
+    void toQDataStream(QDataStream &a_stream) const
+    {
+        a_stream << m_last << m_data;
+    }
+
+    static constexpr char g_signalCode = 5;
+    bool m_last = false;
+    QByteArray m_data;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Возможности узла. Отправляется при подключении; узлы прежних версий игнорируют неизвестный код.
+// Узел, не приславший этот сигнал, не поддерживает ни одной из возможностей.
+struct CapabilitiesSignal
+{
+    enum Capability : quint32
+    {
+        Compression = 1,
+        // сигналы с атрибутами в компактном формате (AttributeSignal::toQVariant), иначе - AttributeContainer
+        CompactAttributes = 2,
+        // данные тем с идентификаторами (TopicDataSignal), иначе - с именами (DataSignal)
+        TopicIds = 4,
+        // сигналы Bulk частями (BulkChunkSignal), иначе - целыми сообщениями
+        BulkChunks = 8
+    };
+
+    explicit CapabilitiesSignal(quint32 a_capabilities)
+    {
+        m_capabilities = a_capabilities;
+    }
+
+    explicit CapabilitiesSignal(QDataStream &a_stream)
+    {
+        a_stream >> m_capabilities;
+    }
+
+    void toQDataStream(QDataStream &a_stream) const
+    {
+        a_stream << m_capabilities;
+    }
+
+    static constexpr char g_signalCode = 6;
+    quint32 m_capabilities = 0;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Сжатое сообщение без размера (qCompress). Отправляется только узлам с возможностью Compression.
+struct CompressedSignal
+{
+    explicit CompressedSignal(const QByteArray &a_data)
+    {
+        m_data = a_data;
+    }
+
+    explicit CompressedSignal(QDataStream &a_stream)
+    {
+        a_stream >> m_data;
+    }
+
+    void toQDataStream(QDataStream &a_stream) const
+    {
+        a_stream << m_data;
+    }
+
+    static constexpr char g_signalCode = 7;
+    QByteArray m_data;
+};
+
+//-------------------------------------------------------------------------------------------------
+// Данные темы. Тема задается идентификатором, назначенным отправителем (см. TopicSignal).
+// Отправляется только узлам с возможностью TopicIds.
+struct TopicDataSignal
+{
+    explicit TopicDataSignal(Signaling::TopicId a_topic, const QVariant &a_value)
+    {
+        m_topic = a_topic;
+        m_value = a_value;
+    }
+
+    explicit TopicDataSignal(QDataStream &a_stream)
+    {
+        a_stream >> m_topic >> m_value;
+    }
+
+    void toQDataStream(QDataStream &a_stream) const
+    {
+        a_stream << m_topic << m_value;
+    }
+
+    static constexpr char g_signalCode = 8;
+    Signaling::TopicId m_topic;
+    QVariant m_value;
+};
+
+//-------------------------------------------------------------------------------------------------
+template<typename T> QByteArray signalToByteArray(const T &a_signal)
+{
+    // сигнал записывается сразу после места под размер сообщения
+    QByteArray result(sizeof(MessageQueue::MessageSize), Qt::Uninitialized);
+    QBuffer buffer(&result);
+    buffer.open(QIODevice::WriteOnly | QIODevice::Append);
+    QDataStream stream(&buffer);
+    stream << T::g_signalCode;
+    a_signal.toQDataStream(stream);
+    buffer.close();
+    MessageQueue::writeMessageSize(result);
+    return result;
+}
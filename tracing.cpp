@@ -0,0 +1,111 @@
+﻿#include <QCoreApplication>
+#include <QThread>
+#include <QSaveFile>
+#include <QJsonDocument>
+#include <QJsonArray>
+#include <QJsonObject>
+#include "tracing.h"
+#include "settings.h"
+
+Tracing &Tracing::get()
+{
+    static Tracing instance;
+    return instance;
+}
+
+void Tracing::setEnabled(bool a_enabled)
+{
+    if (a_enabled && !isEnabled())
+    {
+        for (size_t i = 0; i < m_capacity; i++)
+            m_events[i].m_sequence.store(0, std::memory_order_relaxed);
+        m_nextEvent.store(0, std::memory_order_relaxed);
+    }
+    m_enabled.store(a_enabled, std::memory_order_release);
+}
+
+// запись защищена номером, как seqlock: читатель пропускает событие, номер которого изменился при копировании
+void Tracing::addSpan(const char *a_name, const char *a_category, qint64 a_start, qint64 a_end, const char *a_argumentName, qint64 a_argument)
+{
+    auto number = m_nextEvent.fetch_add(1, std::memory_order_relaxed);
+    auto &event = m_events[number % m_capacity];
+    event.m_sequence.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    event.m_name = a_name;
+    event.m_category = a_category;
+    event.m_argumentName = a_argumentName;
+    event.m_argument = a_argument;
+    event.m_start = a_start;
+    event.m_duration = a_end - a_start;
+    event.m_thread = getThreadNumber();
+    event.m_sequence.store(number + 1, std::memory_order_release);
+}
+
+QByteArray Tracing::toJson() const
+{
+    QJsonArray events;
+    auto pid = QCoreApplication::applicationPid();
+    {
+        QMutexLocker locker(&m_threadMutex);
+        for (size_t i = 0; i < m_threadNames.size(); i++)
+            events.append(QJsonObject{ { "name", "thread_name" }, { "ph", "M" }, { "pid", pid }, { "tid", (int)i },
+                { "args", QJsonObject{ { "name", m_threadNames[i] } } } });
+    }
+    auto end = m_nextEvent.load(std::memory_order_acquire);
+    auto begin = end > m_capacity ? end - m_capacity : 0;
+    for (auto number = begin; number < end; number++)
+    {
+        auto &event = m_events[number % m_capacity];
+        if (event.m_sequence.load(std::memory_order_acquire) != number + 1)
+            continue;
+        auto name = event.m_name;
+        auto category = event.m_category;
+        auto argumentName = event.m_argumentName;
+        auto argument = event.m_argument;
+        auto start = event.m_start;
+        auto duration = event.m_duration;
+        auto thread = event.m_thread;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (event.m_sequence.load(std::memory_order_relaxed) != number + 1)
+            continue; // событие перезаписано при копировании
+        // время в формате Chrome trace event - в мкс
+        QJsonObject object{ { "name", name }, { "cat", category }, { "ph", "X" }, { "pid", pid }, { "tid", thread },
+            { "ts", start / 1000.0 }, { "dur", duration / 1000.0 } };
+        if (argumentName != nullptr)
+            object["args"] = QJsonObject{ { argumentName, argument } };
+        events.append(object);
+    }
+    return QJsonDocument(QJsonObject{ { "traceEvents", events }, { "displayTimeUnit", "ms" } }).toJson(QJsonDocument::Compact);
+}
+
+bool Tracing::save(const QString &a_fileName) const
+{
+    QSaveFile file(a_fileName);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.write(toJson());
+    return file.commit();
+}
+
+// private:
+Tracing::Tracing()
+{
+    m_capacity = std::max(Settings::get().value("TraceBufferSize", 65536).toLongLong(), 1024LL);
+    m_events.reset(new Event[m_capacity]);
+    m_enabled = Settings::get().value("TraceEnabled", false).toBool();
+}
+
+int Tracing::getThreadNumber()
+{
+    thread_local int number = -1;
+    if (number >= 0)
+        return number;
+    auto name = QThread::currentThread()->objectName();
+    QMutexLocker locker(&m_threadMutex);
+    number = (int)m_threadNames.size();
+    if (name.isEmpty())
+        name = QCoreApplication::instance() != nullptr && QThread::currentThread() == QCoreApplication::instance()->thread() ?
+            QString("Main") : QString("Thread %1").arg(number);
+    m_threadNames.push_back(name);
+    return number;
+}
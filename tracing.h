@@ -0,0 +1,108 @@
+﻿#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <QMutex>
+#include <QString>
+
+// Трассировка горячих путей.
+// Интервалы (span) записываются в кольцевой буфер фиксированного размера без блокировок: старые
+// записи вытесняются новыми. Буфер выгружается в формате Chrome trace event (chrome://tracing, Perfetto).
+// Выключенная трассировка стоит одной атомарной загрузки на интервал, поэтому ее можно включать
+// во время работы: настройка TraceEnabled, Tracing::setEnabled или --trace в loadgen.
+class Tracing
+{
+public:
+    static Tracing &get();
+
+    bool isEnabled() const
+    {
+        return m_enabled.load(std::memory_order_relaxed);
+    }
+
+    // включение очищает буфер
+    void setEnabled(bool a_enabled);
+
+    // монотонное время в нс, общее для процессов одного компьютера
+    static qint64 getTime()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // имена и категории - строковые литералы: в буфер записываются только указатели
+    void addSpan(const char *a_name, const char *a_category, qint64 a_start, qint64 a_end, const char *a_argumentName, qint64 a_argument);
+
+    // события буфера в формате Chrome trace event
+    QByteArray toJson() const;
+    bool save(const QString &a_fileName) const;
+
+private:
+    struct Event
+    {
+        // номер записи + 1; 0 - запись не завершена
+        std::atomic<quint64> m_sequence = 0;
+        const char *m_name = nullptr;
+        const char *m_category = nullptr;
+        const char *m_argumentName = nullptr;
+        qint64 m_argument = 0;
+        qint64 m_start = 0;
+        qint64 m_duration = 0;
+        int m_thread = 0;
+    };
+
+    Tracing();
+
+    int getThreadNumber();
+
+    std::atomic<bool> m_enabled = false;
+    size_t m_capacity = 0;
+    std::unique_ptr<Event[]> m_events;
+    std::atomic<quint64> m_nextEvent = 0;
+    mutable QMutex m_threadMutex;
+    // имена потоков по номерам, назначаемым при первой записи из потока
+    std::vector<QString> m_threadNames;
+};
+
+// Интервал от создания до уничтожения объекта
+class TraceSpan
+{
+public:
+    TraceSpan(const char *a_name, const char *a_category) :
+        m_name(a_name),
+        m_category(a_category),
+        m_start(Tracing::get().isEnabled() ? Tracing::getTime() : -1)
+    {
+    }
+
+    ~TraceSpan()
+    {
+        finish();
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+
+    // числовой параметр интервала, например размер сообщения
+    void setArgument(const char *a_name, qint64 a_value)
+    {
+        m_argumentName = a_name;
+        m_argument = a_value;
+    }
+
+    // завершение интервала до уничтожения объекта
+    void finish()
+    {
+        if (m_start < 0)
+            return;
+        Tracing::get().addSpan(m_name, m_category, m_start, Tracing::getTime(), m_argumentName, m_argument);
+        m_start = -1;
+    }
+
+private:
+    const char *m_name;
+    const char *m_category;
+    const char *m_argumentName = nullptr;
+    qint64 m_argument = 0;
+    qint64 m_start;
+};
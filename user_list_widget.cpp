@@ -1,11 +1,14 @@
 ﻿#include <QInputDialog>
 #include <QUuid>
 #include <QFileDialog>
+#include <QMessageBox>
+#include <QFileInfo>
 #include "user_list_widget.h"
 #include "ui_user_list_widget.h"
 #include "signaling.h"
 #include "resource_holder.h"
 #include "settings.h"
+#include "tracing.h"
 
 UserListWidget::UserListWidget(std::shared_ptr<MessengerSignaling> a_signaling, std::shared_ptr<FileSignaling> a_fileSignaling, QWidget *a_parent) :
     QWidget(a_parent, Qt::Window | Qt::CustomizeWindowHint | Qt::WindowMinimizeButtonHint | Qt::WindowCloseButtonHint),
@@ -28,6 +31,11 @@ UserListWidget::UserListWidget(std::shared_ptr<MessengerSignaling> a_signaling,
     m_actions = new QMenu(this);
     m_actions->addAction(ResourceHolder::get().getMessageIcon(), "Send message...", this, &UserListWidget::sendMessage);
     m_actions->addAction(ResourceHolder::get().getFileIcon(), "Send file...", this, &UserListWidget::sendFile);
+    // трассировка включается и выключается во время работы, при выключении буфер сохраняется в файл
+    auto traceAction = new QAction(this);
+    traceAction->setShortcut(QKeySequence("Ctrl+Shift+T"));
+    addAction(traceAction);
+    connect(traceAction, &QAction::triggered, this, &UserListWidget::toggleTracing);
     connect(&m_blinkTimer, &QTimer::timeout, this, &UserListWidget::changeIcons);
     m_blinkTimer.start(500);
 
@@ -51,6 +59,21 @@ UserListWidget::~UserListWidget()
 }
 
 // private slots:
+void UserListWidget::toggleTracing()
+{
+    if (!Tracing::get().isEnabled())
+    {
+        Tracing::get().setEnabled(true);
+        return;
+    }
+    Tracing::get().setEnabled(false);
+    auto fileName = QFileInfo(Settings::get().value("TraceFile", "trace.json").toString()).absoluteFilePath();
+    if (Tracing::get().save(fileName))
+        QMessageBox::information(this, "Tracing", QString("Trace is saved to %1").arg(fileName));
+    else
+        QMessageBox::warning(this, "Tracing", QString("Cannot write %1").arg(fileName));
+}
+
 void UserListWidget::logon()
 {
     QString name = QInputDialog::getText(this, "User name", "Type your name", QLineEdit::Normal, Settings::get().value("Name").toString());
@@ -25,6 +25,7 @@ public:
     ~UserListWidget();
 
 private slots:
+    void toggleTracing();
     void logon();
     void setOnline();
     void setOffline();